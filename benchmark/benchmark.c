@@ -30,6 +30,7 @@ Benchmarking suite for 2D data structures
  * vid - the virtual ID for the thread
  * actives - buffer for already-active points
  * active_size - size of active points buffer
+ * rlu - the RLU record of the thread, freed by the parent thread once every thread exits
  * ready - the bit for the thread to say it's ready
  */
 typedef volatile struct {
@@ -39,6 +40,7 @@ typedef volatile struct {
     uint64_t vid;
     Point *actives;
     uint64_t active_size;
+    rlu_thread_data_t *rlu;
     bool ready;
 } OperationPacket;
 
@@ -59,12 +61,14 @@ void* execute(void *op) {
     const uint64_t npoints = min(2 * packet->active_size, 1000);
     Point *pbuffer = (Point*)malloc(sizeof(*pbuffer) * npoints);  // ``active" points
     uint64_t head = 0, tail = 0;
-    for (head = 0; head < npoints; head++)
+    // one slot stays empty, to tell a full buffer from an empty one
+    for (head = 0; head < min(packet->active_size, npoints - 1); head++)
         pbuffer[head] = packet->actives[head];
 
     // set up RLU
     rlu_self = (rlu_thread_data_t*)malloc(sizeof(*rlu_self));
     RLU_THREAD_INIT(rlu_self);
+    packet->rlu = rlu_self;
 
     packet->ready = true;
 
@@ -132,7 +136,6 @@ void* execute(void *op) {
 
     // end RLU on thread
     RLU_THREAD_FINISH(rlu_self);
-    free(rlu_self);
 
     // ensure thread exits
     pthread_exit(0);
@@ -151,7 +154,9 @@ void test_random(const uint64_t seconds) {
     Point root_point;
     for (i = 0; i < D; i++)
         root_point.data[i] = 0;
+#ifndef BULK_LOAD
     TYPE *root = CONSTRUCTOR(length, root_point);
+#endif
 
     test_rand_off();
 
@@ -203,12 +208,16 @@ void test_random(const uint64_t seconds) {
         register uint64_t j;
         for (j = 0; j < D; j++)
             initial_actives[i].data[j] = (random() - 0.5) * length;
+#ifndef BULK_LOAD
         INSERT(root, initial_actives[i]);
+#endif
     }
+#ifdef BULK_LOAD
+    TYPE *root = BULK_LOAD(initial_actives, initial_population, length, root_point);
+#endif
+    // the record is freed at exit, since RLU syncs keep reading the records of finished threads
     RLU_THREAD_FINISH(rlu_self);
 
-    free(rlu_self);
-
 #ifdef VERBOSE
     printf("Running for %llu seconds\n", (unsigned long long)seconds);
 #endif
@@ -237,6 +246,7 @@ void test_random(const uint64_t seconds) {
             .vid = i,
             .actives = initial_actives + i * actives_per_thread,
             .active_size = actives_per_thread,
+            .rlu = NULL,
             .ready = false
         };
     }
@@ -319,6 +329,8 @@ void test_random(const uint64_t seconds) {
 #endif
 
     free(initial_actives);
+    for (i = 0; i < nthreads; i++)
+        free(packets[i].rlu);
     pthread_mutex_attr_destroy();
     pthread_exit(0);
 }
@@ -367,6 +379,7 @@ int main(int argc, char* argv[]) {
     printf("\nOptional:\n");
     printf("-DCLEANUP (the cleanup function, takes no argument)\n");
     printf("-DINITIAL (initial population, defaults to 1,000,000 nodes)\n");
+    printf("-DBULK_LOAD (builds the initial population at once, given points, count, length and center)\n");
     printf("-DMTRACE (define to enable mtrace)\n");
     printf("-DPARALLEL (use pthreads to run in parallel; serial otherwise)\n");
     printf("-DNTHREADS (number of threads to use, defaults to 1)\n");
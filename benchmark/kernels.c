@@ -0,0 +1,81 @@
+/**
+Microbenchmark for the per-node kernels of the Quadtree
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "Quadtree.h"
+
+// number of squares and points cycled through, few enough to stay in L1/L2
+#define NUM_NODES 1024
+// number of kernel calls timed
+#define NUM_CALLS (1LL << 26)
+
+#if defined(SIMD_AVX2)
+#define KERNELS "avx2"
+#elif defined(SIMD_SSE2)
+#define KERNELS "sse2"
+#else
+#define KERNELS "scalar"
+#endif
+
+#if defined(INTEGER_GRID)
+#define COORDS "int64"
+#elif defined(FLOAT32_COORDS)
+#define COORDS "float32"
+#else
+#define COORDS "float64"
+#endif
+
+static Node nodes[NUM_NODES];
+static Point points[NUM_NODES];
+
+/*
+ * now
+ *
+ * Returns the current monotonic time in seconds.
+ */
+static float64_t now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+    register uint64_t i, j, sum = 0;
+    float64_t start, in_range_time, get_quadrant_time;
+
+    // squares of random size around random centers, each with a point in a random quadrant;
+    // as in a search, most points are in their square, and the rest are just outside of it
+    // in one dimension
+    srand(0);
+    for (i = 0; i < NUM_NODES; i++) {
+        nodes[i].is_square = true;
+        nodes[i].length = (coord_t)(1LL << (4 + rand() % 20));
+        for (j = 0; j < D; j++) {
+            nodes[i].center.data[j] = (coord_t)(rand() % (1 << 24));
+            points[i].data[j] = nodes[i].center.data[j] + (rand() % 2 ? 1 : -1) *
+                (coord_t)(nodes[i].length / 4);
+        }
+        if (rand() % 4 == 0)
+            points[i].data[rand() % D] += nodes[i].length;
+    }
+
+    start = now();
+    for (i = 0; i < NUM_CALLS; i++)
+        sum += in_range(&nodes[i % NUM_NODES], &points[i % NUM_NODES]);
+    in_range_time = now() - start;
+
+    start = now();
+    for (i = 0; i < NUM_CALLS; i++)
+        sum += get_quadrant(&nodes[i % NUM_NODES].center, &points[i % NUM_NODES]);
+    get_quadrant_time = now() - start;
+
+    printf("D = %llu, coords = %-7s kernels = %-6s in_range: %6.2lf ns, get_quadrant: %6.2lf ns (checksum %llu)\n",
+        (unsigned long long)D, COORDS, KERNELS, in_range_time / NUM_CALLS * 1e9,
+        get_quadrant_time / NUM_CALLS * 1e9, (unsigned long long)sum);
+
+    return 0;
+}
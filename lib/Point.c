@@ -8,7 +8,12 @@ Point Point_from_array(float64_t data[D]) {
     Point p;
     uint64_t i;
     for (i = 0; i < D; i++) {
+#ifdef INTEGER_GRID
+        register float64_t scaled = data[i] * GRID_RESOLUTION;
+        p.data[i] = scaled < 0 ? -(coord_t)(0.5 - scaled) : (coord_t)(scaled + 0.5);
+#else
         p.data[i] = data[i];
+#endif
     }
     return p;
 }
@@ -16,16 +21,33 @@ Point Point_from_array(float64_t data[D]) {
 int8_t Point_compare(const Point *a, const Point *b) {
     register uint64_t i;
     for (i = 0; i < D; i++)
-        if (abs(a->data[i] - b->data[i]) > PRECISION)
+        if (coord_differs(a->data[i], b->data[i]))
             return (2 * (a->data[i] > b->data[i]) - 1);
 }
 
 bool Point_equals(const Point *a, const Point *b) {
     register uint64_t i;
+#ifdef FLOAT32_COORDS
+    // floats cannot hold the center of a square much shorter than the spacing of floats
+    // around its largest coordinate, so points that such a square would split are equal
+    register coord_t resolution = 0;
+    for (i = 0; i < D; i++) {
+        if (abs(a->data[i]) > resolution)
+            resolution = abs(a->data[i]);
+        if (abs(b->data[i]) > resolution)
+            resolution = abs(b->data[i]);
+    }
+    resolution *= FLOAT32_RESOLUTION;
     for (i = 0; i < D; i++)
-        if (abs(a->data[i] - b->data[i]) > PRECISION)
+        if (coord_differs(a->data[i], b->data[i]) && abs(a->data[i] - b->data[i]) > resolution)
             return false;
     return true;
+#else
+    for (i = 0; i < D; i++)
+        if (coord_differs(a->data[i], b->data[i]))
+            return false;
+    return true;
+#endif
 }
 
 void Point_copy(const Point* from, Point* to) {
@@ -33,3 +55,31 @@ void Point_copy(const Point* from, Point* to) {
     for (i = 0; i < D; i++)
         to->data[i] = from->data[i];
 }
+
+float64_t Point_distance_squared(const Point *a, const Point *b) {
+    register uint64_t i;
+    float64_t distance = 0, delta;
+    for (i = 0; i < D; i++) {
+        delta = a->data[i] - b->data[i];
+        distance += delta * delta;
+    }
+    return distance;
+}
+
+uint64_t Point_hash(const Point *p) {
+    register uint64_t i, hash = 0;
+    union {
+        coord_t coord;
+        uint64_t bits;
+    } value;
+    for (i = 0; i < D; i++) {
+        value.bits = 0;
+        value.coord = p->data[i];
+        hash = (hash ^ value.bits) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 32;
+    }
+    // the splitmix64 finalizer, so the high bits depend on every coordinate
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
@@ -5,24 +5,66 @@ Point
 #ifndef POINT_H
 #define POINT_H
 
+#include <inttypes.h>
 #include <stdio.h>
 
 #include "types.h"
 
 #define abs(x) ((1 - 2 * ((x) < 0)) * (x))
+#ifndef PRECISION
 #define PRECISION 1e-6
+#endif
 
 #ifdef DIMENSIONS
 #define D DIMENSIONS
 #endif
 
+/**
+ * coord_t
+ *
+ * The type of a coordinate. With INTEGER_GRID defined, coordinates are integers on a grid
+ * with GRID_RESOLUTION cells per unit, and compare exactly; otherwise they are doubles
+ * that compare up to PRECISION, or floats with FLOAT32_COORDS defined. COORD_MAX is above
+ * every coordinate, and -COORD_MAX below every one.
+ *
+ * Floats halve the size of a Point, but the center of a square is only exact while its
+ * length is above the spacing of floats around it. So besides points within PRECISION of
+ * each other, Point_equals also takes points to be equal when they are within
+ * FLOAT32_RESOLUTION times their largest coordinate magnitude, rather than needing squares
+ * that floats cannot represent. PRECISION stays the same for both types of coordinate.
+ */
+#if defined(INTEGER_GRID) && defined(FLOAT32_COORDS)
+#error "INTEGER_GRID and FLOAT32_COORDS cannot both be defined"
+#endif
+
+#ifdef INTEGER_GRID
+#ifndef GRID_RESOLUTION
+#define GRID_RESOLUTION 1
+#endif
+typedef int64_t coord_t;
+#define COORD_FORMAT "%" PRId64
+#define COORD_MAX INT64_MAX
+#define coord_differs(x, y) ((x) != (y))
+#elif defined(FLOAT32_COORDS)
+typedef float32_t coord_t;
+#define COORD_FORMAT "%f"
+#define FLOAT32_RESOLUTION 0x1p-21f
+#define COORD_MAX __builtin_inff()
+#define coord_differs(x, y) (abs((x) - (y)) > PRECISION)
+#else
+typedef float64_t coord_t;
+#define COORD_FORMAT "%lf"
+#define COORD_MAX __builtin_inf()
+#define coord_differs(x, y) (abs((x) - (y)) > PRECISION)
+#endif
+
 /**
  * struct Point_t
  *
  * Represents D-dimensional data. Contains D members.
  */
 typedef struct Point_t{
-    float64_t data[D];
+    coord_t data[D];
 } Point;
 
 /**
@@ -42,6 +84,10 @@ typedef struct Point_t{
  *
  * Returns a Point that represents (data[0], data[1], ...).
  *
+ * With INTEGER_GRID defined, each coordinate is scaled by GRID_RESOLUTION and rounded to
+ * the nearest grid point. With FLOAT32_COORDS defined, each coordinate is rounded to the
+ * nearest float.
+ *
  * data - the coordinates of the point
  *
  * Returns a Point representing (data[0], data[1], ...).
@@ -68,7 +114,8 @@ int8_t Point_compare(const Point *a, const Point *b);
  * Point_equals
  *
  * Returns true if the two points are within precision error of each other in both
- * coordinates.
+ * coordinates. With INTEGER_GRID defined, the coordinates must be exactly equal. With
+ * FLOAT32_COORDS defined, points closer than floats can split are also equal.
  *
  * a - the first point to compare
  * b - the second point to compare
@@ -87,11 +134,36 @@ safe bool Point_equals(const Point *a, const Point *b);
  */
 safe void Point_copy(const Point *from, Point *to);
 
+/**
+ * Point_distance_squared
+ *
+ * Returns the squared Euclidean distance between the two points.
+ *
+ * a - the first point
+ * b - the second point
+ *
+ * Returns the squared distance between a and b.
+ */
+float64_t Point_distance_squared(const Point *a, const Point *b);
+
+/**
+ * Point_hash
+ *
+ * Returns a 64-bit hash of the bits of the coordinates of p. The hash is the same
+ * across runs and machines of the same endianness, and all of its bits, including the
+ * high ones, are mixed.
+ *
+ * p - the point to hash
+ *
+ * Returns the hash of p.
+ */
+uint64_t Point_hash(const Point *p);
+
 static void Point_string(const Point *p, char *buffer) {
-    sprintf(buffer, "Point(%lf", p->data[0]);
+    sprintf(buffer, "Point(" COORD_FORMAT, p->data[0]);
     register uint64_t i;
     for (i = 1; i < D; i++) {
-        sprintf(buffer, "%s, %lf", buffer, p->data[i]);
+        sprintf(buffer, "%s, " COORD_FORMAT, buffer, p->data[i]);
     }
     sprintf(buffer, "%s)", buffer);
 }
@@ -7,13 +7,41 @@ Interface for Quadtree data structure
 
 #include <errno.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 
 #include "types.h"
 #include "util.h"
 #include "Point.h"
 
+// vector instruction set used by in_range and get_quadrant, chosen at compile time from
+// what the target supports; define NO_SIMD to use the scalar loops instead
+#ifndef NO_SIMD
+#if defined(__AVX2__)
+#define SIMD_AVX2
+#endif
+#if defined(__SSE2__)
+#define SIMD_SSE2
+#endif
+#endif
+
+#if defined(SIMD_AVX2) || defined(SIMD_SSE2)
+#include <immintrin.h>
+#endif
+
+// how far below a center get_quadrant still places a coordinate on the upper side; floats
+// compare exactly, as their PRECISION is on the scale of the root square rather than of
+// the smallest squares
+#ifdef FLOAT32_COORDS
+#define QUADRANT_PRECISION 0
+#else
+#define QUADRANT_PRECISION PRECISION
+#endif
+
 #ifdef PARALLEL
 typedef struct SerialSkipQuadtreeNode_t Node;
 #else
@@ -21,36 +49,214 @@ typedef struct SerialSkipQuadtreeNode_t Node;
 #endif
 typedef Node Quadtree;
 
+// number of words in the bitmap of the quadrants of a square that hold a child
+#define CHILD_WORDS (((1LL << D) + 63) / 64)
+
+// number of children that a square holds without a separate children array; up to 3
+// dimensions, this is all of them, as a separate array would cost more than it saves
+#ifndef INLINE_CHILDREN
+#define INLINE_CHILDREN ((1LL << D) <= 8 ? (1LL << D) : 4)
+#endif
+
+// default probability that a point on one level is also on the level above
+#ifndef PROMOTION_PROBABILITY
+#define PROMOTION_PROBABILITY 0.5
+#endif
+
+// with MULTISET defined, a tree holds each point any number of times: adding a point that
+// is already in the tree counts it once more, rather than failing, and removing it counts
+// it once less, until the last copy goes; the structure of the tree only changes for the
+// first and the last copy. Counts, ranks and aggregates count every copy.
+#ifdef MULTISET
+#define COUNT_REPEATS true
+#else
+#define COUNT_REPEATS false
+#endif
+
+// with SUBTREE_COUNTS defined, squares keep the number of points below them on their
+// level, and range counts are taken from those counts. The Makefile defines it for the
+// variants that keep them, which is SerialSkipQuadtree only: in ParallelSkipQuadtree, every
+// add and remove would have to lock the whole path up to the root.
+
+// with AGGREGATES defined, squares also keep an aggregate of the points below them, which
+// is maintained along with their count
+#if defined(AGGREGATES) && !defined(SUBTREE_COUNTS)
+#error "AGGREGATES needs a variant that keeps subtree counts, with SUBTREE_COUNTS defined"
+#endif
+
+// with TIGHT_BOUNDS defined by a variant that keeps aggregate.lo and aggregate.hi up to
+// date, queries prune squares by the tight bounding box of the points below them instead
+// of the bounds of the square
+
 extern __thread rlu_thread_data_t *rlu_self;
 
+#ifdef AGGREGATES
+/*
+ * struct QuadtreeAggregate_t
+ *
+ * Summarizes a set of points, such as the points below a square on its level. Only
+ * available with AGGREGATES defined.
+ *
+ * weight - the total weight of the points
+ * sum - the weighted sum of the coordinates of the points, in each dimension
+ * lo, hi - the corners of the tightest box containing the points; with no points, lo is
+ *     COORD_MAX and hi is -COORD_MAX in every dimension
+ */
+typedef struct QuadtreeAggregate_t {
+    float64_t weight;
+    float64_t sum[D];
+    Point lo, hi;
+} QuadtreeAggregate;
+
+/*
+ * QuadtreeWeight
+ *
+ * Gives the weight of a point in the aggregates of a tree. Must give the same weight
+ * every time it is called with the same point.
+ *
+ * p - the point to weigh
+ * ctx - the context pointer that was passed to Quadtree_set_weight
+ *
+ * Returns the weight of p.
+ */
+typedef float64_t (*QuadtreeWeight)(const Point * const p, void * const ctx);
+#endif
+
 /*
  * struct SerialSkipQuadtreeNode_t
  *
  * Stores information about a node in the quadtree
  *
  * is_square - true if node is a square, false if is a point
+ * is_bottom - true if node is a point on the lowest level, which is the only copy of the
+ *     point that has a value and a multiplicity
+ * num_children - the number of children of the square
+ * capacity - the number of children that fit in the children array
  * center - center of the square, or coordinates of the point
- * length - side length of the square. This means that the boundaries are
- *     length/2 distance from the center-> Does not matter for a point
  * parent - the parent node in the same level; NULL if a root node
  * up - the clone of the same node in the next level, if it exists
  * down - the clone of the same node in the previous level; NULL if at lowest level
- * children - the four children of the square; each entry is NULL if there is no child
- *     there. Each index refers to a quadrant, such that children[0] is Q1, [1] is Q2,
- *     and so on. Should never be all NULL unless node is a point
+ * length - side length of the square. This means that the boundaries are
+ *     length/2 distance from the center. Points do not have one. With
+ *     INTEGER_GRID defined, it is a power of two, and the square covers the grid points
+ *     from center - length/2 up to but not including center - length/2 + length, so
+ *     that the square is identified by its level, log2(length), and the bits of its
+ *     corner above that level: its Morton prefix.
+ * bitmap - bit i is set if the square has a child in quadrant i, where quadrant 0 is Q1,
+ *     1 is Q2, and so on. Should never be all 0.
+ * count - with SUBTREE_COUNTS defined, the number of points below the square on its level
+ * aggregate - with AGGREGATES defined, the aggregate of the points below the square on
+ *     its level
+ * inline_children, children - the children of the square, one for each set bit of
+ *     bitmap, in order of quadrant. Compressed squares mostly have just a few children,
+ *     so up to INLINE_CHILDREN of them are kept in the square itself, and only larger
+ *     capacities get a separate array. Use Node_children to get at them, or Node_child
+ *     to find the child in a given quadrant.
+ * value - the value of a point on the lowest level, as stored by Quadtree_put
+ * multiplicity - with MULTISET defined, the number of times that a point on the lowest
+ *     level has been added
+ *
+ * Only squares have children. is_bottom, num_children and capacity take up what would
+ * otherwise be padding after is_square; the latter two are left unset in point nodes. The
+ * fields of squares share their space with those of points on the lowest level, and nodes
+ * are allocated with Node_size bytes, so each of them must only be accessed through a node
+ * known to be of the right kind. The copies of a point on the levels above have neither.
  */
 struct SerialSkipQuadtreeNode_t {
-    bool is_square;
+    bool is_square, is_bottom;
+    uint16_t num_children, capacity;
     Point center;
-    float64_t length;
     Node *parent;
     Node *up, *down;
-    Node *children[1LL << D];
 #ifdef QUADTREE_TEST
     uint64_t id;
 #endif
+    union {
+        struct {
+            coord_t length;
+            uint64_t bitmap[CHILD_WORDS];
+#ifdef SUBTREE_COUNTS
+            uint64_t count;
+#endif
+#ifdef AGGREGATES
+            QuadtreeAggregate aggregate;
+#endif
+            union {
+                Node *inline_children[INLINE_CHILDREN];
+                Node **children;
+            };
+        };
+        struct {
+            void *value;
+#ifdef MULTISET
+            uint64_t multiplicity;
+#endif
+        };
+    };
 };
 
+// size of the copy of a point on a level above the lowest, which ends where the fields of
+// squares and points on the lowest level start
+#define POINT_NODE_SIZE offsetof(Node, length)
+
+// size of a point on the lowest level, which ends after its value and multiplicity
+#ifdef MULTISET
+#define BOTTOM_NODE_SIZE (offsetof(Node, multiplicity) + sizeof(uint64_t))
+#else
+#define BOTTOM_NODE_SIZE (offsetof(Node, value) + sizeof(void*))
+#endif
+
+/*
+ * Node_size
+ *
+ * Returns the number of bytes that node was allocated with: sizeof(Node) for a square,
+ * BOTTOM_NODE_SIZE for a point on the lowest level, and POINT_NODE_SIZE for a point on a
+ * level above.
+ */
+static inline uint64_t Node_size(const Node * const node) {
+    return node->is_square ? sizeof(Node) : node->is_bottom ? BOTTOM_NODE_SIZE : POINT_NODE_SIZE;
+}
+
+/*
+ * Node_children
+ *
+ * Returns the children array of square, which has square->num_children entries.
+ */
+static inline Node** Node_children(const Node * const square) {
+    return square->capacity > INLINE_CHILDREN ? square->children : (Node**)square->inline_children;
+}
+
+/*
+ * Node_child_index
+ *
+ * Returns the index in the children array of square of the child in the given quadrant, or of where
+ * it would go if there is none: the number of children in lower quadrants.
+ *
+ * square - the square to look in
+ * quadrant - the quadrant, [0, 2^D)
+ */
+static inline uint64_t Node_child_index(const Node * const square, const uint64_t quadrant) {
+    register uint64_t word = quadrant / 64, i;
+    register uint64_t index = __builtin_popcountll(square->bitmap[word] & ((1ULL << quadrant % 64) - 1));
+    for (i = 0; i < CHILD_WORDS - 1 && i < word; i++)
+        index += __builtin_popcountll(square->bitmap[i]);
+    return index;
+}
+
+/*
+ * Node_child
+ *
+ * Returns the child of square in the given quadrant, or NULL if there is none.
+ *
+ * square - the square to look in
+ * quadrant - the quadrant, [0, 2^D)
+ */
+static inline Node* Node_child(const Node * const square, const uint64_t quadrant) {
+    if (!(square->bitmap[quadrant / 64] & (1ULL << quadrant % 64)))
+        return NULL;
+    return Node_children(square)[Node_child_index(square, quadrant)];
+}
+
 /*
  * struct QuadtreeFreeResult_t
  *
@@ -73,13 +279,13 @@ typedef struct QuadtreeFreeResult_t {
  *
  * Allocates memory for and initializes an empty leaf node in the quadtree.
  *
- * length - the "length" of the node -- irrelevant for a leaf node, but necessary
- *          for an internal node (square)
+ * length - ignored, as point nodes have no length; kept so that tests can build a
+ *          node the same way as a square with Quadtree_init
  * center - the center of the node
  *
  * Returns a pointer to the created node.
  */
-Node* Node_init(const float64_t length, const Point center);
+Node* Node_init(const coord_t length, const Point center);
 #endif
 
 /*
@@ -87,16 +293,87 @@ Node* Node_init(const float64_t length, const Point center);
  *
  * Allocates memory for and initializes an empty internal node in the quadtree.
  *
- * In SerialSkipQuadtree, this is implemented as a wrapper for Node_init, setting
- * the resultant node's is_square boolean to true before returning it.
+ * In SerialSkipQuadtree, this also creates the slab arena that every node of the tree
+ * is allocated from.
  *
- * length - the "length" of the node -- irrelevant for a leaf node, but necessary
- *          for an internal node (square)
- * center - the center of the node
+ * With INTEGER_GRID defined, length is in grid units and must be a power of two.
+ *
+ * length - the length of the root square
+ * center - the center of the root square
  *
  * Returns a pointer to the created node.
  */
-Quadtree* Quadtree_init(const float64_t length, const Point center);
+Quadtree* Quadtree_init(const coord_t length, const Point center);
+
+/*
+ * Quadtree_bulk_load
+ *
+ * Builds a quadtree holding the given points in one pass, instead of adding them one at
+ * a time with Quadtree_add.
+ *
+ * The points are sorted in Morton (Z-) order and each level is built left to right,
+ * starting every point from the deepest square on the path to the point before it. Each
+ * point goes on the same levels as with Quadtree_add, so the resulting tree is laid out
+ * just like one built by adding the points in any order.
+ *
+ * Points outside of the root square and duplicates, as defined by Point_equals, are
+ * skipped. With MULTISET defined, duplicates are counted instead, as with Quadtree_add.
+ *
+ * In ParallelSkipQuadtree, the tree is built without locking, as it is not visible to any
+ * other thread until it is returned.
+ *
+ * points - the points to add
+ * n - the number of points
+ * length - the length of the root square
+ * center - the center of the root square
+ *
+ * Returns a pointer to the root of the created tree, or NULL if memory runs out.
+ */
+Quadtree* Quadtree_bulk_load(const Point * const points, const uint64_t n,
+        const coord_t length, const Point center);
+
+/*
+ * Quadtree_build_index
+ *
+ * Builds a hash index of the squares on the bottom-most level of the tree, keyed by
+ * depth and Morton prefix, and keeps it up to date through every later add and remove.
+ *
+ * Once the index is built, Quadtree_search finds the smallest square containing the
+ * point with a binary search over depths, as in an x-fast trie, taking O(log d) hash
+ * lookups for a tree of depth d, instead of descending through the skip levels. The
+ * index takes one entry per square. Calling this again on an indexed tree does nothing.
+ *
+ * In ParallelSkipQuadtree, no index is built, as concurrent writers would contend on the
+ * table, and searches keep descending through the skip levels.
+ *
+ * root - the root node of the tree to index
+ *
+ * Returns the number of squares in the index, or 0 with the tree left unindexed if memory
+ * for the index could not be allocated.
+ */
+uint64_t Quadtree_build_index(Quadtree * const root);
+
+/*
+ * Quadtree_set_promotion
+ *
+ * Sets the probability that a point on one level of the tree is also on the level above,
+ * which is PROMOTION_PROBABILITY for a new tree. Lower probabilities give fewer levels
+ * with longer horizontal traversals on each.
+ *
+ * The levels of a point are derived from a hash of its coordinates rather than drawn at
+ * random, so for a given probability a point always goes on the same levels, in every
+ * tree and every run. Points already in the tree keep their levels.
+ *
+ * In ParallelSkipQuadtree, this must be called before the tree is shared between
+ * threads.
+ *
+ * root - the root node of the tree, as returned by Quadtree_init or Quadtree_bulk_load
+ * promotion - the probability, in [0, 1)
+ *
+ * Returns true if the probability was set, and false, leaving it unchanged, if promotion
+ * is not in [0, 1).
+ */
+bool Quadtree_set_promotion(Quadtree * const root, const float64_t promotion);
 
 #ifdef PARALLEL
 /*
@@ -178,13 +455,63 @@ int Quadtree_parallel_remove(pthread_t *pthread, pthread_attr_t *pthread_attr,
  */
 bool Quadtree_search(const Quadtree * const node, const Point p);
 
+/*
+ * Quadtree_search_batch
+ *
+ * Searches for each of the given points in the quadtree pointed to by node, as if by
+ * calling Quadtree_search on each of them.
+ *
+ * Several searches are kept in flight at once and advanced one step at a time in turn.
+ * Each step prefetches the node that its search needs next, so that the cache misses of
+ * different searches overlap instead of being waited on one after another.
+ *
+ * In ParallelSkipQuadtree, the points are searched for in groups, each group within its
+ * own read-side critical section.
+ *
+ * node - the root node to start at
+ * points - the points we're searching for
+ * n - the number of points
+ * results - buffer for n results, where results[i] receives whether points[i] is in
+ *     the quadtree; may be NULL
+ *
+ * Returns the number of points found.
+ */
+uint64_t Quadtree_search_batch(const Quadtree * const node, const Point * const points,
+        const uint64_t n, bool * const results);
+
+/*
+ * Quadtree_search_from
+ *
+ * Searches for p as Quadtree_search does, but starting from a finger: a node of the tree
+ * that a previous operation ended at, such as the result of searching for a nearby
+ * point. From there, the search climbs up through parent only until it reaches a square
+ * containing p, and then goes back down, so that it costs about as much as the distance
+ * between the two points in the tree rather than the height of the tree.
+ *
+ * In SerialSkipQuadtree, finger may be any node of the tree on any level, including the
+ * root. It is moved to the node of p on the bottom-most level if p is found, and to the
+ * smallest square containing p otherwise, ready for the next search. A finger must not be
+ * used after the node it points to has been removed.
+ *
+ * In ParallelSkipQuadtree, any node but the root can be freed by another thread once an
+ * operation finishes, so finger must be the root, and this is the same as
+ * Quadtree_search.
+ *
+ * finger - the node to start at; updated to where the search ended
+ * p - the point we're searching for
+ *
+ * Returns whether p is in the quadtree.
+ */
+bool Quadtree_search_from(Node ** const finger, const Point p);
+
 /*
  * Quadtree_add
  *
  * Adds p to the quadtree represented by node, the root.
  *
  * Will not add duplicate points to the tree, as defined by Point_equals. If p is already
- * in the tree, this function will return false.
+ * in the tree, this function will return false. With MULTISET defined, it instead counts
+ * p once more, in place, and returns true.
  *
  * node - the root node of the tree to add to
  * p - the point being added
@@ -193,10 +520,59 @@ bool Quadtree_search(const Quadtree * const node, const Point p);
  */
 bool Quadtree_add(Quadtree * const node, const Point p);
 
+/*
+ * Quadtree_add_batch
+ *
+ * Adds each of the given points to the quadtree represented by node, the root, as if by
+ * calling Quadtree_add on each of them.
+ *
+ * The points are sorted in Morton (Z-) order first. In SerialSkipQuadtree, each point
+ * then starts on every level from the deepest square it shares with the point added
+ * before it, instead of from the top of the tree, which makes adding points that are
+ * close together much cheaper.
+ *
+ * In ParallelSkipQuadtree, a square may be freed by another thread as soon as an add
+ * finishes, so every point is added with Quadtree_add; only the sorting carries over.
+ *
+ * node - the root node of the tree to add to
+ * points - the points being added
+ * n - the number of points
+ * results - buffer for n results, where results[i] receives whether points[i] was
+ *     added; may be NULL
+ *
+ * Returns the number of points added, or 0 with every result false if memory for sorting
+ * the points could not be allocated.
+ */
+uint64_t Quadtree_add_batch(Quadtree * const node, const Point * const points,
+        const uint64_t n, bool * const results);
+
+/*
+ * Quadtree_add_from
+ *
+ * Adds p as Quadtree_add does, but starting from a finger as in Quadtree_search_from.
+ *
+ * In SerialSkipQuadtree, the square to add p to on the bottom-most level is found from
+ * the finger. On each level above that p is added to, the search climbs from the square
+ * below only to the nearest square that also has a copy on this level, which is a
+ * constant number of squares on average, instead of coming down from the top. The finger
+ * is moved to the node of p on the bottom-most level, whether it was added now or
+ * already in the tree.
+ *
+ * In ParallelSkipQuadtree, finger must be the root, and this is the same as
+ * Quadtree_add.
+ *
+ * finger - the node to start at; updated to where the add ended
+ * p - the point being added
+ *
+ * Returns whether the add was successful.
+ */
+bool Quadtree_add_from(Node ** const finger, const Point p);
+
 /*
  * Quadtree_remove
  *
- * Removes p from the quadtree represented by node, the root.
+ * Removes p from the quadtree represented by node, the root. With MULTISET defined, only
+ * one of the times that p was added is removed, and p stays in the tree until the last.
  *
  * node - the root node of the tree to remove from
  * p - the point being removed
@@ -206,103 +582,1435 @@ bool Quadtree_add(Quadtree * const node, const Point p);
  */
 bool Quadtree_remove(Quadtree * const node, const Point p);
 
-/*bool Quadtree_search(Quadtree *node, Point p, int64_t *lock_count, uint64_t index);
-bool Quadtree_add(Quadtree *node, Point p, int64_t *lock_count, uint64_t index);
-bool Quadtree_remove(Quadtree *node, Point p, int64_t *lock_count, uint64_t index);*/
+/*
+ * Quadtree_multiplicity
+ *
+ * Counts how many times p is in the quadtree represented by node, the root: with MULTISET
+ * defined, the number of times that it has been added and not yet removed, and otherwise
+ * at most 1.
+ *
+ * node - the root node of the tree
+ * p - the point to count
+ *
+ * Returns the number of times p is in the quadtree, 0 if it is not.
+ */
+uint64_t Quadtree_multiplicity(const Quadtree * const node, const Point p);
 
 /*
- * Quadtree_free
+ * QuadtreeUpsert
  *
- * Frees the entire tree one node at a time
+ * Callback used by Quadtree_upsert to compute the new value of a point.
  *
- * The freeing order is such that, if a free fails, retrying won't
- * cause memory leaks.
+ * value - the current value of the point, or NULL if the point is not in the tree yet
+ * present - whether the point is in the tree already
+ * ctx - the context pointer that was passed to Quadtree_upsert
  *
- * This can also be used to free subtrees.
+ * Returns the value to store for the point.
+ */
+typedef void* (*QuadtreeUpsert)(void * const value, const bool present, void * const ctx);
+
+/*
+ * Quadtree_put
  *
- * Returns a QuadtreeFreeResult.
+ * Stores value for p in the quadtree represented by node, the root, adding p first if it
+ * is not in the tree yet, as Quadtree_add would. If p is already in the tree, its value is
+ * replaced in place, without changing the structure of the tree.
+ *
+ * Values are kept on the bottom-most level only; the copies of p on the levels above do
+ * not hold one. Points added by any other function have a NULL value.
+ *
+ * node - the root node of the tree
+ * p - the point to store the value for
+ * value - the value to store
+ *
+ * Returns whether the value was stored: false if p is outside of the tree.
  */
-QuadtreeFreeResult Quadtree_free(Quadtree * const root);
+bool Quadtree_put(Quadtree * const node, const Point p, void * const value);
 
 /*
- * Node_valid
+ * Quadtree_get
  *
- * Returns false if node is either NULL or is dirty, and true otherwise. A value of true
- * indicates that the node is both non-NULL and not logically deleted.
+ * Looks up the value of p in the quadtree represented by node, the root.
  *
- * node - the node to check
+ * node - the root node of the tree
+ * p - the point to look up
+ * value - buffer for the value of p, as stored by Quadtree_put or Quadtree_upsert; left
+ *     unchanged if p is not in the tree; may be NULL
  *
- * Returns whether the node is valid for use.
+ * Returns whether p is in the quadtree.
  */
-static inline bool Node_valid(const Node * const node) {
-    return node != NULL;
-}
+bool Quadtree_get(const Quadtree * const node, const Point p, void ** const value);
 
 /*
- * in_range
+ * Quadtree_upsert
  *
- * Returns true if p is within the boundaries of n, false otherwise.
+ * Replaces the value of p with the result of update, adding p first if it is not in the
+ * tree yet, in a single lookup when p is present. Like Quadtree_put, the structure of the
+ * tree is left unchanged if p is already in it.
  *
- * On-boundary counts as being within if on the left or bottom boundaries.
+ * In ParallelSkipQuadtree, the update is made within one critical section, so no other
+ * update of p can come between reading and writing its value. update may be called more
+ * than once if the section has to be retried, and only the result of the last call is kept.
  *
- * n - the square node to check at
- * p - the point to check for
+ * node - the root node of the tree
+ * p - the point to update
+ * update - computes the new value of p from its current value
+ * ctx - passed to update
  *
- * Returns whether p is within the boundaries of n.
+ * Returns whether the value was stored: false if p is outside of the tree.
  */
-static bool in_range(const Node * const n, const Point * const p) {
-    /*return n->center->data[0] - n->length / 2 <= p->data[0] &&
-        n->center->data[0] + n->length / 2 > p->data[0] &&
-        n->center->data[1] - n->length / 2 <= p->data[1] &&
-        n->center->data[1] + n->length / 2 > p->data[1];*/
-    register float64_t bound = n->length * 0.5;
-    register uint64_t i;
-    for (i = 0; i < D; i++)
-        if ((n->center.data[i] - bound > p->data[i]) || (n->center.data[i] + bound <= p->data[i]))
-            return false;
-    return true;
-}
+bool Quadtree_upsert(Quadtree * const node, const Point p, QuadtreeUpsert update,
+        void * const ctx);
 
 /*
- * get_quadrant
+ * QuadtreeCallback
  *
- * Returns the quadrant [0,2^D) that p is in, relative to the origin point.
+ * Callback used by queries that report more than one point. Called once for each
+ * reported point.
  *
- * Let b = quadrant id in binary, with b[0] being the least significant bit. Then, b[0] corresponds
- * to the first dimension, b[1] corresponds to the second, etc. such that b[i] corresponds to the
- * (i + 1)th dimension.
+ * p - the point being reported
+ * ctx - the context pointer that was passed to the query
  *
- * origin - the point representing the origin of the bounding square
- * p - the point we're trying to find the quadrant of
+ * Returns true to keep the query going, false to stop it early.
+ */
+typedef bool (*QuadtreeCallback)(const Point * const p, void * const ctx);
+
+/*
+ * Quadtree_range_query
  *
- * Returns the quadrant that p is in, relative to origin.
+ * Reports every point in the quadtree represented by node that lies within the
+ * axis-aligned box [lo, hi], boundaries included.
+ *
+ * Squares that do not overlap the box are skipped entirely, and squares that lie
+ * completely within the box are reported without further bounds checks on their
+ * subsquares.
+ *
+ * node - the root node of the tree to query
+ * lo - the corner of the box with the smallest coordinate values
+ * hi - the corner of the box with the largest coordinate values
+ * callback - called once for each point in the box
+ * ctx - passed through to callback
+ *
+ * Returns the number of points reported.
  */
-static uint64_t get_quadrant(const Point * const origin, const Point * const p) {
-    //return (p->data[0] >= origin->data[0]) + 2 * (p->data[1] >= origin->data[1]);
-    register uint64_t i;
-    uint64_t quadrant = 0;
-    for (i = 0; i < D; i++)
-        quadrant |= ((p->data[i] >= origin->data[i] - PRECISION) & 1) << i;
-    return quadrant;
-}
+uint64_t Quadtree_range_query(const Quadtree * const node, const Point lo, const Point hi,
+        QuadtreeCallback callback, void * const ctx);
 
+#ifdef SUBTREE_COUNTS
 /*
- * get_new_center
+ * Quadtree_range_count
  *
- * Given the current node and a quadrant, returns the Point representing
- * the center of the square that represents that quadrant.
+ * Counts the points in the quadtree represented by node that lie within the
+ * axis-aligned box [lo, hi], boundaries included, matching the number of points that
+ * Quadtree_range_query would report. With MULTISET defined, a point counts as many times
+ * as it was added, but is reported once.
  *
- * node - the parent node
- * quadrant - the quadrant to search for, [0, 2^D)
+ * Squares that lie completely within the box add their count of points at once, so only
+ * the squares crossing the boundary of the box are visited. Only available with
+ * SUBTREE_COUNTS defined; otherwise, Quadtree_range_query returns the same number.
  *
- * Returns the center point for the given quadrant of node.
+ * node - the root node of the tree to query
+ * lo - the corner of the box with the smallest coordinate values
+ * hi - the corner of the box with the largest coordinate values
+ *
+ * Returns the number of points in the box.
  */
-static Point get_new_center(const Node * const node, const uint64_t quadrant) {
-    Point p;
-    register uint64_t i;
-    for (i = 0; i < D; i++)
-        p.data[i] = node->center.data[i] + (((quadrant >> i) & 1) - 0.5) * 0.5 * node->length;
-    return p;
+uint64_t Quadtree_range_count(const Quadtree * const node, const Point lo, const Point hi);
+#endif
+
+#ifdef AGGREGATES
+/*
+ * Quadtree_set_weight
+ *
+ * Sets the function that gives the weight of each point in the aggregates of the tree.
+ * Without one, every point weighs 1. The aggregates of the points already in the tree
+ * are recomputed.
+ *
+ * root - the root node of the tree, as returned by Quadtree_init or Quadtree_bulk_load
+ * weight - the weight function, or NULL to weigh every point 1
+ * ctx - passed through to weight
+ */
+void Quadtree_set_weight(Quadtree * const root, QuadtreeWeight weight, void * const ctx);
+
+/*
+ * Quadtree_range_aggregate
+ *
+ * Aggregates the points in the quadtree represented by node that lie within the
+ * axis-aligned box [lo, hi], boundaries included: their total weight, weighted centroid
+ * and tight bounding box.
+ *
+ * Squares that lie completely within the box add their aggregate at once, as in
+ * Quadtree_range_count. Weights and weighted sums are kept up to date by adding and
+ * subtracting, so after many adds and removes they carry the rounding of each.
+ *
+ * node - the root node of the tree to query
+ * lo - the corner of the box with the smallest coordinate values
+ * hi - the corner of the box with the largest coordinate values
+ * aggregate - buffer for the aggregate of the points in the box
+ *
+ * Returns the number of points in the box.
+ */
+uint64_t Quadtree_range_aggregate(const Quadtree * const node, const Point lo, const Point hi,
+        QuadtreeAggregate * const aggregate);
+#endif
+
+/*
+ * Quadtree_knn
+ *
+ * Finds the k points in the quadtree represented by node that are closest to p.
+ *
+ * The skip levels are used to find the smallest square containing p, and squares are
+ * then visited best-first by their distance to p, widening outward only as far as the
+ * current k-th best distance requires.
+ *
+ * node - the root node of the tree to query
+ * p - the query point; does not need to be in the tree
+ * k - the number of neighbors to find
+ * out - buffer for at least k points, which receives the neighbors in order of
+ *     increasing distance
+ *
+ * Returns the number of neighbors written to out, which is less than k only if the tree
+ * holds fewer than k points, or 0 if memory runs out.
+ */
+uint64_t Quadtree_knn(const Quadtree * const node, const Point p, const uint64_t k,
+        Point * const out);
+
+/*
+ * Quadtree_ann
+ *
+ * Finds an approximate nearest neighbor of p in the quadtree represented by node: a
+ * point whose distance to p is at most (1 + eps) times the distance from p to its true
+ * nearest neighbor.
+ *
+ * Runs the same search as Quadtree_knn, but stops refining as soon as no unvisited
+ * square can beat the current candidate by more than a factor of (1 + eps). Larger
+ * values of eps trade accuracy for fewer visited nodes; an eps of 0 is exact.
+ *
+ * node - the root node of the tree to query
+ * p - the query point; does not need to be in the tree
+ * eps - the allowed relative error in distance, at least 0
+ * out - buffer that receives the neighbor
+ *
+ * Returns whether a neighbor was found, which is false only if the tree is empty or
+ * memory runs out.
+ */
+bool Quadtree_ann(const Quadtree * const node, const Point p, const float64_t eps,
+        Point * const out);
+
+/*
+ * Quadtree_radius_query
+ *
+ * Reports every point in the quadtree represented by node that is within distance r
+ * of p, boundary included. Squares whose closest point is farther than r from p are
+ * skipped entirely.
+ *
+ * node - the root node of the tree to query
+ * p - the center of the ball
+ * r - the radius of the ball
+ * callback - called once for each point in the ball
+ * ctx - passed through to callback
+ *
+ * Returns the number of points reported.
+ */
+uint64_t Quadtree_radius_query(const Quadtree * const node, const Point p, const float64_t r,
+        QuadtreeCallback callback, void * const ctx);
+
+/*
+ * Quadtree_any_within
+ *
+ * Checks whether any point in the quadtree represented by node is within distance r
+ * of p, boundary included.
+ *
+ * Starts at the smallest square containing p, found through the skip levels, and only
+ * moves outward while the ball reaches past the explored square. Returns on the first
+ * point found.
+ *
+ * node - the root node of the tree to query
+ * p - the center of the ball
+ * r - the radius of the ball
+ *
+ * Returns whether there is a point within distance r of p.
+ */
+bool Quadtree_any_within(const Quadtree * const node, const Point p, const float64_t r);
+
+/*
+ * struct QuadtreeCursor_t
+ *
+ * Stores the position of a traversal of the points of a tree in Morton (Z-) order.
+ *
+ * root - the root square of the bottom-most level
+ * node - in SerialSkipQuadtree, the node of the next point to return; NULL once all
+ *     points have been returned
+ * parent - in SerialSkipQuadtree, the parent of node
+ * index - in SerialSkipQuadtree, the position of node among the children of parent
+ * from - in ParallelSkipQuadtree, the point that the next point is looked up from
+ * seek - in ParallelSkipQuadtree, false if the next point is the first of the tree
+ * after - in ParallelSkipQuadtree, whether the next point is after from rather than at
+ *     or after it
+ */
+typedef struct QuadtreeCursor_t {
+    Node *root, *node, *parent;
+    uint64_t index;
+    Point from;
+    bool seek, after;
+} QuadtreeCursor;
+
+/*
+ * Quadtree_cursor_init
+ *
+ * Starts a traversal of the points of the quadtree pointed to by node in Morton (Z-)
+ * order, the order that squares hold their children in, starting from the first point
+ * that is not before start.
+ *
+ * In SerialSkipQuadtree, the cursor holds on to the node of the next point and its
+ * place in its parent, which makes every step walk only as far up and down the
+ * bottom-most level as the next point is away, without a stack. The tree must not be
+ * changed while a cursor is open; to change it partway through a traversal, close the
+ * cursor and start a new one from the last point returned afterwards.
+ *
+ * In ParallelSkipQuadtree, nodes can be freed by other threads between steps, so the
+ * cursor only remembers the last point returned, and each step looks up the point after
+ * it from the root within its own read-side critical section. The tree may change while
+ * a cursor is open: points added or removed ahead of the cursor are returned or not
+ * depending on whether the change happens before the cursor gets there.
+ *
+ * cursor - the cursor to initialize
+ * node - the root node of the tree to traverse
+ * start - the point to start from, which need not be in the tree; NULL to start from
+ *     the first point of the tree
+ */
+void Quadtree_cursor_init(QuadtreeCursor * const cursor, const Quadtree * const node,
+        const Point * const start);
+
+/*
+ * Quadtree_cursor_next
+ *
+ * Moves the cursor to the next point of the traversal.
+ *
+ * cursor - the cursor to move
+ * p - buffer for the next point
+ *
+ * Returns false if there are no more points, in which case p is left unchanged.
+ */
+bool Quadtree_cursor_next(QuadtreeCursor * const cursor, Point * const p);
+
+/*
+ * Quadtree_cursor_close
+ *
+ * Ends a traversal. The cursor must not be used afterwards, unless it is initialized
+ * again.
+ *
+ * cursor - the cursor to close
+ */
+void Quadtree_cursor_close(QuadtreeCursor * const cursor);
+
+#ifdef SUBTREE_COUNTS
+/*
+ * Quadtree_rank
+ *
+ * Counts the points in the quadtree represented by node that come before p in Morton
+ * order, the order that Quadtree_cursor_next returns them in, with MULTISET defined
+ * counting every copy of them. p does not have to be in the tree.
+ *
+ * Follows the path to p down the bottom-most level, adding up the counts of the children
+ * before the path on the way, so it takes O(depth) steps for a fixed dimension. Only
+ * available with SUBTREE_COUNTS defined.
+ *
+ * node - the root node of the tree
+ * p - the point to rank, within the root square
+ *
+ * Returns the number of points before p, or 0 if p is outside of the root square.
+ */
+uint64_t Quadtree_rank(const Quadtree * const node, const Point p);
+
+/*
+ * Quadtree_select
+ *
+ * Finds the point at position k in Morton order among the points in the quadtree
+ * represented by node, counting from 0, so that Quadtree_rank of the point is k. With
+ * MULTISET defined, a point takes up one position for every copy of it.
+ *
+ * Goes down the bottom-most level, skipping whole children by their counts, so it takes
+ * O(depth) steps for a fixed dimension. Only available with SUBTREE_COUNTS defined;
+ * otherwise, a cursor walks past the first k points in the same order.
+ *
+ * node - the root node of the tree
+ * k - the position of the point
+ * p - buffer for the point
+ *
+ * Returns false if the tree has no more than k points, true otherwise.
+ */
+bool Quadtree_select(const Quadtree * const node, const uint64_t k, Point * const p);
+#endif
+
+/*
+ * Quadtree_save
+ *
+ * Writes a snapshot of the quadtree represented by root to fd, which Quadtree_load reads
+ * back into the same tree without adding the points one at a time.
+ *
+ * Only the bottom-most level is written, one point after another in Morton order, with
+ * each coordinate delta-encoded against the point before, so that a snapshot takes a few
+ * bytes per coordinate for dense trees. The skip levels are not written, as the levels
+ * of each point follow from the promotion probability, which is. With MULTISET defined,
+ * multiplicities are written too. Values and, with AGGREGATES defined, weight functions
+ * are not, and have to be set again after loading.
+ *
+ * The snapshot goes through a large buffer, so fd gets few, large writes. fd is neither
+ * synced nor closed.
+ *
+ * In ParallelSkipQuadtree, the whole tree is written within one read-side critical
+ * section, so the snapshot is consistent, but writers that need to wait for readers are
+ * held up until it is done.
+ *
+ * root - the root node of the tree, as returned by Quadtree_init, Quadtree_bulk_load or
+ *     Quadtree_load
+ * fd - the file descriptor to write to
+ *
+ * Returns true if the snapshot was written, false if a write failed, with errno set.
+ */
+bool Quadtree_save(const Quadtree * const root, const int fd);
+
+/*
+ * Quadtree_load
+ *
+ * Reads a snapshot written by Quadtree_save from fd, and builds the tree in it as
+ * Quadtree_bulk_load does, but without sorting the points, which are already in Morton
+ * order.
+ *
+ * The snapshot must come from a build with the same dimensions, coordinate type and
+ * MULTISET setting.
+ *
+ * fd - the file descriptor to read from, positioned at the start of the snapshot
+ *
+ * Returns a pointer to the root of the loaded tree, or NULL with errno set if reading
+ * failed, memory ran out, or the snapshot is malformed or from a different build, in
+ * which case errno is EINVAL.
+ */
+Quadtree* Quadtree_load(const int fd);
+
+/*bool Quadtree_search(Quadtree *node, Point p, int64_t *lock_count, uint64_t index);
+bool Quadtree_add(Quadtree *node, Point p, int64_t *lock_count, uint64_t index);
+bool Quadtree_remove(Quadtree *node, Point p, int64_t *lock_count, uint64_t index);*/
+
+/*
+ * Quadtree_free
+ *
+ * Frees the entire tree one node at a time
+ *
+ * The freeing order is such that, if a free fails, retrying won't
+ * cause memory leaks.
+ *
+ * This can also be used to free subtrees.
+ *
+ * In SerialSkipQuadtree, freeing a whole tree releases its arena at once, which takes
+ * time proportional to the number of slabs rather than the number of nodes.
+ *
+ * Returns a QuadtreeFreeResult.
+ */
+QuadtreeFreeResult Quadtree_free(Quadtree * const root);
+
+/*
+ * Node_valid
+ *
+ * Returns false if node is either NULL or is dirty, and true otherwise. A value of true
+ * indicates that the node is both non-NULL and not logically deleted.
+ *
+ * node - the node to check
+ *
+ * Returns whether the node is valid for use.
+ */
+static inline bool Node_valid(const Node * const node) {
+    return node != NULL;
+}
+
+/*
+ * in_range
+ *
+ * Returns true if p is within the boundaries of n, false otherwise.
+ *
+ * On-boundary counts as being within if on the left or bottom boundaries. Like
+ * get_quadrant, coordinates up to QUADRANT_PRECISION below a boundary count as on it, so
+ * that a point is always within the child that get_quadrant places it in, and within no
+ * other square on the same level. box_intersects, box_contains, min_distance_squared and
+ * exit_distance use the same boundaries, so queries agree with search on which square
+ * holds a point.
+ *
+ * With INTEGER_GRID defined, this is one unsigned compare of the offset of p from the
+ * corner of n per dimension, with no branches. With SIMD_AVX2 or SIMD_SSE2 defined, up to
+ * 4 or 2 dimensions are compared at once, or 8 or 4 with FLOAT32_COORDS. Bounds are
+ * computed in coord_t, so the vector and scalar compares agree.
+ *
+ * n - the square node to check at
+ * p - the point to check for
+ *
+ * Returns whether p is within the boundaries of n.
+ */
+static bool in_range(const Node * const n, const Point * const p) {
+    /*return n->center->data[0] - n->length / 2 <= p->data[0] &&
+        n->center->data[0] + n->length / 2 > p->data[0] &&
+        n->center->data[1] - n->length / 2 <= p->data[1] &&
+        n->center->data[1] + n->length / 2 > p->data[1];*/
+    register uint64_t i = 0;
+#ifdef INTEGER_GRID
+    register coord_t bound = n->length >> 1;
+    register uint64_t outside = 0;
+#ifdef SIMD_AVX2
+    // unsigned compares, as signed compares with the sign bits flipped
+    const __m256i sign4 = _mm256_set1_epi64x(INT64_MIN), length4 = _mm256_set1_epi64x(n->length ^ INT64_MIN);
+    for (; i + 4 <= D; i += 4) {
+        __m256i offset = _mm256_sub_epi64(_mm256_loadu_si256((const __m256i*)(p->data + i)),
+            _mm256_sub_epi64(_mm256_loadu_si256((const __m256i*)(n->center.data + i)), _mm256_set1_epi64x(bound)));
+        outside |= _mm256_movemask_pd(_mm256_castsi256_pd(
+            _mm256_cmpgt_epi64(length4, _mm256_xor_si256(offset, sign4)))) ^ 0xf;
+    }
+#endif
+    for (; i < D; i++)
+        outside |= (uint64_t)(p->data[i] - (n->center.data[i] - bound)) >= (uint64_t)n->length;
+    return !outside;
+#else
+    register coord_t bound = n->length * (coord_t)0.5;
+    register uint64_t outside = 0;
+#ifdef FLOAT32_COORDS
+#ifdef SIMD_AVX2
+    const __m256 bound8 = _mm256_set1_ps(bound);
+    for (; i + 8 <= D; i += 8) {
+        __m256 center = _mm256_loadu_ps(n->center.data + i), point = _mm256_loadu_ps(p->data + i);
+        outside |= _mm256_movemask_ps(_mm256_or_ps(
+            _mm256_cmp_ps(_mm256_sub_ps(center, bound8), point, _CMP_GT_OQ),
+            _mm256_cmp_ps(_mm256_add_ps(center, bound8), point, _CMP_LE_OQ)));
+    }
+#endif
+#ifdef SIMD_SSE2
+    const __m128 bound4 = _mm_set1_ps(bound);
+    for (; i + 4 <= D; i += 4) {
+        __m128 center = _mm_loadu_ps(n->center.data + i), point = _mm_loadu_ps(p->data + i);
+        outside |= _mm_movemask_ps(_mm_or_ps(_mm_cmpgt_ps(_mm_sub_ps(center, bound4), point),
+            _mm_cmple_ps(_mm_add_ps(center, bound4), point)));
+    }
+    // two floats in the low half, where the upper lanes compare zeros and are masked off
+    if (i + 2 <= D) {
+        __m128 center = _mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)(n->center.data + i))),
+            point = _mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)(p->data + i)));
+        outside |= _mm_movemask_ps(_mm_or_ps(_mm_cmpgt_ps(_mm_sub_ps(center, bound4), point),
+            _mm_cmple_ps(_mm_add_ps(center, bound4), point))) & 0x3;
+        i += 2;
+    }
+#endif
+#else
+#ifdef SIMD_AVX2
+    const __m256d bound4 = _mm256_set1_pd(bound), precision4 = _mm256_set1_pd(QUADRANT_PRECISION);
+    for (; i + 4 <= D; i += 4) {
+        __m256d center = _mm256_loadu_pd(n->center.data + i), point = _mm256_loadu_pd(p->data + i);
+        outside |= _mm256_movemask_pd(_mm256_or_pd(
+            _mm256_cmp_pd(_mm256_sub_pd(_mm256_sub_pd(center, bound4), precision4), point, _CMP_GT_OQ),
+            _mm256_cmp_pd(_mm256_sub_pd(_mm256_add_pd(center, bound4), precision4), point, _CMP_LE_OQ)));
+    }
+#endif
+#ifdef SIMD_SSE2
+    const __m128d bound2 = _mm_set1_pd(bound), precision2 = _mm_set1_pd(QUADRANT_PRECISION);
+    for (; i + 2 <= D; i += 2) {
+        __m128d center = _mm_loadu_pd(n->center.data + i), point = _mm_loadu_pd(p->data + i);
+        outside |= _mm_movemask_pd(_mm_or_pd(
+            _mm_cmpgt_pd(_mm_sub_pd(_mm_sub_pd(center, bound2), precision2), point),
+            _mm_cmple_pd(_mm_sub_pd(_mm_add_pd(center, bound2), precision2), point)));
+    }
+#endif
+#endif
+    if (outside)
+        return false;
+    for (; i < D; i++)
+        if ((n->center.data[i] - bound - (coord_t)QUADRANT_PRECISION > p->data[i]) ||
+                (n->center.data[i] + bound - (coord_t)QUADRANT_PRECISION <= p->data[i]))
+            return false;
+    return true;
+#endif
+}
+
+/*
+ * get_quadrant
+ *
+ * Returns the quadrant [0,2^D) that p is in, relative to the origin point.
+ *
+ * Let b = quadrant id in binary, with b[0] being the least significant bit. Then, b[0] corresponds
+ * to the first dimension, b[1] corresponds to the second, etc. such that b[i] corresponds to the
+ * (i + 1)th dimension. With SIMD_AVX2 or SIMD_SSE2 defined, these bits come straight out
+ * of the movemask of a vector compare, 4 or 2 dimensions at a time (8 or 4 with
+ * FLOAT32_COORDS).
+ *
+ * origin - the point representing the origin of the bounding square
+ * p - the point we're trying to find the quadrant of
+ *
+ * Returns the quadrant that p is in, relative to origin.
+ */
+static uint64_t get_quadrant(const Point * const origin, const Point * const p) {
+    //return (p->data[0] >= origin->data[0]) + 2 * (p->data[1] >= origin->data[1]);
+    register uint64_t i = 0;
+    uint64_t quadrant = 0;
+#ifdef INTEGER_GRID
+#ifdef SIMD_AVX2
+    // p >= origin in every lane where origin > p is false
+    for (; i + 4 <= D; i += 4)
+        quadrant |= (uint64_t)(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(
+            _mm256_loadu_si256((const __m256i*)(origin->data + i)),
+            _mm256_loadu_si256((const __m256i*)(p->data + i))))) ^ 0xf) << i;
+#endif
+    for (; i < D; i++)
+        quadrant |= (uint64_t)(p->data[i] >= origin->data[i]) << i;
+#else
+#ifdef FLOAT32_COORDS
+#ifdef SIMD_AVX2
+    for (; i + 8 <= D; i += 8)
+        quadrant |= (uint64_t)_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(p->data + i),
+            _mm256_loadu_ps(origin->data + i), _CMP_GE_OQ)) << i;
+#endif
+#ifdef SIMD_SSE2
+    for (; i + 4 <= D; i += 4)
+        quadrant |= (uint64_t)_mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(p->data + i),
+            _mm_loadu_ps(origin->data + i))) << i;
+    // the last two floats, with the upper lanes masked off
+    if (i + 2 <= D) {
+        quadrant |= (uint64_t)(_mm_movemask_ps(_mm_cmpge_ps(
+            _mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)(p->data + i))),
+            _mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)(origin->data + i))))) & 0x3) << i;
+        i += 2;
+    }
+#endif
+#else
+#ifdef SIMD_AVX2
+    const __m256d precision4 = _mm256_set1_pd(QUADRANT_PRECISION);
+    for (; i + 4 <= D; i += 4)
+        quadrant |= (uint64_t)_mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(p->data + i),
+            _mm256_sub_pd(_mm256_loadu_pd(origin->data + i), precision4), _CMP_GE_OQ)) << i;
+#endif
+#ifdef SIMD_SSE2
+    const __m128d precision2 = _mm_set1_pd(QUADRANT_PRECISION);
+    for (; i + 2 <= D; i += 2)
+        quadrant |= (uint64_t)_mm_movemask_pd(_mm_cmpge_pd(_mm_loadu_pd(p->data + i),
+            _mm_sub_pd(_mm_loadu_pd(origin->data + i), precision2))) << i;
+#endif
+#endif
+    for (; i < D; i++)
+        quadrant |= ((p->data[i] >= origin->data[i] - (coord_t)QUADRANT_PRECISION) & 1) << i;
+#endif
+    return quadrant;
+}
+
+/*
+ * get_new_center
+ *
+ * Given the current node and a quadrant, returns the Point representing
+ * the center of the square that represents that quadrant.
+ *
+ * node - the parent node
+ * quadrant - the quadrant to search for, [0, 2^D)
+ *
+ * Returns the center point for the given quadrant of node.
+ */
+static Point get_new_center(const Node * const node, const uint64_t quadrant) {
+    Point p;
+    register uint64_t i;
+#ifdef INTEGER_GRID
+    // the corner of the subsquare, plus half of its length
+    register coord_t half = node->length >> 1;
+    for (i = 0; i < D; i++)
+        p.data[i] = node->center.data[i] - half + ((quadrant >> i) & 1) * half + (half >> 1);
+#else
+    for (i = 0; i < D; i++)
+        p.data[i] = node->center.data[i] + (((quadrant >> i) & 1) - 0.5) * 0.5 * node->length;
+#endif
+    return p;
+}
+
+/*
+ * in_box
+ *
+ * Returns true if p is within the axis-aligned box [lo, hi], boundaries included.
+ *
+ * p - the point to check
+ * lo - the corner of the box with the smallest coordinate values
+ * hi - the corner of the box with the largest coordinate values
+ *
+ * Returns whether p is within the box.
+ */
+static bool in_box(const Point * const p, const Point * const lo, const Point * const hi) {
+    register uint64_t i;
+    for (i = 0; i < D; i++)
+        if (p->data[i] < lo->data[i] || p->data[i] > hi->data[i])
+            return false;
+    return true;
+}
+
+/*
+ * box_intersects
+ *
+ * Returns true if the square n overlaps the box [lo, hi] at all. Uses the same
+ * boundaries as in_range for the square, or with TIGHT_BOUNDS, the bounding box of the
+ * points below it.
+ *
+ * n - the square node to check
+ * lo - the corner of the box with the smallest coordinate values
+ * hi - the corner of the box with the largest coordinate values
+ *
+ * Returns whether n and the box overlap.
+ */
+static bool box_intersects(const Node * const n, const Point * const lo, const Point * const hi) {
+    register uint64_t i;
+#ifdef TIGHT_BOUNDS
+    for (i = 0; i < D; i++)
+        if (n->aggregate.lo.data[i] > hi->data[i] || n->aggregate.hi.data[i] < lo->data[i])
+            return false;
+#else
+    register float64_t bound = n->length * 0.5, center;
+    for (i = 0; i < D; i++) {
+        center = n->center.data[i] - (coord_t)QUADRANT_PRECISION;
+        if ((center - bound > hi->data[i]) || (center + bound <= lo->data[i]))
+            return false;
+    }
+#endif
+    return true;
+}
+
+/*
+ * box_contains
+ *
+ * Returns true if the square n lies completely within the box [lo, hi], or with
+ * TIGHT_BOUNDS, if the bounding box of the points below it does. Uses the same
+ * boundaries as in_range for the square.
+ *
+ * n - the square node to check
+ * lo - the corner of the box with the smallest coordinate values
+ * hi - the corner of the box with the largest coordinate values
+ *
+ * Returns whether every point of n is within the box.
+ */
+static bool box_contains(const Node * const n, const Point * const lo, const Point * const hi) {
+    register uint64_t i;
+#ifdef TIGHT_BOUNDS
+    for (i = 0; i < D; i++)
+        if (n->aggregate.lo.data[i] < lo->data[i] || n->aggregate.hi.data[i] > hi->data[i])
+            return false;
+#else
+    register float64_t bound = n->length * 0.5;
+#ifdef INTEGER_GRID
+    // the upper boundary itself is not in the square
+    for (i = 0; i < D; i++)
+        if ((n->center.data[i] - bound < lo->data[i]) || (n->center.data[i] + bound - 1 > hi->data[i]))
+            return false;
+#else
+    register float64_t center;
+    for (i = 0; i < D; i++) {
+        center = n->center.data[i] - (coord_t)QUADRANT_PRECISION;
+        if ((center - bound < lo->data[i]) || (center + bound > hi->data[i]))
+            return false;
+    }
+#endif
+#endif
+    return true;
+}
+
+/*
+ * min_distance_squared
+ *
+ * Returns the squared distance from p to the closest point of the square n, which is
+ * 0 if p is within n. Uses the same boundaries as in_range for the square, or with
+ * TIGHT_BOUNDS, measures to the bounding box of the points below n instead, which is no
+ * closer.
+ *
+ * n - the square node to measure to
+ * p - the point to measure from
+ *
+ * Returns the squared distance between p and n.
+ */
+static float64_t min_distance_squared(const Node * const n, const Point * const p) {
+    register float64_t distance = 0, delta;
+    register uint64_t i;
+#ifdef TIGHT_BOUNDS
+    for (i = 0; i < D; i++)
+        if ((delta = n->aggregate.lo.data[i] - p->data[i]) > 0 ||
+                (delta = p->data[i] - n->aggregate.hi.data[i]) > 0)
+            distance += delta * delta;
+#else
+    register float64_t bound = n->length * 0.5;
+    for (i = 0; i < D; i++) {
+        delta = abs(p->data[i] - (n->center.data[i] - (coord_t)QUADRANT_PRECISION)) - bound;
+        if (delta > 0)
+            distance += delta * delta;
+    }
+#endif
+    return distance;
+}
+
+/*
+ * exit_distance
+ *
+ * Returns the distance from p to the nearest boundary of the square n, using the same
+ * boundaries as in_range. Any point outside n is at least this far from p. Is not
+ * positive if p is outside n.
+ *
+ * n - the square node to measure to
+ * p - the point to measure from
+ *
+ * Returns the distance from p to the outside of n.
+ */
+static float64_t exit_distance(const Node * const n, const Point * const p) {
+    register float64_t bound = n->length * 0.5, distance = bound, delta;
+    register uint64_t i;
+    for (i = 0; i < D; i++) {
+        delta = bound - abs(p->data[i] - (n->center.data[i] - (coord_t)QUADRANT_PRECISION));
+        if (delta < distance)
+            distance = delta;
+    }
+    return distance;
+}
+
+#ifdef AGGREGATES
+/*
+ * QuadtreeAggregate_clear
+ *
+ * Sets aggregate to that of no points.
+ *
+ * aggregate - the aggregate to clear
+ */
+static inline void QuadtreeAggregate_clear(QuadtreeAggregate * const aggregate) {
+    register uint64_t i;
+    aggregate->weight = 0;
+    for (i = 0; i < D; i++) {
+        aggregate->sum[i] = 0;
+        aggregate->lo.data[i] = COORD_MAX;
+        aggregate->hi.data[i] = -COORD_MAX;
+    }
+}
+
+/*
+ * QuadtreeAggregate_extend
+ *
+ * Grows the bounding box of aggregate to contain the box [lo, hi].
+ *
+ * aggregate - the aggregate to grow
+ * lo - the corner of the box with the smallest coordinate values
+ * hi - the corner of the box with the largest coordinate values
+ */
+static inline void QuadtreeAggregate_extend(QuadtreeAggregate * const aggregate,
+        const Point * const lo, const Point * const hi) {
+    register uint64_t i;
+    for (i = 0; i < D; i++) {
+        if (lo->data[i] < aggregate->lo.data[i])
+            aggregate->lo.data[i] = lo->data[i];
+        if (hi->data[i] > aggregate->hi.data[i])
+            aggregate->hi.data[i] = hi->data[i];
+    }
+}
+
+/*
+ * QuadtreeAggregate_add
+ *
+ * Adds p, with the given weight, to aggregate.
+ *
+ * aggregate - the aggregate to add to
+ * p - the point to add
+ * weight - the weight of p
+ */
+static inline void QuadtreeAggregate_add(QuadtreeAggregate * const aggregate,
+        const Point * const p, const float64_t weight) {
+    register uint64_t i;
+    aggregate->weight += weight;
+    for (i = 0; i < D; i++)
+        aggregate->sum[i] += weight * p->data[i];
+    QuadtreeAggregate_extend(aggregate, p, p);
+}
+
+/*
+ * QuadtreeAggregate_merge
+ *
+ * Adds the points summarized by other to aggregate.
+ *
+ * aggregate - the aggregate to add to
+ * other - the aggregate to add
+ */
+static inline void QuadtreeAggregate_merge(QuadtreeAggregate * const aggregate,
+        const QuadtreeAggregate * const other) {
+    register uint64_t i;
+    aggregate->weight += other->weight;
+    for (i = 0; i < D; i++)
+        aggregate->sum[i] += other->sum[i];
+    QuadtreeAggregate_extend(aggregate, &other->lo, &other->hi);
+}
+
+/*
+ * QuadtreeAggregate_centroid
+ *
+ * Computes the weighted centroid of the points summarized by aggregate, in the units of
+ * the coordinates.
+ *
+ * aggregate - the aggregate of the points
+ * centroid - buffer for the D coordinates of the centroid
+ *
+ * Returns false if the points have no weight, and so no centroid, true otherwise.
+ */
+static inline bool QuadtreeAggregate_centroid(const QuadtreeAggregate * const aggregate,
+        float64_t centroid[D]) {
+    register uint64_t i;
+    if (aggregate->weight == 0)
+        return false;
+    for (i = 0; i < D; i++)
+        centroid[i] = aggregate->sum[i] / aggregate->weight;
+    return true;
+}
+#endif
+
+// number of bits per dimension in a Morton key
+#define MORTON_BITS 62
+
+/*
+ * struct MortonPoint_t
+ *
+ * A point along with its position in Morton (Z-) order within a root square, used to
+ * sort points so that points in the same square end up next to each other.
+ *
+ * key - the coordinates of the point as fixed-point offsets from the lower corner of
+ *     the root square, MORTON_BITS bits per dimension
+ * point - the point itself
+ * index - the position of the point in the array it came from
+ */
+typedef struct MortonPoint_t {
+    uint64_t key[D];
+    Point point;
+    uint64_t index;
+} MortonPoint;
+
+/*
+ * MortonPoint_init
+ *
+ * Computes the Morton key of p within the square root.
+ *
+ * Coordinates are shifted by QUADRANT_PRECISION first, so that points that get_quadrant
+ * places on the upper side of a boundary also sort after it. With INTEGER_GRID defined,
+ * the key is just the offset of p from the corner of root, which is exact.
+ *
+ * mp - the MortonPoint to initialize
+ * root - the square that p is in
+ * p - the point
+ * index - the position of p in the array it came from
+ */
+static void MortonPoint_init(MortonPoint * const mp, const Node * const root,
+        const Point * const p, const uint64_t index) {
+    register uint64_t i;
+#ifdef INTEGER_GRID
+    for (i = 0; i < D; i++)
+        mp->key[i] = (uint64_t)(p->data[i] - (root->center.data[i] - (root->length >> 1)));
+#else
+    register float64_t scale = (float64_t)(1ULL << MORTON_BITS) / root->length, offset;
+    for (i = 0; i < D; i++) {
+        offset = (p->data[i] + QUADRANT_PRECISION - root->center.data[i] + 0.5 * root->length) * scale;
+        if (offset < 0)
+            mp->key[i] = 0;
+        else if (offset >= (float64_t)(1ULL << MORTON_BITS))
+            mp->key[i] = (1ULL << MORTON_BITS) - 1;
+        else
+            mp->key[i] = (uint64_t)offset;
+    }
+#endif
+    mp->point = *p;
+    mp->index = index;
+}
+
+/*
+ * MortonPoint_compare
+ *
+ * Comparator for qsort that orders MortonPoints in Morton order, without interleaving
+ * the keys: the dimension with the highest differing bit decides, and ties go to the
+ * higher dimension, as in the quadrant numbering used by get_quadrant.
+ *
+ * a - the first MortonPoint
+ * b - the second MortonPoint
+ *
+ * Returns a negative number, 0, or a positive number if a comes before, at the same
+ * place as, or after b respectively.
+ */
+static int MortonPoint_compare(const void *a, const void *b) {
+    const uint64_t * const x = ((const MortonPoint*)a)->key, * const y = ((const MortonPoint*)b)->key;
+    register uint64_t i, dimension = D - 1, highest = x[D - 1] ^ y[D - 1], bits;
+    for (i = D - 1; i-- > 0;) {
+        bits = x[i] ^ y[i];
+        // true iff the highest set bit of bits is above that of highest
+        if (highest < bits && highest < (highest ^ bits)) {
+            highest = bits;
+            dimension = i;
+        }
+    }
+    return (x[dimension] > y[dimension]) - (x[dimension] < y[dimension]);
+}
+
+// the most levels that a point goes on
+#define MAX_HEIGHT 65
+
+/*
+ * get_height
+ *
+ * Returns the number of levels that p goes on, bottom-most level included, when a point
+ * on one level is also on the level above with the given probability.
+ *
+ * p goes on more than h levels iff its hash is below promotion^h * 2^64, which for
+ * uniform hashes happens with probability promotion^h. For the default of 1/2, that is
+ * the number of leading zero bits of the hash plus one. Either way, no point goes on
+ * more than MAX_HEIGHT levels, which only a hash of 0 reaches with the default.
+ *
+ * p - the point
+ * promotion - the probability of promotion, in [0, 1)
+ *
+ * Returns the number of levels, in [1, MAX_HEIGHT].
+ */
+static inline uint64_t get_height(const Point * const p, const float64_t promotion) {
+    register const uint64_t hash = Point_hash(p);
+    if (promotion == 0.5)
+        return hash == 0 ? MAX_HEIGHT : 1 + __builtin_clzll(hash);
+
+    register uint64_t height = 1;
+    register float64_t bound;
+    for (bound = promotion * 0x1p64; (float64_t)hash < bound && height < MAX_HEIGHT;
+            bound *= promotion)
+        height++;
+    return height;
+}
+
+/*
+ * get_split_square
+ *
+ * Given a square and two points that fall into the same quadrant of it, finds the
+ * largest subsquare of that quadrant that has the two points in different quadrants.
+ * This is the square that has to be added to the compressed tree to hold both points.
+ *
+ * Rather than halving the square until the points separate, which takes one step per
+ * level in between, the level of the subsquare is read off the highest bit in which the
+ * Morton keys of the two points differ, and its corner off the bits above that. Without
+ * INTEGER_GRID, the keys are only as precise as MortonPoint_init makes them, so the
+ * result is checked, and the halving is still used when the keys cannot tell the points
+ * apart or disagree with get_quadrant near a boundary.
+ *
+ * node - the square that both points are in
+ * a - the first point
+ * b - the second point
+ * center - buffer for the center of the subsquare
+ * length - buffer for the length of the subsquare
+ */
+static void get_split_square(const Node * const node, const Point * const a,
+        const Point * const b, Point * const center, coord_t * const length) {
+    register uint64_t i, bits = 0, shift;
+#ifdef INTEGER_GRID
+    register coord_t corner;
+    for (i = 0; i < D; i++) {
+        corner = node->center.data[i] - (node->length >> 1);
+        bits |= (uint64_t)(a->data[i] - corner) ^ (uint64_t)(b->data[i] - corner);
+    }
+
+    // the subsquare is the smallest whose length is past the highest differing bit
+    shift = 64 - __builtin_clzll(bits);
+    *length = (coord_t)1 << shift;
+    for (i = 0; i < D; i++) {
+        corner = node->center.data[i] - (node->length >> 1);
+        center->data[i] = corner + ((a->data[i] - corner) & -*length) + (*length >> 1);
+    }
+#else
+    Node square;
+    MortonPoint x, y;
+    MortonPoint_init(&x, node, a, 0);
+    MortonPoint_init(&y, node, b, 0);
+    for (i = 0; i < D; i++)
+        bits |= x.key[i] ^ y.key[i];
+
+    register uint64_t quadrant;
+    if (bits != 0) {
+        shift = 64 - __builtin_clzll(bits);
+        square.length = node->length * ((float64_t)(1ULL << shift) / (float64_t)(1ULL << MORTON_BITS));
+        for (i = 0; i < D; i++)
+            square.center.data[i] = node->center.data[i] - 0.5 * node->length +
+                (x.key[i] >> shift) * square.length + 0.5 * square.length;
+        if (in_range(&square, a) && in_range(&square, b) &&
+                get_quadrant(&square.center, a) != get_quadrant(&square.center, b)) {
+            *center = square.center;
+            *length = square.length;
+            return;
+        }
+    }
+
+    quadrant = get_quadrant(&node->center, a);
+    square.center = get_new_center(node, quadrant);
+    square.length = node->length / 2;
+
+    // keep halving until a and b are in different quadrants
+    while ((quadrant = get_quadrant(&square.center, a)) == get_quadrant(&square.center, b)) {
+        square.center = get_new_center(&square, quadrant);
+        square.length /= 2;
+    }
+
+    *center = square.center;
+    *length = square.length;
+#endif
+}
+
+// size of the buffer that snapshots are written and read through
+#define SNAPSHOT_BUFFER_SIZE (1 << 20)
+
+// number of points that the buffers of a snapshot being read start with, before they
+// grow by doubling
+#define SNAPSHOT_POINTS 1024
+
+// first number of a snapshot, "SKQT01" read as a little-endian integer, which changes
+// with the format
+#define SNAPSHOT_MAGIC 0x313054514b53ULL
+
+// the type of coordinate, which snapshots are only read back with
+#ifdef INTEGER_GRID
+#define SNAPSHOT_COORDS (2 + 4 * (uint64_t)GRID_RESOLUTION)
+#elif defined(FLOAT32_COORDS)
+#define SNAPSHOT_COORDS 1
+#else
+#define SNAPSHOT_COORDS 0
+#endif
+
+/*
+ * struct QuadtreeStream_t
+ *
+ * A buffer that a snapshot is written to or read from a file descriptor through.
+ *
+ * A snapshot is a sequence of unsigned LEB128 varints: SNAPSHOT_MAGIC, the dimensions,
+ * SNAPSHOT_COORDS, COUNT_REPEATS, the bits of the promotion probability, the number of
+ * points, and the root square, then the points. Each coordinate is written as the
+ * zigzag-encoded difference between its key and that of the same coordinate of the
+ * point before, starting from 0, where keys are integers in the same order as the
+ * coordinates. With MULTISET defined, each point is followed by its multiplicity.
+ *
+ * fd - the file descriptor
+ * size - when reading, the number of bytes in buffer
+ * position - the next byte of buffer to write or read
+ * key - the keys of the coordinates of the last point written or read
+ * buffer - the buffered bytes
+ */
+typedef struct QuadtreeStream_t {
+    int fd;
+    uint64_t size, position;
+    uint64_t key[D];
+    uint8_t buffer[SNAPSHOT_BUFFER_SIZE];
+} QuadtreeStream;
+
+/*
+ * QuadtreeStream_new
+ *
+ * Allocates an empty stream on the given file descriptor.
+ *
+ * fd - the file descriptor
+ *
+ * Returns a pointer to the stream, to be released with free, or NULL if it could not
+ * be allocated.
+ */
+static QuadtreeStream* QuadtreeStream_new(const int fd) {
+    QuadtreeStream *stream = (QuadtreeStream*)malloc(sizeof(*stream));
+    if (stream != NULL) {
+        stream->fd = fd;
+        stream->size = stream->position = 0;
+        memset(stream->key, 0, sizeof(stream->key));
+    }
+    return stream;
+}
+
+/*
+ * QuadtreeStream_flush
+ *
+ * Writes out the bytes in the buffer of stream and empties it.
+ *
+ * stream - the stream to flush
+ *
+ * Returns false if a write failed, true otherwise.
+ */
+static bool QuadtreeStream_flush(QuadtreeStream * const stream) {
+    register uint64_t written = 0;
+    register ssize_t result;
+    while (written < stream->position) {
+        result = write(stream->fd, stream->buffer + written, stream->position - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return false;
+        written += result;
+    }
+    stream->position = 0;
+    return true;
+}
+
+/*
+ * QuadtreeStream_put
+ *
+ * Writes x to stream as a varint, flushing the buffer first if x might not fit.
+ *
+ * stream - the stream to write to
+ * x - the number to write
+ *
+ * Returns false if a write failed, true otherwise.
+ */
+static inline bool QuadtreeStream_put(QuadtreeStream * const stream, uint64_t x) {
+    // a varint takes at most 10 bytes
+    if (stream->position + 10 > SNAPSHOT_BUFFER_SIZE && !QuadtreeStream_flush(stream))
+        return false;
+    for (; x >= 0x80; x >>= 7)
+        stream->buffer[stream->position++] = (uint8_t)x | 0x80;
+    stream->buffer[stream->position++] = (uint8_t)x;
+    return true;
+}
+
+/*
+ * QuadtreeStream_get
+ *
+ * Reads a varint from stream, refilling the buffer when it runs out.
+ *
+ * stream - the stream to read from
+ * x - buffer for the number read
+ *
+ * Returns false if a read failed or the snapshot ended or is malformed, with errno set,
+ * true otherwise.
+ */
+static inline bool QuadtreeStream_get(QuadtreeStream * const stream, uint64_t * const x) {
+    register uint64_t value = 0, shift = 0, byte;
+    register ssize_t result;
+    do {
+        if (stream->position == stream->size) {
+            do
+                result = read(stream->fd, stream->buffer, SNAPSHOT_BUFFER_SIZE);
+            while (result < 0 && errno == EINTR);
+            if (result <= 0) {
+                if (result == 0)
+                    errno = EINVAL;
+                return false;
+            }
+            stream->size = result;
+            stream->position = 0;
+        }
+        if (shift > 63) {
+            errno = EINVAL;
+            return false;
+        }
+        byte = stream->buffer[stream->position++];
+        value |= (byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    *x = value;
+    return true;
+}
+
+/*
+ * coord_key
+ *
+ * Maps a coordinate to an integer key, so that coordinates close to each other get keys
+ * close to each other. For floating-point coordinates, this is their bits, with the
+ * negative ones flipped so that the keys are in the same order as the coordinates.
+ *
+ * x - the coordinate
+ *
+ * Returns the key, which coord_from_key maps back to exactly x.
+ */
+static inline uint64_t coord_key(const coord_t x) {
+#ifdef INTEGER_GRID
+    return (uint64_t)x;
+#elif defined(FLOAT32_COORDS)
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits >> 31 ? (uint32_t)~bits : bits | (1U << 31);
+#else
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits >> 63 ? ~bits : bits | (1ULL << 63);
+#endif
+}
+
+/*
+ * coord_from_key
+ *
+ * Maps a key from coord_key back to its coordinate.
+ *
+ * key - the key
+ *
+ * Returns the coordinate.
+ */
+static inline coord_t coord_from_key(const uint64_t key) {
+    coord_t x;
+#ifdef INTEGER_GRID
+    x = (coord_t)key;
+#elif defined(FLOAT32_COORDS)
+    uint32_t bits = key >> 31 ? (uint32_t)key & ~(1U << 31) : ~(uint32_t)key;
+    memcpy(&x, &bits, sizeof(x));
+#else
+    uint64_t bits = key >> 63 ? key & ~(1ULL << 63) : ~key;
+    memcpy(&x, &bits, sizeof(x));
+#endif
+    return x;
+}
+
+/*
+ * QuadtreeStream_put_header
+ *
+ * Writes the header of a snapshot to stream.
+ *
+ * stream - the stream to write to
+ * root - the root square of the tree
+ * promotion - the promotion probability of the tree
+ * n - the number of points that follow
+ *
+ * Returns false if a write failed, true otherwise.
+ */
+static bool QuadtreeStream_put_header(QuadtreeStream * const stream, const Node * const root,
+        const float64_t promotion, const uint64_t n) {
+    register uint64_t i;
+    uint64_t bits;
+    memcpy(&bits, &promotion, sizeof(bits));
+    if (!QuadtreeStream_put(stream, SNAPSHOT_MAGIC) || !QuadtreeStream_put(stream, D) ||
+            !QuadtreeStream_put(stream, SNAPSHOT_COORDS) || !QuadtreeStream_put(stream, COUNT_REPEATS) ||
+            !QuadtreeStream_put(stream, bits) || !QuadtreeStream_put(stream, n) ||
+            !QuadtreeStream_put(stream, coord_key(root->length)))
+        return false;
+    for (i = 0; i < D; i++)
+        if (!QuadtreeStream_put(stream, coord_key(root->center.data[i])))
+            return false;
+    return true;
+}
+
+/*
+ * QuadtreeStream_get_header
+ *
+ * Reads the header of a snapshot from stream, checking that it comes from a build with
+ * the same settings and that its promotion probability is in [0, 1).
+ *
+ * stream - the stream to read from
+ * length - buffer for the length of the root square
+ * center - buffer for the center of the root square
+ * promotion - buffer for the promotion probability
+ * n - buffer for the number of points
+ *
+ * Returns false with errno set if reading failed or the header does not match, true
+ * otherwise.
+ */
+static bool QuadtreeStream_get_header(QuadtreeStream * const stream, coord_t * const length,
+        Point * const center, float64_t * const promotion, uint64_t * const n) {
+    register uint64_t i;
+    uint64_t magic, dimensions, coords, repeats, bits, key;
+    if (!QuadtreeStream_get(stream, &magic) || !QuadtreeStream_get(stream, &dimensions) ||
+            !QuadtreeStream_get(stream, &coords) || !QuadtreeStream_get(stream, &repeats) ||
+            !QuadtreeStream_get(stream, &bits) || !QuadtreeStream_get(stream, n) ||
+            !QuadtreeStream_get(stream, &key))
+        return false;
+    if (magic != SNAPSHOT_MAGIC || dimensions != D || coords != SNAPSHOT_COORDS ||
+            repeats != COUNT_REPEATS) {
+        errno = EINVAL;
+        return false;
+    }
+    memcpy(promotion, &bits, sizeof(*promotion));
+    if (!(*promotion >= 0 && *promotion < 1)) {
+        errno = EINVAL;
+        return false;
+    }
+    *length = coord_from_key(key);
+    for (i = 0; i < D; i++) {
+        if (!QuadtreeStream_get(stream, &key))
+            return false;
+        center->data[i] = coord_from_key(key);
+    }
+    return true;
+}
+
+/*
+ * QuadtreeStream_put_point
+ *
+ * Writes the point of a point node to stream, after the point written before it.
+ *
+ * stream - the stream to write to
+ * node - the point node on the bottom-most level
+ *
+ * Returns false if a write failed, true otherwise.
+ */
+static inline bool QuadtreeStream_put_point(QuadtreeStream * const stream, const Node * const node) {
+    register uint64_t i, key;
+    register int64_t delta;
+    for (i = 0; i < D; i++) {
+        key = coord_key(node->center.data[i]);
+        delta = (int64_t)(key - stream->key[i]);
+        stream->key[i] = key;
+        if (!QuadtreeStream_put(stream, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63)))
+            return false;
+    }
+#ifdef MULTISET
+    return QuadtreeStream_put(stream, node->multiplicity);
+#else
+    return true;
+#endif
+}
+
+/*
+ * QuadtreeStream_get_points
+ *
+ * Reads the points of a snapshot from stream into sorted, in Morton order within root.
+ *
+ * The points are checked to be within root, and sorted again if they are out of order,
+ * which only happens to snapshots written with a different QUADRANT_PRECISION. The
+ * buffers grow as the points are read rather than being sized by n up front, so that a
+ * header that claims more points than the snapshot holds runs into the end of the
+ * snapshot instead of a huge or overflowing allocation.
+ *
+ * stream - the stream to read from, past the header
+ * root - the root square of the tree being loaded
+ * sorted - set to a buffer of the n points, which the caller frees, also on failure
+ * multiplicities - with MULTISET defined, set to a buffer of the multiplicity of each
+ *     point, in the order the points were read, which the caller frees likewise
+ * n - the number of points
+ *
+ * Returns false with errno set if reading failed, memory ran out or a point is malformed,
+ * true otherwise.
+ */
+static bool QuadtreeStream_get_points(QuadtreeStream * const stream, const Node * const root,
+        MortonPoint ** const sorted, uint64_t ** const multiplicities, const uint64_t n) {
+    register uint64_t i, j, capacity = 0;
+    register bool in_order = true;
+    uint64_t zigzag;
+    Point p;
+    void *grown;
+    *sorted = NULL;
+    *multiplicities = NULL;
+    for (i = 0; i < n; i++) {
+        if (i == capacity) {
+            capacity = SNAPSHOT_POINTS + capacity * 2;
+            if (capacity > n)
+                capacity = n;
+            if ((grown = realloc(*sorted, sizeof(**sorted) * capacity)) == NULL)
+                return false;
+            *sorted = (MortonPoint*)grown;
+#ifdef MULTISET
+            if ((grown = realloc(*multiplicities, sizeof(**multiplicities) * capacity)) == NULL)
+                return false;
+            *multiplicities = (uint64_t*)grown;
+#endif
+        }
+        for (j = 0; j < D; j++) {
+            if (!QuadtreeStream_get(stream, &zigzag))
+                return false;
+            stream->key[j] += (zigzag >> 1) ^ -(zigzag & 1);
+            p.data[j] = coord_from_key(stream->key[j]);
+        }
+#ifdef MULTISET
+        if (!QuadtreeStream_get(stream, &(*multiplicities)[i]))
+            return false;
+        if ((*multiplicities)[i] == 0) {
+            errno = EINVAL;
+            return false;
+        }
+#endif
+        if (!in_range(root, &p)) {
+            errno = EINVAL;
+            return false;
+        }
+        MortonPoint_init(&(*sorted)[i], root, &p, i);
+        in_order &= i == 0 || MortonPoint_compare(&(*sorted)[i - 1], &(*sorted)[i]) <= 0;
+    }
+    if (!in_order)
+        qsort(*sorted, n, sizeof(**sorted), MortonPoint_compare);
+    return true;
 }
 
 #ifdef QUADTREE_TEST
@@ -319,13 +2027,13 @@ static inline void Node_string(const Node * const node, char * const buffer) {
     Point_string(&node->center, pbuf);
     sprintf(buffer, "Node{id = %llu, is_square = %s, center = %s, length = %lf, parent = %s, up = %s, down = %s, children = {%s",
         (unsigned long long)node->id,
-        (node->is_square ? "YES" : "NO"), pbuf, node->length,
+        (node->is_square ? "YES" : "NO"), pbuf, node->is_square ? (float64_t)node->length : 0.0,
         (node->parent == NULL ? "NO" : "YES"), (node->up == NULL ? "NO" : "YES"),
         (node->down == NULL ? "NO" : "YES"),
-        (node->children[0] == NULL ? "NO" : "YES"));
+        (!node->is_square || Node_child(node, 0) == NULL ? "NO" : "YES"));
 	uint64_t i = 1;
 	for (i = 1; i < (1LL << D); i++) {
-		sprintf(buffer, "%s, %s", buffer, (node->children[i] == NULL ? "NO" : "YES"));
+		sprintf(buffer, "%s, %s", buffer, (!node->is_square || Node_child(node, i) == NULL ? "NO" : "YES"));
 	}
 	sprintf(buffer, "%s}}", buffer);
     /*sprintf(buffer, "Node{is_square = %s, center = (%f, %f), length = %lf, parent = %p, up = %p, down = %p, children = {%p, %p, %p, %p}}",
@@ -343,14 +2051,14 @@ static void print(const Node * const n) {
     else {
         char pbuf[100];
         Point_string((Point*)&n->center, pbuf);
-        printf("pointer = %p, is_square = %s, center = %s, length = %llu, parent = %p, up = %p, down = %p, children = {%p, %p, %p, %p}, dirty = %s, lock = %p\n", n, n->is_square ? "true" : "false", pbuf, (unsigned long long)n->length,
+        printf("pointer = %p, is_square = %s, center = %s, length = %llu, parent = %p, up = %p, down = %p, children = {%p, %p, %p, %p}, dirty = %s, lock = %p\n", n, n->is_square ? "true" : "false", pbuf, n->is_square ? (unsigned long long)n->length : 0ULL,
             !Node_valid(n->parent) ? NULL : n->parent,
             !Node_valid(n->up) ? NULL : n->up,
             !Node_valid(n->down) ? NULL : n->down,
-            !Node_valid(n->children[0]) ? NULL : n->children[0],
-            !Node_valid(n->children[1]) ? NULL : n->children[1],
-            !Node_valid(n->children[2]) ? NULL : n->children[2],
-            !Node_valid(n->children[3]) ? NULL : n->children[3],
+            !n->is_square || !Node_valid(Node_child(n, 0)) ? NULL : Node_child(n, 0),
+            !n->is_square || !Node_valid(Node_child(n, 1)) ? NULL : Node_child(n, 1),
+            !n->is_square || !Node_valid(Node_child(n, 2)) ? NULL : Node_child(n, 2),
+            !n->is_square || !Node_valid(Node_child(n, 3)) ? NULL : Node_child(n, 3),
             "false", NULL
             );
     }
@@ -2,12 +2,20 @@
 Parallel implementation of compressed skip quadtree using RLU
 */
 
+// squares keep no counts of the points below them, as every add and remove would have to
+// lock the whole path up to the root
+#ifdef SUBTREE_COUNTS
+#error "ParallelSkipQuadtree keeps no subtree counts; build without -DSUBTREE_COUNTS"
+#endif
+
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "../types.h"
 #include "../Quadtree.h"
 #include "../Point.h"
+#include "../util.h"
 
 // rlu_self
 __thread rlu_thread_data_t *rlu_self = NULL;
@@ -15,6 +23,7 @@ __thread rlu_thread_data_t *rlu_self = NULL;
 // rand() functions
 #ifdef QUADTREE_TEST
 extern uint32_t test_rand();
+extern bool test_rand_fed();
 #define rand() test_rand()
 #else
 extern uint32_t Marsaglia_rand();
@@ -23,25 +32,62 @@ extern void Marsaglia_srand(uint32_t);
 #define srand(x) Marsaglia_srand(x)
 #endif
 
+// initial capacity of the stack used by Quadtree_remove_node
+#define REMOVE_STACK_SIZE 64
+
+// most neighbors that Quadtree_nearest_helper makes room for before it finds them
+#define NEAREST_HEAP_SIZE 64
+
+// number of searches that Quadtree_search_batch keeps in flight
+#define SEARCH_BATCH_WIDTH 16
+
+// number of searches that Quadtree_search_batch runs per read-side critical section
+#define SEARCH_BATCH_GROUP 256
+
 // quadtree counter
 #ifdef QUADTREE_TEST
 uint64_t QUADTREE_NODE_COUNT = 0;
 #endif
 
-#define TRY_OR_FAIL(node) if (!RLU_TRY_LOCK(rlu_self, &node)) {return NULL;}
+// nodes differ in size, so locks take the size of the node rather than sizeof(Node)
+#define TRY_LOCK(node) rlu_try_lock(rlu_self, (intptr_t**)&node, Node_size(node))
+#define TRY_OR_FAIL(node) if (!TRY_LOCK(node)) {return NULL;}
+#define TRY_OR_ABORT(node) if (!TRY_LOCK(node)) {goto remove_abort;}
 #define DEREF(node) (Node*)RLU_DEREF(rlu_self, node)
 
-Node* Node_init(const float64_t length, const Point center) {
-    Node *node = (Node*)RLU_ALLOC(sizeof(Node));
-    node->is_square = false;
-    node->length = length;
+/*
+ * Node_new_sized
+ *
+ * Allocates size bytes for and initializes an empty node.
+ *
+ * size - the number of bytes to allocate, at least the size of the node
+ * length - the length of the square; unused for a point
+ * center - the center of the node
+ * is_square - whether the node is a square
+ * is_bottom - whether the node is a point on the lowest level
+ *
+ * Returns a pointer to the created node.
+ */
+static Node* Node_new_sized(const uint64_t size, const coord_t length, const Point center,
+        const bool is_square, const bool is_bottom) {
+    Node *node = (Node*)RLU_ALLOC(size);
+    node->is_square = is_square;
+    node->is_bottom = is_bottom;
     node->center = center;
     node->parent = NULL;
     node->up = NULL;
     node->down = NULL;
-    uint64_t i;
-    for(i = 0; i < (1 << D); i++) {
-        node->children[i] = NULL;
+    if (is_bottom) {
+        node->value = NULL;
+#ifdef MULTISET
+        node->multiplicity = 1;
+#endif
+    }
+    if (is_square) {
+        node->length = length;
+        node->num_children = 0;
+        node->capacity = INLINE_CHILDREN;
+        memset(node->bitmap, 0, sizeof(node->bitmap));
     }
 #ifdef QUADTREE_TEST
     node->id = QUADTREE_NODE_COUNT++;
@@ -49,10 +95,90 @@ Node* Node_init(const float64_t length, const Point center) {
     return node;
 }
 
-Quadtree* Quadtree_init(const float64_t length, const Point center) {
-    Quadtree *qtree = Node_init(length, center);
-    qtree->is_square = true;
-    return qtree;
+/*
+ * Node_new
+ *
+ * Allocates memory for and initializes an empty node. Point nodes are allocated without
+ * room for the fields that only squares have, and the copies of a point on the levels
+ * above the lowest also without room for its value and multiplicity.
+ *
+ * length - the length of the square; unused for a point
+ * center - the center of the node
+ * is_square - whether the node is a square
+ * is_bottom - whether the node is a point on the lowest level
+ *
+ * Returns a pointer to the created node.
+ */
+static inline Node* Node_new(const coord_t length, const Point center, const bool is_square,
+        const bool is_bottom) {
+    return Node_new_sized(is_square ? sizeof(Node) : is_bottom ? BOTTOM_NODE_SIZE : POINT_NODE_SIZE,
+        length, center, is_square, is_bottom);
+}
+
+/*
+ * struct QuadtreeSettings_t
+ *
+ * The settings of a tree. There is no arena to keep them in, so they are kept right after
+ * the root square that Quadtree_init returns, and never written once the tree is shared.
+ *
+ * promotion - the probability that a point on one level is also on the level above
+ */
+typedef struct QuadtreeSettings_t {
+    float64_t promotion;
+} QuadtreeSettings;
+
+/*
+ * Quadtree_settings
+ *
+ * Returns the settings of the tree with the given root.
+ *
+ * root - the root node of the tree, as returned by Quadtree_init
+ */
+static inline QuadtreeSettings* Quadtree_settings(const Quadtree * const root) {
+    return (QuadtreeSettings*)((char*)root + sizeof(Node));
+}
+
+Node* Node_init(const coord_t length, const Point center) {
+    return Node_new(0, center, false, true);
+}
+
+Quadtree* Quadtree_init(const coord_t length, const Point center) {
+    Quadtree *root = Node_new_sized(sizeof(Node) + sizeof(QuadtreeSettings), length, center,
+        true, false);
+    Quadtree_settings(root)->promotion = PROMOTION_PROBABILITY;
+    return root;
+}
+
+bool Quadtree_set_promotion(Quadtree * const root, const float64_t promotion) {
+    // also false for NaN
+    if (!(promotion >= 0 && promotion < 1))
+        return false;
+    Quadtree_settings(root)->promotion = promotion;
+    return true;
+}
+
+/*
+ * Quadtree_height
+ *
+ * Returns the number of levels that p goes on in the tree with the given root.
+ *
+ * Under QUADTREE_TEST, while test_rand is being fed, the levels are drawn from it instead
+ * of hashed, so that tests can lay out the levels themselves.
+ *
+ * root - the root node of the tree, as returned by Quadtree_init
+ * p - the point
+ *
+ * Returns the number of levels, at least 1.
+ */
+static inline uint64_t Quadtree_height(const Quadtree * const root, const Point * const p) {
+#ifdef QUADTREE_TEST
+    register uint64_t height;
+    if (test_rand_fed()) {
+        for (height = 1; rand() % 100 < 50 && height < MAX_HEIGHT; height++);
+        return height;
+    }
+#endif
+    return get_height(p, Quadtree_settings(root)->promotion);
 }
 
 /*
@@ -63,56 +189,121 @@ Quadtree* Quadtree_init(const float64_t length, const Point center) {
  * node - the node to be freed
  */
 static inline void Node_free(const Node *node) {
+    if (node->is_square && node->capacity > INLINE_CHILDREN)
+        RLU_FREE(rlu_self, node->children);
     RLU_FREE(rlu_self, (void*)node);
 }
 
+/*
+ * Node_set_child
+ *
+ * Sets the child of a locked square in the given quadrant, adding, replacing, or removing
+ * it.
+ *
+ * Children that fit in the square itself are part of the locked copy. A separate children
+ * array, however, may still be read by other threads, so it is never written in place.
+ * Instead, the square gets a new array of exactly the right size, and the old one is
+ * returned, to be freed once the change is certain to be committed.
+ *
+ * square - the locked copy of the square to change
+ * quadrant - the quadrant, [0, 2^D)
+ * child - the new child; NULL to remove the child in the quadrant
+ *
+ * Returns the old children array of the square, or NULL if there is nothing to free.
+ */
+static Node** Node_set_child(Node * const square, const uint64_t quadrant, Node * const child) {
+    register uint64_t word = quadrant / 64, bit = 1ULL << quadrant % 64;
+    register uint64_t index = Node_child_index(square, quadrant);
+    register bool present = (square->bitmap[word] & bit) != 0, added = child != NULL;
+    register uint64_t num_children = square->num_children - present + added;
+    Node *inline_children[INLINE_CHILDREN], **old_children = Node_children(square), **children;
+
+    if (!present && !added)
+        return NULL;
+
+    // build the new children, then put them in place
+    children = num_children > INLINE_CHILDREN ?
+        (Node**)RLU_ALLOC(sizeof(Node*) * num_children) : inline_children;
+    memcpy(children, old_children, sizeof(Node*) * index);
+    if (added)
+        children[index] = child;
+    memcpy(children + index + added, old_children + index + present,
+        sizeof(Node*) * (square->num_children - index - present));
+
+    if (square->capacity <= INLINE_CHILDREN)
+        old_children = NULL;
+    if (num_children > INLINE_CHILDREN) {
+        square->children = children;
+        square->capacity = num_children;
+    }
+    else {
+        memcpy(square->inline_children, inline_children, sizeof(inline_children));
+        square->capacity = INLINE_CHILDREN;
+    }
+    square->bitmap[word] = (square->bitmap[word] & ~bit) | (added ? bit : 0);
+    square->num_children = num_children;
+    return old_children;
+}
+
+/*
+ * Node_set_children
+ *
+ * Gives an empty square its first two children, which must be in different quadrants.
+ *
+ * square - the locked copy of the square, or the square itself if not yet published
+ * a_quadrant - the quadrant of the first child
+ * a - the first child
+ * b_quadrant - the quadrant of the second child
+ * b - the second child
+ */
+static void Node_set_children(Node * const square, const uint64_t a_quadrant, Node * const a,
+        const uint64_t b_quadrant, Node * const b) {
+    register bool a_first = a_quadrant < b_quadrant;
+    square->inline_children[!a_first] = a;
+    square->inline_children[a_first] = b;
+    square->bitmap[a_quadrant / 64] |= 1ULL << a_quadrant % 64;
+    square->bitmap[b_quadrant / 64] |= 1ULL << b_quadrant % 64;
+    square->num_children = 2;
+}
+
 /*
  * Quadtree_search_helper
  *
- * Recursive helper function to traverse the tree horizontally before dropping levels.
+ * Iterative helper function to traverse the tree horizontally before dropping levels.
  *
  * Invariant: node is always a square.
  *
  * node - the square to look in
  * p - the point to search for
  *
- * Returns whether p is in node.
+ * Returns the node of p on the topmost level that it is found on, or NULL if p is not in
+ * node.
  */
-bool Quadtree_search_helper(const Node * const node, const Point *p) {
-    Node *current = DEREF(node);
-
-    if (!in_range(node, p))
-        return false;
-
-    register uint8_t quadrant = get_quadrant(&current->center, p);
-    Node *child = DEREF(current->children[quadrant]);
-    Node *down = DEREF(current->down);
-
-    // if the target child is NULL, we try to drop down a level
-    if (child == NULL) {
-        if (down != NULL)
-            return Quadtree_search_helper(down, p);
-        // otherwise, we're on the bottom-most level and just can't find the point
-        else
-            return false;
-    }
+Node* Quadtree_search_helper(const Node * const node, const Point *p) {
+    Node *current = DEREF(node), *child_node, *child;
 
-    // here, the child exists
+    if (!in_range(current, p))
+        return NULL;
 
-    // if is a square, move to it and recurse
-    if (child->is_square)
-        return Quadtree_search_helper(child, p);
+    while (true) {
+        child_node = Node_child(current, get_quadrant(&current->center, p));
+        child = DEREF(child_node);
 
-    // otherwise, we check if the child point matches, since it's a point node
-    if (Point_equals(&child->center, p))
-        return true;
+        // if the child is a square containing p, move to it
+        if (Node_valid(child) && child->is_square && in_range(child, p)) {
+            current = child;
+            continue;
+        }
 
-    // if we're here, then we need to branch down a level
-    if (down != NULL)
-        return Quadtree_search_helper(down, p);
+        // otherwise, we check if the child point matches, if it is a point node
+        if (Node_valid(child) && !child->is_square && Point_equals(&child->center, p))
+            return child;
 
-    // here, we have nowhere else to search for, so we give up
-    return false;
+        // if we're here, then we need to branch down a level
+        if (!Node_valid(current->down))
+            return NULL;
+        current = DEREF(current->down);
+    }
 }
 
 bool Quadtree_search(const Quadtree * const node, const Point p) {
@@ -126,28 +317,167 @@ bool Quadtree_search(const Quadtree * const node, const Point p) {
     while (current->up != NULL)
         current = DEREF(current->up);
 
-    bool found = Quadtree_search_helper(current, &p);
+    bool found = Quadtree_search_helper(current, &p) != NULL;
 
     RLU_READER_UNLOCK(rlu_self);
 
     return found;
 }
 
+bool Quadtree_search_from(Node ** const finger, const Point p) {
+    return Quadtree_search(*finger, p);
+}
+
+uint64_t Quadtree_build_index(Quadtree * const root) {
+    return 0;
+}
+
+/*
+ * struct QuadtreeSearch_t
+ *
+ * Stores the state of one of the searches that Quadtree_search_batch runs at once.
+ *
+ * square - the raw square the search is at; NULL if the slot is free
+ * child - the raw child of square that p falls into, once fetched
+ * fetched - whether child has been read from square yet
+ * index - the index of the point being searched for
+ */
+typedef struct QuadtreeSearch_t {
+    Node *square, *child;
+    bool fetched;
+    uint64_t index;
+} QuadtreeSearch;
+
+/*
+ * Quadtree_search_batch_helper
+ *
+ * Helper function that runs a group of searches within a single read-side critical
+ * section.
+ *
+ * top - the raw root node on the topmost level
+ * points - the points to search for
+ * n - the number of points
+ * results - buffer for n results; may be NULL
+ *
+ * Returns the number of points found.
+ */
+uint64_t Quadtree_search_batch_helper(Node * const top, const Point * const points,
+        const uint64_t n, bool * const results) {
+    // name_node is the raw node, name is the deref'ed version
+
+    QuadtreeSearch searches[SEARCH_BATCH_WIDTH], *search;
+    register uint64_t next = 0, found = 0, active, i;
+    Node *square, *child;
+    const Point *p;
+
+    for (i = 0; i < SEARCH_BATCH_WIDTH; i++)
+        searches[i].square = NULL;
+
+    // every round advances each search by one step, which touches only memory that was
+    // prefetched during the previous round
+    do {
+        for (i = 0, active = 0; i < SEARCH_BATCH_WIDTH; i++) {
+            search = searches + i;
+
+            // start the next search in a free slot
+            if (search->square == NULL) {
+                if (next == n)
+                    continue;
+                search->index = next++;
+                search->fetched = false;
+                if (results != NULL)
+                    results[search->index] = false;
+                if (!in_range(DEREF(top), points + search->index))
+                    continue;
+                search->square = top;
+            }
+            active++;
+            p = points + search->index;
+            square = DEREF(search->square);
+
+            // fetch the child that p falls into, and come back to it next round
+            if (!search->fetched) {
+                search->child = Node_child(square, get_quadrant(&square->center, p));
+                if (Node_valid(search->child)) {
+                    __builtin_prefetch(search->child);
+                    search->fetched = true;
+                    continue;
+                }
+            }
+            else {
+                search->fetched = false;
+                child = DEREF(search->child);
+
+                // if the child is a square containing p, move to it
+                if (child->is_square && in_range(child, p)) {
+                    search->square = search->child;
+                    __builtin_prefetch(Node_children(child) + Node_child_index(child, get_quadrant(&child->center, p)));
+                    continue;
+                }
+
+                // otherwise, we check if the child point matches, if it is a point node
+                if (!child->is_square && Point_equals(&child->center, p)) {
+                    if (results != NULL)
+                        results[search->index] = true;
+                    found++;
+                    search->square = NULL;
+                    continue;
+                }
+            }
+
+            // if we're here, then we need to branch down a level
+            search->square = square->down;
+            if (Node_valid(search->square))
+                __builtin_prefetch(search->square);
+        }
+    } while (active > 0 || next < n);
+
+    return found;
+}
+
+uint64_t Quadtree_search_batch(const Quadtree * const node, const Point * const points,
+        const uint64_t n, bool * const results) {
+    register uint64_t found = 0, i;
+    Node *top_node, *top;
+
+    // keep each critical section short, so that writers are not held up
+    for (i = 0; i < n; i += SEARCH_BATCH_GROUP) {
+        RLU_READER_LOCK(rlu_self);
+
+        top_node = (Node*)node;
+        top = DEREF(top_node);
+        while (top->up != NULL) {
+            top_node = top->up;
+            top = DEREF(top_node);
+        }
+
+        found += Quadtree_search_batch_helper(top_node, points + i,
+            n - i < SEARCH_BATCH_GROUP ? n - i : SEARCH_BATCH_GROUP,
+            results != NULL ? results + i : NULL);
+
+        RLU_READER_UNLOCK(rlu_self);
+    }
+
+    return found;
+}
+
 /*
  * Quadtree_add_helper
  *
- * Recursive helper function to add new points to the tree.
+ * Iterative helper function to add new points to the tree.
  *
  * The process is three-part:
  * 1. We traverse node on the topmost level to where p should be added.
- * 2. We then branch down to create lower-level nodes first.
- * 3. We then take the lower-level node and use it as our down for this level.
+ * 2. We then drop down a level from there and repeat, locking and remembering the parent
+ *    square that p belongs in on every level.
+ * 3. We then insert from the bottom-most level upward, using each new node as the down
+ *    of the one on the level above it.
  *
  * node - the node to start inserting at; should be a square; must be the original Node
  * p - the point to add
  * gap_depth - the number of levels we need to go through before actually inserting nodes
  *
- * Returns the corresponding raw node, one level lower, or NULL if the action failed.
+ * Returns the raw node added on the topmost inserted level, or NULL if the action failed.
  */
 Node* Quadtree_add_helper(const Node * const node, const Point * const p, const uint64_t gap_depth) {
     // name_node is the raw node, name is the deref'ed version
@@ -156,83 +486,102 @@ Node* Quadtree_add_helper(const Node * const node, const Point * const p, const
     if (!in_range(current, p))
         return NULL;
 
-    // horizontal traversal
-    Node *parent_node, *parent;
-    do {
-        parent_node = current_node;
-        parent = current;
-        current_node = parent->children[get_quadrant(&parent->center, p)];
-        current = DEREF(current_node);
-    } while(Node_valid(current) && current->is_square && in_range(current, p));
-    TRY_OR_FAIL(parent);
+    register uint64_t levels = 0, level;
+    while (Node_valid(current)) {
+        levels++;
+        current = DEREF(current->down);
+    }
+    current = DEREF(current_node);
 
-    // check for duplication
-    if (!gap_depth && Node_valid(current) && !current->is_square && Point_equals(&current->center, p))
-        return NULL;
+    // per-level stack of the squares that p gets added to, topmost level first; the
+    // squares are locked on the way down, so these are the copies
+    Node *parent_nodes[levels], *parents[levels];
+
+    Node *parent_node, *parent;
+    for (level = 0; level < levels; level++) {
+        // horizontal traversal
+        do {
+            parent_node = current_node;
+            parent = current;
+            current_node = Node_child(parent, get_quadrant(&parent->center, p));
+            current = DEREF(current_node);
+        } while(Node_valid(current) && current->is_square && in_range(current, p));
+        TRY_OR_FAIL(parent);
 
-    // branch down a level if possible
-    Node *down_node = NULL, *down = NULL;
-    if (Node_valid(parent->down)) {
-        if (!Node_valid(down_node = Quadtree_add_helper(parent->down, p,
-                (gap_depth > 0) & (gap_depth - 1))))
+        // check for duplication
+        if (level >= gap_depth && Node_valid(current) && !current->is_square && Point_equals(&current->center, p))
             return NULL;
-        down = DEREF(down_node);
+
+        parent_nodes[level] = parent_node;
+        parents[level] = parent;
+
+        // a square without a copy below is on the bottom-most level that p can go to
+        if (!Node_valid(parent->down)) {
+            levels = level + 1;
+            break;
+        }
+        current_node = parent->down;
+        current = DEREF(current_node);
     }
 
-    // if gap_depth is not zero, we shouldn't actually add anything
-    if (gap_depth)
-        return down_node;
+    // children arrays replaced on the way, which stay in use if a later lock fails
+    Node **retired[levels];
+    register uint64_t num_retired = 0;
+
+    // insert from the bottom up, so that each level can link to the one below it
+    Node *down_node = NULL, *down = NULL, *new_node = NULL, *new = NULL;
+    for (level = levels; level-- > gap_depth; down_node = new_node, down = new) {
+        parent_node = parent_nodes[level];
+        parent = parents[level];
+
+        new_node = Node_new(0, *p, false, down_node == NULL);
+        new = DEREF(new_node);
+        TRY_OR_FAIL(new);
+        RLU_ASSIGN_PTR(rlu_self, &new->parent, parent_node);
+
+        if (Node_valid(down)) {
+            TRY_OR_FAIL(down);
+            RLU_ASSIGN_PTR(rlu_self, &new->down, down_node);
+            RLU_ASSIGN_PTR(rlu_self, &down->up, new_node);
+        }
 
-    Node *new_node = Node_init(0.5 * parent->length, *p), *new = DEREF(new_node);
-    TRY_OR_FAIL(new);
-    RLU_ASSIGN_PTR(rlu_self, &new->parent, parent_node);
+        // time to try inserting onto this level
+        register uint64_t quadrant = get_quadrant(&parent->center, p);
 
-    if (Node_valid(down)) {
-        TRY_OR_FAIL(down);
-        RLU_ASSIGN_PTR(rlu_self, &new->down, down_node);
-        RLU_ASSIGN_PTR(rlu_self, &down->up, new_node);
-    }
+        // if the slot is empty, it's trivial
+        Node *sibling_node = Node_child(parent, quadrant);
+        if (!Node_valid(sibling_node)) {
+            retired[num_retired++] = Node_set_child(parent, quadrant, new_node);
+            continue;
+        }
 
-    // time to try inserting onto this level
-    register uint8_t quadrant = get_quadrant(&parent->center, p);
+        // if it's not empty, that means there's already a node there...
 
-    // if the slot is empty, it's trivial
-    Node *sibling_node = parent->children[quadrant];
-    if (!Node_valid(sibling_node)) {
-        RLU_ASSIGN_PTR(rlu_self, &parent->children[quadrant], new_node);
-    }
-    // if it's not empty, that means there's already a node there...
-    else {
         // grab the lock on the sibling-to-be
         Node *sibling = DEREF(sibling_node);
         TRY_OR_FAIL(sibling);
 
-        // create a new square to contain the sibling and the new node
-        uint8_t square_quadrant = quadrant;
-        Node *square_node = Quadtree_init(0.5 * parent->length, get_new_center(parent, quadrant));
+        // create a new square to contain the sibling and the new node, small enough that
+        // they are in different quadrants
+        uint64_t square_quadrant = quadrant;
+        Point square_center;
+        coord_t square_length;
+        get_split_square(parent, &sibling->center, p, &square_center, &square_length);
+        Node *square_node = Node_new(square_length, square_center, true, false);
         Node *square = DEREF(square_node);
         TRY_OR_FAIL(square);
         RLU_ASSIGN_PTR(rlu_self, &square->parent, parent_node);
 
-        // now, we keep splitting until the new node and the sibling are in different quadrants
-        register uint8_t sibling_quadrant;
-        while ( (sibling_quadrant = get_quadrant(&square->center, &sibling->center)) ==
-                (quadrant = get_quadrant(&square->center, &new->center))) {
-            Point new_square_center = get_new_center(square, quadrant);
-            Point_copy(&new_square_center, &square->center);
-            square->length *= 0.5;
-        }
-
         // okay, now we have separate quadrants to use
-        RLU_ASSIGN_PTR(rlu_self, &square->children[quadrant], new_node);
-        RLU_ASSIGN_PTR(rlu_self, &square->children[sibling_quadrant], sibling_node);
+        Node_set_children(square, get_quadrant(&square->center, p), new_node,
+            get_quadrant(&square->center, &sibling->center), sibling_node);
 
         // now, we need to find the down square to this square, if we're not on the last level
         if (Node_valid(parent->down)) {
             Node *down_square_node = parent->down, *down_square = DEREF(down_square_node);
             while (!Point_equals(&down_square->center, &square->center) ||
                     abs(down_square->length - square->length) > PRECISION) {
-                down_square_node = down_square->children[get_quadrant(&down_square->center, &square->center)];
+                down_square_node = Node_child(down_square, get_quadrant(&down_square->center, &square->center));
                 down_square = DEREF(down_square_node);
                 if (!Node_valid(down_square))
                     return NULL;
@@ -242,28 +591,70 @@ Node* Quadtree_add_helper(const Node * const node, const Point * const p, const
             RLU_ASSIGN_PTR(rlu_self, &down_square->up, square_node);
         }
 
-        RLU_ASSIGN_PTR(rlu_self, &parent->children[square_quadrant], square_node);
+        retired[num_retired++] = Node_set_child(parent, square_quadrant, square_node);
         RLU_ASSIGN_PTR(rlu_self, &new->parent, square_node);
         RLU_ASSIGN_PTR(rlu_self, &sibling->parent, square_node);
     }
 
+    // every lock is taken, so the add will be committed
+    while (num_retired > 0)
+        RLU_FREE(rlu_self, retired[--num_retired]);
+
     return new_node;
 }
 
-bool Quadtree_add(Quadtree * const node, const Point p) {
+/*
+ * Quadtree_add_value
+ *
+ * Adds p to the tree as Quadtree_add does, within one critical section that is retried
+ * a few times if a lock cannot be taken. With update given, p gets the result of update
+ * as its value, and if p is already in the tree, only its value is replaced. Otherwise,
+ * with MULTISET defined, a p that is already in the tree is only counted once more.
+ *
+ * node - the root node of the tree to add to
+ * p - the point being added
+ * update - computes the value of p; NULL to add p as Quadtree_add does
+ * ctx - passed to update
+ *
+ * Returns whether p was added, or with update given, whether its value was stored.
+ */
+static bool Quadtree_add_value(Quadtree * const node, const Point * const p,
+        QuadtreeUpsert update, void * const ctx) {
     register uint8_t attempts_left = 10;
+    register const uint64_t height = Quadtree_height(node, p);
+    register uint64_t level;
+    Node *point;
 add_restart:
     RLU_READER_LOCK(rlu_self);
 
     Node *current_node = (Node*)node, *current = DEREF(current_node);
 
-    while (rand() % 100 < 50) {
+    // if p is already in the tree, only its node on the bottom-most level changes
+    if (update != NULL || COUNT_REPEATS) {
+        for (point = current; point->up != NULL; point = DEREF(point->up));
+        if ((point = Quadtree_search_helper(point, p)) != NULL) {
+            while (Node_valid(point->down))
+                point = DEREF(point->down);
+            if (!TRY_LOCK(point))
+                goto add_abort;
+            if (update != NULL)
+                point->value = update(point->value, true, ctx);
+#ifdef MULTISET
+            else
+                point->multiplicity++;
+#endif
+            RLU_READER_UNLOCK(rlu_self);
+            return true;
+        }
+    }
+
+    for (level = 1; level < height; level++) {
         if (current->up == NULL) {
-            if (!RLU_TRY_LOCK(rlu_self, &current))
+            if (!TRY_LOCK(current))
                 goto add_abort;
-            Node *up_node = Quadtree_init(current->length, current->center);
+            Node *up_node = Node_new(current->length, current->center, true, false);
             Node *up = DEREF(up_node);
-            if (!RLU_TRY_LOCK(rlu_self, &up))
+            if (!TRY_LOCK(up))
                 goto add_abort;
             RLU_ASSIGN_PTR(rlu_self, &up->down, current_node);
             RLU_ASSIGN_PTR(rlu_self, &current->up, up_node);
@@ -280,7 +671,8 @@ add_restart:
         gap_depth++;
     }
 
-    bool success = Quadtree_add_helper(current_node, &p, gap_depth) != NULL;
+    point = Quadtree_add_helper(current_node, p, gap_depth);
+    bool success = point != NULL;
 
     if (!success) {
 add_abort:
@@ -289,125 +681,412 @@ add_abort:
             goto add_restart;
     }
     else {
+        // every new node is locked, so these are the copies that get written back
+        if (update != NULL) {
+            for (point = DEREF(point); Node_valid(point->down); point = DEREF(point->down));
+            point->value = update(NULL, false, ctx);
+        }
         RLU_READER_UNLOCK(rlu_self);
     }
 
     return success;
 }
 
+bool Quadtree_add(Quadtree * const node, const Point p) {
+    return Quadtree_add_value(node, &p, NULL, NULL);
+}
+
+uint64_t Quadtree_add_batch(Quadtree * const node, const Point * const points,
+        const uint64_t n, bool * const results) {
+    MortonPoint *sorted = (MortonPoint*)malloc(sizeof(*sorted) * n);
+    register uint64_t added = 0, i;
+    bool success;
+
+    if (sorted == NULL) {
+        if (results != NULL)
+            for (i = 0; i < n; i++)
+                results[i] = false;
+        return 0;
+    }
+
+    // the bounds of the root never change, so no need to dereference it
+    for (i = 0; i < n; i++)
+        MortonPoint_init(&sorted[i], node, &points[i], i);
+    qsort(sorted, n, sizeof(*sorted), MortonPoint_compare);
+
+    // consecutive adds now mostly touch the same squares, which are likely still cached
+    for (i = 0; i < n; i++) {
+        success = Quadtree_add(node, sorted[i].point);
+        if (results != NULL)
+            results[sorted[i].index] = success;
+        added += success;
+    }
+
+    free(sorted);
+
+    return added;
+}
+
+bool Quadtree_add_from(Node ** const finger, const Point p) {
+    return Quadtree_add(*finger, p);
+}
+
+/*
+ * Quadtree_bulk_load_level
+ *
+ * Helper function to build a single level of a tree from points in Morton order.
+ *
+ * The squares on the path to the last added point are kept on a stack. Since the points
+ * are sorted, each point is placed by popping the squares that do not contain it and
+ * continuing from the deepest one left, usually without descending at all.
+ *
+ * The level is not visible to any other thread yet, so nodes are written without locking,
+ * and children arrays are freed as soon as they are replaced.
+ *
+ * root - the empty root square of the level
+ * points - the points to add, in Morton order
+ * nodes - on entry, each point's node on the level below, all NULL on the bottom level;
+ *     on return, each point's node on this level, or NULL if the point was a duplicate
+ * n - the number of points
+ * stack - buffer for at least n + 1 squares
+ */
+static void Quadtree_bulk_load_level(Node * const root, const MortonPoint * const points,
+        Node ** const nodes, const uint64_t n, Node ** const stack) {
+    register uint64_t stack_size = 0, i, quadrant;
+    Node *square, *child, *new_node;
+    const Point *p;
+
+    stack[stack_size++] = root;
+    for (i = 0; i < n; i++) {
+        p = &points[i].point;
+
+        // drop the squares that the previous point is in but p is not
+        while (!in_range(stack[stack_size - 1], p))
+            stack_size--;
+
+        // then move down to the square that p belongs in
+        square = stack[stack_size - 1];
+        while ((child = Node_child(square, quadrant = get_quadrant(&square->center, p))) != NULL &&
+                child->is_square && in_range(child, p))
+            stack[stack_size++] = square = child;
+
+        // check for duplication, which only happens on the bottom-most level
+        if (child != NULL && !child->is_square && Point_equals(&child->center, p)) {
+#ifdef MULTISET
+            child->multiplicity++;
+#endif
+            nodes[i] = NULL;
+            continue;
+        }
+
+        new_node = Node_new(0, *p, false, nodes[i] == NULL);
+        new_node->parent = square;
+        if (nodes[i] != NULL) {
+            new_node->down = nodes[i];
+            nodes[i]->up = new_node;
+        }
+        nodes[i] = new_node;
+
+        // if the slot is empty, it's trivial
+        if (child == NULL) {
+            RLU_FREE(rlu_self, Node_set_child(square, quadrant, new_node));
+            continue;
+        }
+
+        // otherwise, create a new square to contain child and the new node
+        Point split_center;
+        coord_t split_length;
+        get_split_square(square, &child->center, p, &split_center, &split_length);
+        Node *split = Node_new(split_length, split_center, true, false);
+        split->parent = square;
+        Node_set_children(split, get_quadrant(&split->center, p), new_node,
+            get_quadrant(&split->center, &child->center), child);
+
+        // the same square is already on the level below, if there is one
+        if (square->down != NULL) {
+            Node *down_square = square->down;
+            while (!Point_equals(&down_square->center, &split->center) ||
+                    abs(down_square->length - split->length) > PRECISION)
+                down_square = Node_child(down_square, get_quadrant(&down_square->center, &split->center));
+            split->down = down_square;
+            down_square->up = split;
+        }
+
+        RLU_FREE(rlu_self, Node_set_child(square, quadrant, split));
+        new_node->parent = split;
+        child->parent = split;
+        stack[stack_size++] = split;
+    }
+}
+
+/*
+ * Quadtree_bulk_load_sorted
+ *
+ * Builds every level of the tree rooted at root from points in Morton order, as
+ * Quadtree_bulk_load does once they are sorted, without locking.
+ *
+ * root - the empty root of the tree, whose promotion probability decides the levels
+ * sorted - the points, in Morton order, which get reordered
+ * n - the number of points
+ * multiplicities - with MULTISET defined, the multiplicity of each point by its index,
+ *     or NULL to count the duplicates among the points instead
+ *
+ * Returns whether the tree was built, which fails before anything is added if memory
+ * runs out.
+ */
+static bool Quadtree_bulk_load_sorted(Quadtree * const root, MortonPoint * const sorted,
+        const uint64_t n, const uint64_t * const multiplicities) {
+    Quadtree *level = root;
+    Node **nodes = (Node**)malloc(sizeof(*nodes) * n);
+    Node **stack = (Node**)malloc(sizeof(*stack) * (n + 1));
+    register uint64_t count = n, levels = 1, promoted, i;
+
+    if ((nodes == NULL && n > 0) || stack == NULL) {
+        free(nodes);
+        free(stack);
+        return false;
+    }
+
+    // nothing else can see the tree yet, so replaced children arrays are freed right away
+    rlu_thread_data_t *old_rlu_self = rlu_self;
+    rlu_self = NULL;
+
+    for (i = 0; i < n; i++)
+        nodes[i] = NULL;
+
+    while (true) {
+        Quadtree_bulk_load_level(level, sorted, nodes, count, stack);
+#ifdef MULTISET
+        if (levels == 1 && multiplicities != NULL)
+            for (i = 0; i < count; i++)
+                if (nodes[i] != NULL)
+                    nodes[i]->multiplicity = multiplicities[sorted[i].index];
+#endif
+
+        // promote the points that go on the next level too, as in Quadtree_add
+        for (i = 0, promoted = 0; i < count; i++)
+            if (nodes[i] != NULL && Quadtree_height(root, &sorted[i].point) > levels) {
+                sorted[promoted] = sorted[i];
+                nodes[promoted++] = nodes[i];
+            }
+        if (promoted == 0)
+            break;
+        count = promoted;
+        levels++;
+
+        level->up = Node_new(root->length, root->center, true, false);
+        level->up->down = level;
+        level = level->up;
+    }
+
+    rlu_self = old_rlu_self;
+
+    free(nodes);
+    free(stack);
+
+    return true;
+}
+
+Quadtree* Quadtree_bulk_load(const Point * const points, const uint64_t n,
+        const coord_t length, const Point center) {
+    Quadtree *root = Quadtree_init(length, center);
+    MortonPoint *sorted = (MortonPoint*)malloc(sizeof(*sorted) * n);
+    register uint64_t count = 0, i;
+
+    if (sorted == NULL && n > 0) {
+        Quadtree_free(root);
+        return NULL;
+    }
+
+    // only points within the root square can be added
+    for (i = 0; i < n; i++)
+        if (in_range(root, &points[i]))
+            MortonPoint_init(&sorted[count++], root, &points[i], i);
+    qsort(sorted, count, sizeof(*sorted), MortonPoint_compare);
+
+    if (!Quadtree_bulk_load_sorted(root, sorted, count, NULL)) {
+        Quadtree_free(root);
+        root = NULL;
+    }
+
+    free(sorted);
+
+    return root;
+}
+
 /*
  * Quadtree_remove_node
  *
  * Helper function to remove all instances of the given node and properly relink pointers
  * to it.
  *
+ * Nodes left behind that may also need removing, namely a parent square left with fewer
+ * than two children and the node's copy on the level below, are kept on an explicit
+ * stack and handled in the same order a recursive implementation would.
+ *
+ * Either every node is unlinked or none is: if any lock cannot be taken, or the stacks
+ * cannot grow, the relinks made so far are still in the write set, so the caller must
+ * abort the critical section rather than commit it. Nodes are only freed once every lock
+ * is taken.
+ *
  * Invariant: node must have either a parent or a down.
  *
  * node - the node to remove
  *
- * Returns true if removal is successful, false otherwise.
+ * Returns true if removal is successful, false if a lock could not be taken or memory ran
+ * out.
  */
 bool Quadtree_remove_node(const Node * const node) {
     // name_node is the raw node, name is the deref'ed version
 
-    Node *current_node = (Node*)node, *current = DEREF(current_node);
-
-    // root node at lowest level, can't be removed
-    if (!Node_valid(current->down) && !Node_valid(current->parent))
-        return false;
+    Node *local_stack[REMOVE_STACK_SIZE], **stack = local_stack;
+    register uint64_t stack_size = 0, stack_capacity = REMOVE_STACK_SIZE;
 
-    TRY_OR_FAIL(current);
+    // nodes and children arrays unlinked on the way, which stay in use if a later lock fails
+    void *local_retired[REMOVE_STACK_SIZE], **retired = local_retired;
+    register uint64_t num_retired = 0, retired_capacity = REMOVE_STACK_SIZE;
 
-    // if is square, determine whether need to remove, and if so, which node to move up
-    if (current->is_square) {
-        register uint8_t num_children = 0, i;
-        Node *child_node = NULL;
-        for (i = 0; i < (1 << D); i++)
-            if (Node_valid(current->children[i])) {
-                num_children++;
-                child_node = current->children[i];
-            }
+    Node *current_node, *current;
+    bool removed = false;
 
-        // cannot remove square if more than 1 child
-        if (num_children > 1)
-            return false;
+    stack[stack_size++] = (Node*)node;
+    while (stack_size > 0) {
+        current_node = stack[--stack_size];
+        current = DEREF(current_node);
 
-        // if we have a child, then we relink parent to point to this child, and unlink
-        // ourself from the parent
-        if (num_children == 1) {
-            // however this cannot happen at the root. If we're going to remove a copy of
-            // the root, we want no children on that node
-            if (!Node_valid(current->parent))
-                return false;
-
-            // if all goes well, we can relink
-            Node *parent_node = current->parent, *parent = DEREF(parent_node);
-            Node *child = DEREF(child_node);
-            TRY_OR_FAIL(parent);
-            TRY_OR_FAIL(child);
-            RLU_ASSIGN_PTR(rlu_self, &parent->children[get_quadrant(&parent->center, &current->center)], child_node);
-            RLU_ASSIGN_PTR(rlu_self, &child->parent, parent_node);
-            RLU_ASSIGN_PTR(rlu_self, &current->parent, NULL);
+        // root node at lowest level, can't be removed
+        if (!Node_valid(current->down) && !Node_valid(current->parent))
+            continue;
+
+        TRY_OR_ABORT(current);
+
+        // make room for the node, its children array, and the children arrays of its parent;
+        // if memory runs out, the remove is given up like one that cannot take a lock
+        if (num_retired + 4 > retired_capacity) {
+            void **larger_retired = (void**)malloc(sizeof(*retired) * 2 * retired_capacity);
+            if (larger_retired == NULL)
+                goto remove_abort;
+            retired_capacity *= 2;
+            memcpy(larger_retired, retired, sizeof(*retired) * num_retired);
+            if (retired != local_retired)
+                free(retired);
+            retired = larger_retired;
         }
 
-        // otherwise, 0 children, and no problem
-    }
+        // if is square, determine whether need to remove, and if so, which node to move up
+        if (current->is_square) {
+            register uint64_t num_children = current->num_children;
+            Node *child_node = num_children > 0 ? Node_children(current)[0] : NULL;
+
+            // cannot remove square if more than 1 child
+            if (num_children > 1)
+                continue;
+
+            // nor while its copy on the level above is left, as searches there go through it
+            if (Node_valid(current->up))
+                continue;
+
+            // if we have a child, then we relink parent to point to this child, and unlink
+            // ourself from the parent
+            if (num_children == 1) {
+                // however this cannot happen at the root. If we're going to remove a copy of
+                // the root, we want no children on that node
+                if (!Node_valid(current->parent))
+                    continue;
+
+                // if all goes well, we can relink
+                Node *parent_node = current->parent, *parent = DEREF(parent_node);
+                Node *child = DEREF(child_node);
+                TRY_OR_ABORT(parent);
+                TRY_OR_ABORT(child);
+                retired[num_retired++] = Node_set_child(parent, get_quadrant(&parent->center, &current->center), child_node);
+                RLU_ASSIGN_PTR(rlu_self, &child->parent, parent_node);
+                RLU_ASSIGN_PTR(rlu_self, &current->parent, NULL);
+            }
 
-    // now, get rid of pointers from the parent
-    Node *parent_node = current->parent, *parent = DEREF(parent_node);
-    Node *up_node = current->up, *up = NULL;
-    if (Node_valid(up_node))
-        up = DEREF(up_node);
-    Node *down_node = current->down, *down = NULL;
-    if (Node_valid(down_node))
-        down = DEREF(down_node);
+            // otherwise, 0 children, and no problem
+        }
 
-    if (Node_valid(parent) && parent->children[get_quadrant(&parent->center, &current_node->center)] == current_node) {
-        TRY_OR_FAIL(parent);
-        RLU_ASSIGN_PTR(rlu_self, &parent->children[get_quadrant(&parent->center, &current_node->center)], NULL);
-    }
+        // now, get rid of pointers from the parent
+        Node *parent_node = current->parent, *parent = DEREF(parent_node);
+        Node *up_node = current->up, *up = NULL;
+        if (Node_valid(up_node))
+            up = DEREF(up_node);
+        Node *down_node = current->down, *down = NULL;
+        if (Node_valid(down_node))
+            down = DEREF(down_node);
+
+        if (Node_valid(parent) && Node_child(parent, get_quadrant(&parent->center, &current_node->center)) == current_node) {
+            TRY_OR_ABORT(parent);
+            retired[num_retired++] = Node_set_child(parent, get_quadrant(&parent->center, &current_node->center), NULL);
+        }
 
-    // next, unlink pointers from up and down
-    if (Node_valid(up)) {
-        TRY_OR_FAIL(up);
-        RLU_ASSIGN_PTR(rlu_self, &up->down, NULL);
-        RLU_ASSIGN_PTR(rlu_self, &current->up, NULL);
-    }
-    if (Node_valid(down)) {
-        TRY_OR_FAIL(down);
-        RLU_ASSIGN_PTR(rlu_self, &down->up, NULL);
-        RLU_ASSIGN_PTR(rlu_self, &current->down, NULL);
-    }
+        // next, unlink pointers from up and down
+        if (Node_valid(up)) {
+            TRY_OR_ABORT(up);
+            RLU_ASSIGN_PTR(rlu_self, &up->down, NULL);
+            RLU_ASSIGN_PTR(rlu_self, &current->up, NULL);
+        }
+        if (Node_valid(down)) {
+            TRY_OR_ABORT(down);
+            RLU_ASSIGN_PTR(rlu_self, &down->up, NULL);
+            RLU_ASSIGN_PTR(rlu_self, &current->down, NULL);
+        }
 
-    // now, we can get rid of our node
-    Node_free(current);
+        // now, we can get rid of our node, once the remove is certain to be committed
+        if (current->is_square && current->capacity > INLINE_CHILDREN)
+            retired[num_retired++] = current->children;
+        retired[num_retired++] = current_node;
+        removed |= current_node == node;
+
+        // make room for up to two more nodes
+        if (stack_size + 2 > stack_capacity) {
+            Node **larger_stack = (Node**)malloc(sizeof(*stack) * 2 * stack_capacity);
+            if (larger_stack == NULL)
+                goto remove_abort;
+            stack_capacity *= 2;
+            memcpy(larger_stack, stack, sizeof(*stack) * stack_size);
+            if (stack != local_stack)
+                free(stack);
+            stack = larger_stack;
+        }
 
-    // then, recurse up the parent as necessary
-    if (Node_valid(parent)) {
-        register uint8_t num_children = 0, i;
-        for (i = 0; i < (1 << D); i++)
-            num_children += Node_valid(parent->children[i]);
-        if (num_children < 2)
-            Quadtree_remove_node(parent_node);
+        // pushed in reverse: down, then the parent, which is visited first
+        if (Node_valid(down))
+            stack[stack_size++] = down_node;
+        if (Node_valid(parent) && parent->num_children < 2)
+            stack[stack_size++] = parent_node;
+        continue;
+
+remove_abort:
+        // a lock we needed is taken, so none of the remove can be committed
+        removed = false;
+        num_retired = 0;
+        break;
     }
 
-    // finally, recurse on up and down
-    if (Node_valid(down))
-        Quadtree_remove_node(down_node);
+    while (num_retired > 0)
+        RLU_FREE(rlu_self, retired[--num_retired]);
 
-    return true;
+    if (stack != local_stack)
+        free(stack);
+    if (retired != local_retired)
+        free(retired);
+
+    return removed;
 }
 
 /*
  * Quadtree_remove_helper
  *
- * Recursive helper function to remove nodes. Removal starts at highest-level occurance
+ * Iterative helper function to remove nodes. Removal starts at highest-level occurance
  * and progresses downward.
  *
  * node - the node to start at
  * p - the point to remove
  *
- * Returns true if the node was successfully removed, false if not.
+ * Returns true if the node was successfully removed, false if p is not in the tree, a
+ * lock could not be taken, or memory ran out.
  */
 bool Quadtree_remove_helper(Node * const node, const Point * const p) {
     // name_node is the raw node, name is the deref'ed version
@@ -416,37 +1095,34 @@ bool Quadtree_remove_helper(Node * const node, const Point * const p) {
     if (!in_range(current, p))
         return false;
 
-    register uint8_t quadrant = get_quadrant(&current->center, p);
-
-    // if the target child is NULL, we try to drop down a level
-    if (!Node_valid(current->children[quadrant])) {
-        if (Node_valid(current->down))
-            return Quadtree_remove_helper(current->down, p);
-        // otherwise, we're on the bottom-most level and just can't find the point
-        else
-            return false;
-    }
-
-    // here, the child exists
+    Node *child_node, *child;
+    while (true) {
+        child_node = Node_child(current, get_quadrant(&current->center, p));
+        child = DEREF(child_node);
 
-    // if is a square, move to it and recurse if in range
-    if (current->children[quadrant]->is_square && in_range(current->children[quadrant], p))
-        return Quadtree_remove_helper(current->children[quadrant], p);
-
-    // otherwise, we check if the child point matches, since it's a point node
-    if (Point_equals(&current->children[quadrant]->center, p))
-        return Quadtree_remove_node(current->children[quadrant]);
+        // if the child is a square containing p, move to it
+        if (Node_valid(child) && child->is_square && in_range(child, p)) {
+            current_node = child_node;
+            current = child;
+            continue;
+        }
 
-    // if we're here, then we need to branch down a level
-    if (Node_valid(current->down))
-        return Quadtree_remove_helper(current->down, p);
+        // otherwise, we check if the child point matches, if it is a point node
+        if (Node_valid(child) && !child->is_square && Point_equals(&child->center, p))
+            return Quadtree_remove_node(child_node);
 
-    // here, we have nowhere else to search for, so we give up
-    return false;
- 
+        // if we're here, then we need to branch down a level
+        if (!Node_valid(current->down))
+            return false;
+        current_node = current->down;
+        current = DEREF(current_node);
+    }
 }
 
 bool Quadtree_remove(Quadtree * const node, const Point p) {
+    register uint8_t attempts_left = 10;
+    Node *point;
+remove_restart:
     RLU_READER_LOCK(rlu_self);
 
     Node *current_node = (Node*)node, *current = DEREF(current_node);
@@ -455,13 +1131,709 @@ bool Quadtree_remove(Quadtree * const node, const Point p) {
         current = DEREF(current_node);
     }
 
-    bool success = Quadtree_remove_helper(current_node, &p);
+    if ((point = Quadtree_search_helper(current, &p)) == NULL) {
+        RLU_READER_UNLOCK(rlu_self);
+        return false;
+    }
 
-    RLU_READER_UNLOCK(rlu_self);
+#ifdef MULTISET
+    // the nodes of p only go with its last copy, until then only its count goes down
+    while (Node_valid(point->down))
+        point = DEREF(point->down);
+    if (point->multiplicity > 1) {
+        if (!TRY_LOCK(point))
+            goto remove_abort;
+        if (point->multiplicity > 1) {
+            point->multiplicity--;
+            RLU_READER_UNLOCK(rlu_self);
+            return true;
+        }
+    }
+#endif
+
+    // p is in the tree, so the remove only fails if a lock is taken or memory runs out;
+    // like a failed add, it is retried from the start, as nothing of it can be committed
+    if (!Quadtree_remove_helper(current_node, &p))
+        goto remove_abort;
+
+    RLU_READER_UNLOCK(rlu_self);
+
+    return true;
+
+remove_abort:
+    RLU_ABORT(rlu_self);
+    if (--attempts_left)
+        goto remove_restart;
+    return false;
+}
+
+uint64_t Quadtree_multiplicity(const Quadtree * const node, const Point p) {
+    RLU_READER_LOCK(rlu_self);
+
+    Node *current = DEREF(node), *point;
+    while (current->up != NULL)
+        current = DEREF(current->up);
+
+    register uint64_t multiplicity = 0;
+    if ((point = Quadtree_search_helper(current, &p)) != NULL) {
+#ifdef MULTISET
+        while (Node_valid(point->down))
+            point = DEREF(point->down);
+        multiplicity = point->multiplicity;
+#else
+        multiplicity = 1;
+#endif
+    }
+
+    RLU_READER_UNLOCK(rlu_self);
+
+    return multiplicity;
+}
+
+/*
+ * Quadtree_put_value
+ *
+ * QuadtreeUpsert that replaces the value of a point with ctx, for Quadtree_put.
+ */
+static void* Quadtree_put_value(void * const value, const bool present, void * const ctx) {
+    return ctx;
+}
+
+bool Quadtree_put(Quadtree * const node, const Point p, void * const value) {
+    return Quadtree_upsert(node, p, Quadtree_put_value, value);
+}
+
+bool Quadtree_get(const Quadtree * const node, const Point p, void ** const value) {
+    RLU_READER_LOCK(rlu_self);
+
+    Node *current = DEREF(node), *point;
+    while (current->up != NULL)
+        current = DEREF(current->up);
+
+    // only the copy on the bottom-most level holds the value
+    if ((point = Quadtree_search_helper(current, &p)) != NULL) {
+        while (Node_valid(point->down))
+            point = DEREF(point->down);
+        if (value != NULL)
+            *value = point->value;
+    }
+
+    RLU_READER_UNLOCK(rlu_self);
+
+    return point != NULL;
+}
+
+bool Quadtree_upsert(Quadtree * const node, const Point p, QuadtreeUpsert update,
+        void * const ctx) {
+    return Quadtree_add_value(node, &p, update, ctx);
+}
+
+/*
+ * Quadtree_range_query_helper
+ *
+ * Recursive helper function to report the points under node that lie within [lo, hi].
+ * Only traverses the level that node is on.
+ *
+ * node - the node to look in; must be the original Node
+ * lo - the corner of the box with the smallest coordinate values
+ * hi - the corner of the box with the largest coordinate values
+ * contained - whether node is already known to lie completely within the box
+ * callback - called once for each point in the box
+ * ctx - passed through to callback
+ * count - the number of points reported so far
+ *
+ * Returns false if callback asked to stop, true otherwise.
+ */
+bool Quadtree_range_query_helper(const Node * const node, const Point * const lo,
+        const Point * const hi, bool contained, QuadtreeCallback callback, void * const ctx,
+        uint64_t * const count) {
+    Node *current = DEREF(node);
+
+    if (!current->is_square) {
+        if (!in_box(&current->center, lo, hi))
+            return true;
+        (*count)++;
+        return callback(&current->center, ctx);
+    }
+
+    if (!contained) {
+        if (!box_intersects(current, lo, hi))
+            return true;
+        contained = box_contains(current, lo, hi);
+    }
+
+    register uint64_t i;
+    for (i = 0; i < current->num_children; i++)
+        if (!Quadtree_range_query_helper(Node_children(current)[i], lo, hi, contained, callback, ctx, count))
+            return false;
+
+    return true;
+}
+
+uint64_t Quadtree_range_query(const Quadtree * const node, const Point lo, const Point hi,
+        QuadtreeCallback callback, void * const ctx) {
+    uint64_t count = 0;
+
+    if (node == NULL)
+        return 0;
+
+    RLU_READER_LOCK(rlu_self);
+
+    Node *current_node = (Node*)node, *current = DEREF(current_node);
+
+    // every point lives on the bottom-most level, so that is the only one we need
+    while (Node_valid(current->down)) {
+        current_node = current->down;
+        current = DEREF(current_node);
+    }
+
+    Quadtree_range_query_helper(current_node, &lo, &hi, false, callback, ctx, &count);
+
+    RLU_READER_UNLOCK(rlu_self);
+
+    return count;
+}
+
+/*
+ * Quadtree_count_callback
+ *
+ * Callback for range queries that accepts every point, so they are all counted.
+ */
+static bool Quadtree_count_callback(const Point * const p, void * const ctx) {
+    return true;
+}
+
+/*
+ * Quadtree_locate
+ *
+ * Uses the skip levels to find the smallest square on the bottom-most level that
+ * contains p, moving horizontally while a child square contains p and dropping a level
+ * otherwise.
+ *
+ * Invariant: node is always a square.
+ *
+ * node - the square to start at, normally the root on the topmost level; must be the
+ *     original Node
+ * p - the point to locate
+ *
+ * Returns the smallest bottom-level square containing p as a raw node, or the
+ * bottom-level root if p is not within the bounds of the tree at all.
+ */
+Node* Quadtree_locate(const Node * const node, const Point * const p) {
+    Node *current_node = (Node*)node, *current = DEREF(current_node);
+    Node *child_node, *child;
+
+    if (!in_range(current, p)) {
+        while (Node_valid(current->down)) {
+            current_node = current->down;
+            current = DEREF(current_node);
+        }
+        return current_node;
+    }
+
+    while (true) {
+        child_node = Node_child(current, get_quadrant(&current->center, p));
+        child = DEREF(child_node);
+        if (Node_valid(child) && child->is_square && in_range(child, p)) {
+            current_node = child_node;
+            current = child;
+        }
+        else if (Node_valid(current->down)) {
+            current_node = current->down;
+            current = DEREF(current_node);
+        }
+        else
+            return current_node;
+    }
+}
+
+/*
+ * Quadtree_nearest_helper
+ *
+ * Best-first search for the k points closest to p. Starts in the square containing p
+ * and only moves out to the siblings of an ancestor while a point outside the explored
+ * square could still beat the k-th best distance found so far.
+ *
+ * With a positive eps, the search is approximate: a node is only visited if it could
+ * beat the k-th best distance by more than a factor of (1 + eps), so every neighbor
+ * returned is within (1 + eps) times the distance of the true neighbor it stands for.
+ *
+ * Invariant: k is at least 1.
+ *
+ * start - the bottom-level square to start at; should contain p; must be the original
+ *     Node
+ * p - the point to search around
+ * k - the number of neighbors to find
+ * eps - the allowed relative error in distance; 0 for an exact search
+ * out - the buffer for the neighbors, in order of increasing distance
+ *
+ * Returns the number of neighbors written to out, or 0 if the heaps could not be
+ * allocated.
+ */
+uint64_t Quadtree_nearest_helper(const Node * const start, const Point * const p,
+        const uint64_t k, const float64_t eps, Point * const out) {
+    // name_node is the raw node, name is the deref'ed version
+
+    // best is keyed by negated distance, so that the k-th best is always on top; it only
+    // grows as neighbors are found, so that k does not decide the allocation
+    Heap candidates, best;
+    uint64_t found = 0;
+    bool allocated = Heap_init(&candidates, 64);
+    if (!Heap_init(&best, (k < NEAREST_HEAP_SIZE ? k : NEAREST_HEAP_SIZE) + 1) || !allocated)
+        goto nearest_done;
+
+    Node *region_node = (Node*)start, *region = DEREF(region_node);
+    Node *previous_node, *node, *child_node, *child;
+    register uint64_t i;
+    register float64_t exit;
+
+    // distances are squared, so the error factor is as well
+    const float64_t factor = (1 + eps) * (1 + eps);
+
+    if (!Heap_push(&candidates, min_distance_squared(region, p), region_node))
+        goto nearest_done;
+
+    while (true) {
+        // visit nodes closest-first until none of them can beat the k-th best
+        while (candidates.size > 0 &&
+                (best.size < k || candidates.entries[0].key * factor < -best.entries[0].key)) {
+            HeapEntry entry = Heap_pop(&candidates);
+            node = DEREF(entry.value);
+
+            if (!node->is_square) {
+                if (!Heap_push(&best, -entry.key, entry.value))
+                    goto nearest_done;
+                if (best.size > k)
+                    Heap_pop(&best);
+                continue;
+            }
+
+            for (i = 0; i < node->num_children; i++) {
+                child_node = Node_children(node)[i];
+                child = DEREF(child_node);
+                if (!Heap_push(&candidates, child->is_square ? min_distance_squared(child, p) :
+                        Point_distance_squared(&child->center, p), child_node))
+                    goto nearest_done;
+            }
+        }
+
+        if (!Node_valid(region->parent))
+            break;
+
+        // nothing outside of region is closer than the way out of it
+        exit = exit_distance(region, p);
+        if (best.size == k && exit > 0 && -best.entries[0].key <= factor * exit * exit)
+            break;
+
+        // otherwise, widen the search to the rest of the parent square
+        previous_node = region_node;
+        region_node = region->parent;
+        region = DEREF(region_node);
+        for (i = 0; i < region->num_children; i++)
+            if ((child_node = Node_children(region)[i]) != previous_node) {
+                child = DEREF(child_node);
+                if (!Heap_push(&candidates, child->is_square ? min_distance_squared(child, p) :
+                        Point_distance_squared(&child->center, p), child_node))
+                    goto nearest_done;
+            }
+    }
+
+    // the farthest neighbor comes out first, so fill out from the back
+    found = best.size;
+    HeapEntry node_entry;
+    while (best.size > 0) {
+        node_entry = Heap_pop(&best);
+        node = DEREF(node_entry.value);
+        out[best.size] = node->center;
+    }
+
+nearest_done:
+    Heap_free(&candidates);
+    Heap_free(&best);
+
+    return found;
+}
+
+uint64_t Quadtree_knn(const Quadtree * const node, const Point p, const uint64_t k,
+        Point * const out) {
+    if (node == NULL || k == 0)
+        return 0;
+
+    RLU_READER_LOCK(rlu_self);
+
+    Node *current_node = (Node*)node, *current = DEREF(current_node);
+    while (Node_valid(current->up)) {
+        current_node = current->up;
+        current = DEREF(current_node);
+    }
+
+    uint64_t found = Quadtree_nearest_helper(Quadtree_locate(current_node, &p), &p, k, 0, out);
+
+    RLU_READER_UNLOCK(rlu_self);
+
+    return found;
+}
+
+bool Quadtree_ann(const Quadtree * const node, const Point p, const float64_t eps,
+        Point * const out) {
+    if (node == NULL)
+        return false;
+
+    RLU_READER_LOCK(rlu_self);
+
+    Node *current_node = (Node*)node, *current = DEREF(current_node);
+    while (Node_valid(current->up)) {
+        current_node = current->up;
+        current = DEREF(current_node);
+    }
+
+    bool found = Quadtree_nearest_helper(Quadtree_locate(current_node, &p), &p, 1, eps, out) > 0;
+
+    RLU_READER_UNLOCK(rlu_self);
+
+    return found;
+}
+
+/*
+ * Quadtree_radius_query_helper
+ *
+ * Recursive helper function to report the points under node that are within distance
+ * sqrt(radius2) of p. Only traverses the level that node is on.
+ *
+ * node - the node to look in; must be the original Node
+ * p - the center of the ball
+ * radius2 - the squared radius of the ball
+ * callback - called once for each point in the ball
+ * ctx - passed through to callback
+ * count - the number of points reported so far
+ *
+ * Returns false if callback asked to stop, true otherwise.
+ */
+bool Quadtree_radius_query_helper(const Node * const node, const Point * const p,
+        const float64_t radius2, QuadtreeCallback callback, void * const ctx,
+        uint64_t * const count) {
+    Node *current = DEREF(node);
+
+    if (!current->is_square) {
+        if (Point_distance_squared(&current->center, p) > radius2)
+            return true;
+        (*count)++;
+        return callback(&current->center, ctx);
+    }
+
+    if (min_distance_squared(current, p) > radius2)
+        return true;
+
+    register uint64_t i;
+    for (i = 0; i < current->num_children; i++)
+        if (!Quadtree_radius_query_helper(Node_children(current)[i], p, radius2, callback, ctx, count))
+            return false;
+
+    return true;
+}
+
+uint64_t Quadtree_radius_query(const Quadtree * const node, const Point p, const float64_t r,
+        QuadtreeCallback callback, void * const ctx) {
+    uint64_t count = 0;
+
+    if (node == NULL)
+        return 0;
+
+    RLU_READER_LOCK(rlu_self);
+
+    Node *current_node = (Node*)node, *current = DEREF(current_node);
+
+    // every point lives on the bottom-most level, so that is the only one we need
+    while (Node_valid(current->down)) {
+        current_node = current->down;
+        current = DEREF(current_node);
+    }
+
+    Quadtree_radius_query_helper(current_node, &p, r * r, callback, ctx, &count);
+
+    RLU_READER_UNLOCK(rlu_self);
+
+    return count;
+}
+
+/*
+ * Quadtree_any_within_helper
+ *
+ * Recursive helper function to check whether any point under node is within distance
+ * sqrt(radius2) of p. Returns as soon as one is found.
+ *
+ * node - the node to look in; must be the original Node
+ * p - the center of the ball
+ * radius2 - the squared radius of the ball
+ *
+ * Returns whether some point under node is in the ball.
+ */
+bool Quadtree_any_within_helper(const Node * const node, const Point * const p,
+        const float64_t radius2) {
+    Node *current = DEREF(node);
+
+    if (!current->is_square)
+        return Point_distance_squared(&current->center, p) <= radius2;
+
+    if (min_distance_squared(current, p) > radius2)
+        return false;
+
+    register uint64_t i;
+    for (i = 0; i < current->num_children; i++)
+        if (Quadtree_any_within_helper(Node_children(current)[i], p, radius2))
+            return true;
+
+    return false;
+}
+
+bool Quadtree_any_within(const Quadtree * const node, const Point p, const float64_t r) {
+    if (node == NULL)
+        return false;
+
+    RLU_READER_LOCK(rlu_self);
+
+    Node *current_node = (Node*)node, *current = DEREF(current_node);
+    while (Node_valid(current->up)) {
+        current_node = current->up;
+        current = DEREF(current_node);
+    }
+
+    // the square containing p is the likeliest place for a hit, so look there first
+    Node *region_node = Quadtree_locate(current_node, &p), *region = DEREF(region_node);
+    Node *previous_node;
+    bool found = Quadtree_any_within_helper(region_node, &p, r * r);
+    register uint64_t i;
+
+    // then move outward only while the ball reaches past the explored square
+    while (!found && Node_valid(region->parent) && exit_distance(region, &p) < r) {
+        previous_node = region_node;
+        region_node = region->parent;
+        region = DEREF(region_node);
+        for (i = 0; i < region->num_children && !found; i++)
+            if (Node_children(region)[i] != previous_node)
+                found = Quadtree_any_within_helper(Node_children(region)[i], &p, r * r);
+    }
+
+    RLU_READER_UNLOCK(rlu_self);
+
+    return found;
+}
+
+/*
+ * Quadtree_first
+ *
+ * Returns the first point under node in Morton order, or NULL if there is none.
+ *
+ * node - the node to look in; must be the original Node, or NULL
+ *
+ * Returns the dereferenced Node of the point.
+ */
+static inline Node* Quadtree_first(const Node * const node) {
+    Node *current = node == NULL ? NULL : DEREF(node);
+    while (current != NULL && current->is_square)
+        current = current->num_children > 0 ? DEREF(Node_children(current)[0]) : NULL;
+    return current;
+}
+
+/*
+ * Quadtree_cursor_seek
+ *
+ * Finds the first point under root that is not before start in Morton order, or, with
+ * after set, the first point after it.
+ *
+ * Follows the path to start down from root, remembering the first child after the path
+ * at the deepest square that has one. The path ends at an empty quadrant, a point, or a
+ * square that does not contain start, and the last two lie wholly before or after
+ * start. Whatever comes after start first is where the search ends up.
+ *
+ * root - the square to look in; must be the original Node
+ * start - the point to look from
+ * after - whether a point equal to start is skipped
+ *
+ * Returns the dereferenced Node of the point found, or NULL if there is none.
+ */
+static Node* Quadtree_cursor_seek(const Node * const root, const Point * const start,
+        const bool after) {
+    Node *square = DEREF(root), *next_node = NULL, *child_node, *child;
+    register uint64_t quadrant, index;
+    MortonPoint key, child_key;
+    MortonPoint_init(&key, square, start, 0);
+
+    while (true) {
+        quadrant = get_quadrant(&square->center, start);
+        child_node = Node_child(square, quadrant);
+        index = Node_child_index(square, quadrant) + (child_node != NULL);
+        if (index < square->num_children)
+            next_node = Node_children(square)[index];
+
+        if (child_node == NULL)
+            break;
+        child = DEREF(child_node);
+        if (child->is_square && in_range(child, start)) {
+            square = child;
+            continue;
+        }
+
+        if (!child->is_square && Point_equals(&child->center, start)) {
+            if (!after)
+                next_node = child_node;
+        }
+        else {
+            MortonPoint_init(&child_key, DEREF(root), &child->center, 0);
+            if (MortonPoint_compare(&child_key, &key) > 0)
+                next_node = child_node;
+        }
+        break;
+    }
+
+    return Quadtree_first(next_node);
+}
+
+void Quadtree_cursor_init(QuadtreeCursor * const cursor, const Quadtree * const node,
+        const Point * const start) {
+    RLU_READER_LOCK(rlu_self);
+
+    Node *current_node = (Node*)node, *current = DEREF(current_node);
+
+    // every point lives on the bottom-most level, so that is the only one we need
+    while (Node_valid(current->down)) {
+        current_node = current->down;
+        current = DEREF(current_node);
+    }
+
+    RLU_READER_UNLOCK(rlu_self);
+
+    // root squares are never freed, so the cursor can hold on to the root between steps
+    cursor->root = current_node;
+    cursor->node = cursor->parent = NULL;
+    cursor->index = 0;
+    cursor->seek = start != NULL;
+    cursor->after = false;
+    if (start != NULL)
+        cursor->from = *start;
+}
+
+bool Quadtree_cursor_next(QuadtreeCursor * const cursor, Point * const p) {
+    if (cursor->root == NULL)
+        return false;
+
+    RLU_READER_LOCK(rlu_self);
+
+    Node *next = cursor->seek ? Quadtree_cursor_seek(cursor->root, &cursor->from, cursor->after) :
+        Quadtree_first(cursor->root);
+    if (next != NULL)
+        cursor->from = *p = next->center;
+
+    RLU_READER_UNLOCK(rlu_self);
+
+    // once the traversal is over, it stays over
+    if (next == NULL) {
+        cursor->root = NULL;
+        return false;
+    }
+    cursor->seek = cursor->after = true;
+
+    return true;
+}
+
+void Quadtree_cursor_close(QuadtreeCursor * const cursor) {
+    cursor->root = cursor->node = cursor->parent = NULL;
+}
+
+/*
+ * Quadtree_save_helper
+ *
+ * Recursive helper function to write the points under node to a snapshot, in Morton
+ * order. Only traverses the level that node is on.
+ *
+ * node - the node to write; must be the original Node
+ * stream - the stream to write to
+ *
+ * Returns false if a write failed, true otherwise.
+ */
+static bool Quadtree_save_helper(const Node * const node, QuadtreeStream * const stream) {
+    Node *current = DEREF(node);
+
+    if (!current->is_square)
+        return QuadtreeStream_put_point(stream, current);
+
+    register uint64_t i;
+    for (i = 0; i < current->num_children; i++)
+        if (!Quadtree_save_helper(Node_children(current)[i], stream))
+            return false;
+
+    return true;
+}
+
+bool Quadtree_save(const Quadtree * const root, const int fd) {
+    QuadtreeStream *stream = QuadtreeStream_new(fd);
+    register uint64_t i;
+    uint64_t count = 0;
+    Point lo, hi;
+    bool success;
+
+    if (stream == NULL)
+        return false;
+    for (i = 0; i < D; i++) {
+        lo.data[i] = -COORD_MAX;
+        hi.data[i] = COORD_MAX;
+    }
+
+    RLU_READER_LOCK(rlu_self);
+
+    Node *current_node = (Node*)root, *current = DEREF(current_node);
+
+    // every point lives on the bottom-most level, so that is the only one we need
+    while (Node_valid(current->down)) {
+        current_node = current->down;
+        current = DEREF(current_node);
+    }
+
+    // squares keep no counts here, so the points are counted first, in the same critical
+    // section, so that the count matches the points written
+    Quadtree_range_query_helper(current_node, &lo, &hi, true, Quadtree_count_callback, NULL, &count);
+    success = QuadtreeStream_put_header(stream, current, Quadtree_settings(root)->promotion, count) &&
+        Quadtree_save_helper(current_node, stream);
+
+    RLU_READER_UNLOCK(rlu_self);
+
+    success = success && QuadtreeStream_flush(stream);
+    free(stream);
 
     return success;
 }
 
+Quadtree* Quadtree_load(const int fd) {
+    QuadtreeStream *stream = QuadtreeStream_new(fd);
+    Quadtree *root = NULL;
+    MortonPoint *sorted = NULL;
+    uint64_t *multiplicities = NULL, n;
+    coord_t length;
+    Point center;
+    float64_t promotion;
+    int error;
+
+    if (stream == NULL || !QuadtreeStream_get_header(stream, &length, &center, &promotion, &n))
+        goto load_done;
+
+    root = Quadtree_init(length, center);
+    Quadtree_set_promotion(root, promotion);
+    if (!QuadtreeStream_get_points(stream, root, &sorted, &multiplicities, n) ||
+            !Quadtree_bulk_load_sorted(root, sorted, n, multiplicities)) {
+        error = errno;
+        Quadtree_free(root);
+        root = NULL;
+        errno = error;
+    }
+
+load_done:
+    free(stream);
+    free(sorted);
+    free(multiplicities);
+
+    return root;
+}
+
 /*
  * Quadtree_free_helper
  *
@@ -478,12 +1850,10 @@ bool Quadtree_remove(Quadtree * const node, const Point p) {
 bool Quadtree_free_helper(Node * const node, QuadtreeFreeResult * const result) {
     bool success = true;
     if (node->is_square) {
-        register uint8_t i;
-        for (i = 0; i < (1 << D); i++)
-            if (node->children[i] != NULL) {
-                success &= Quadtree_free_helper(node->children[i], result);
-                node->children[i] = NULL;
-            }
+        register uint64_t i;
+        for (i = 0; i < node->num_children; i++)
+            success &= Quadtree_free_helper(Node_children(node)[i], result);
+        node->num_children = 0;
     }
 
     // up and down
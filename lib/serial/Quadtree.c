@@ -2,113 +2,1919 @@
 Naive serial implementation of compressed skip quadtree
 */
 
+// this variant keeps the number of points below every square, so it and everything built
+// against it need SUBTREE_COUNTS, as the Makefile defines for it
+#ifndef SUBTREE_COUNTS
+#error "SerialSkipQuadtree keeps subtree counts; build with -DSUBTREE_COUNTS"
+#endif
+
+// with AGGREGATES defined, this variant keeps the tight bounding box of the points below
+// every square, which queries prune squares by instead of the bounds of the square
+#ifdef AGGREGATES
+#define TIGHT_BOUNDS
+#endif
+
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "../types.h"
+#include "../Quadtree.h"
+#include "../Point.h"
+#include "../util.h"
+
+// rlu_self, included to make compiler happy
+__thread rlu_thread_data_t *rlu_self = NULL;
+
+// rand() functions
+#ifdef QUADTREE_TEST
+extern uint32_t test_rand();
+extern bool test_rand_fed();
+#define rand() test_rand()
+#else
+extern uint32_t Marsaglia_rand();
+#define rand() Marsaglia_rand()
+extern void Marsaglia_srand(uint32_t);
+#define srand(x) Marsaglia_srand(x)
+#endif
+
+// initial capacity of the stack used by Quadtree_remove_node
+#define REMOVE_STACK_SIZE 64
+
+// most neighbors that Quadtree_nearest_helper makes room for before it finds them
+#define NEAREST_HEAP_SIZE 64
+
+// number of searches that Quadtree_search_batch keeps in flight
+#define SEARCH_BATCH_WIDTH 16
+
+// quadtree counter
+#ifdef QUADTREE_TEST
+uint64_t QUADTREE_NODE_COUNT = 0;
+#endif
+
+/*
+ * struct QuadtreeArena_t
+ *
+ * The memory that all nodes of a tree are allocated from. Every node stays within the
+ * arena of its tree, so the arena can be found from any node through Arena_of.
+ *
+ * arena - the arena to allocate nodes and children arrays from; must come first
+ * points - the number of point nodes currently allocated
+ * distinct - of them, the number on the bottom-most level, one for every distinct point
+ * arrays - the number of children arrays currently allocated
+ * root - the root square of the bottom-most level, once the tree is indexed
+ * index - the squares of the bottom-most level by depth and Morton prefix, as built by
+ *     Quadtree_build_index; NULL if the tree is not indexed
+ * promotion - the probability that a point on one level is also on the level above
+ * weight, weight_ctx - with AGGREGATES defined, the weight function of the tree and its
+ *     context, as set by Quadtree_set_weight
+ */
+typedef struct QuadtreeArena_t {
+    Arena arena;
+    uint64_t points, distinct, arrays;
+    Node *root;
+    HashTable *index;
+    float64_t promotion;
+#ifdef AGGREGATES
+    QuadtreeWeight weight;
+    void *weight_ctx;
+#endif
+} QuadtreeArena;
+
+/*
+ * Node_new
+ *
+ * Allocates memory for and initializes an empty node in the given arena.
+ *
+ * tree - the arena to allocate from
+ * length - the length of the square; unused for a point
+ * center - the center of the node
+ * is_square - whether the node is a square
+ * is_bottom - whether the node is a point on the lowest level
+ *
+ * Returns a pointer to the created node.
+ */
+static Node* Node_new(QuadtreeArena * const tree, const coord_t length, const Point center,
+        const bool is_square, const bool is_bottom) {
+    Node *node = (Node*)Arena_alloc(&tree->arena,
+        is_square ? sizeof(Node) : is_bottom ? BOTTOM_NODE_SIZE : POINT_NODE_SIZE);
+    node->is_square = is_square;
+    node->is_bottom = is_bottom;
+    node->center = center;
+    node->parent = NULL;
+    node->up = NULL;
+    node->down = NULL;
+    if (is_bottom) {
+        node->value = NULL;
+#ifdef MULTISET
+        node->multiplicity = 1;
+#endif
+    }
+    if (is_square) {
+        node->length = length;
+        node->num_children = 0;
+        node->capacity = INLINE_CHILDREN;
+        memset(node->bitmap, 0, sizeof(node->bitmap));
+        node->count = 0;
+#ifdef AGGREGATES
+        QuadtreeAggregate_clear(&node->aggregate);
+#endif
+    }
+#ifdef QUADTREE_TEST
+    node->id = QUADTREE_NODE_COUNT++;
+#endif
+    tree->points += !is_square;
+    tree->distinct += is_bottom;
+    return node;
+}
+
+/*
+ * QuadtreeArena_init
+ *
+ * Allocates memory for and initializes the arena of a new tree.
+ *
+ * Returns a pointer to the created arena.
+ */
+static QuadtreeArena* QuadtreeArena_init() {
+    QuadtreeArena *tree = (QuadtreeArena*)malloc(sizeof(QuadtreeArena));
+    Arena_init(&tree->arena);
+    tree->points = 0;
+    tree->distinct = 0;
+    tree->arrays = 0;
+    tree->root = NULL;
+    tree->index = NULL;
+    tree->promotion = PROMOTION_PROBABILITY;
+#ifdef AGGREGATES
+    tree->weight = NULL;
+    tree->weight_ctx = NULL;
+#endif
+    return tree;
+}
+
+/*
+ * Leaf_init
+ *
+ * Allocates memory for and initializes a point node in the same tree as neighbor.
+ *
+ * neighbor - any node of the tree
+ * center - the point
+ * is_bottom - whether the node goes on the lowest level
+ *
+ * Returns a pointer to the created node.
+ */
+static inline Node* Leaf_init(const Node * const neighbor, const Point center,
+        const bool is_bottom) {
+    return Node_new((QuadtreeArena*)Arena_of(neighbor), 0, center, false, is_bottom);
+}
+
+/*
+ * Square_init
+ *
+ * Allocates memory for and initializes a square in the same tree as neighbor.
+ *
+ * neighbor - any node of the tree
+ * length - the length of the square
+ * center - the center of the square
+ *
+ * Returns a pointer to the created square.
+ */
+static inline Node* Square_init(const Node * const neighbor, const coord_t length,
+        const Point center) {
+    return Node_new((QuadtreeArena*)Arena_of(neighbor), length, center, true, false);
+}
+
+Node* Node_init(const coord_t length, const Point center) {
+    return Node_new(QuadtreeArena_init(), 0, center, false, true);
+}
+
+Quadtree* Quadtree_init(const coord_t length, const Point center) {
+    return Node_new(QuadtreeArena_init(), length, center, true, false);
+}
+
+bool Quadtree_set_promotion(Quadtree * const root, const float64_t promotion) {
+    // also false for NaN
+    if (!(promotion >= 0 && promotion < 1))
+        return false;
+    ((QuadtreeArena*)Arena_of(root))->promotion = promotion;
+    return true;
+}
+
+/*
+ * Quadtree_height
+ *
+ * Returns the number of levels that p goes on in the tree that node is in.
+ *
+ * Under QUADTREE_TEST, while test_rand is being fed, the levels are drawn from it instead
+ * of hashed, so that tests can lay out the levels themselves.
+ *
+ * node - any node of the tree
+ * p - the point
+ *
+ * Returns the number of levels, at least 1.
+ */
+static inline uint64_t Quadtree_height(const Node * const node, const Point * const p) {
+#ifdef QUADTREE_TEST
+    register uint64_t height;
+    if (test_rand_fed()) {
+        for (height = 1; rand() % 100 < 50 && height < MAX_HEIGHT; height++);
+        return height;
+    }
+#endif
+    return get_height(p, ((const QuadtreeArena*)Arena_of(node))->promotion);
+}
+
+/*
+ * Node_free
+ *
+ * Returns the memory used to represent this node to its tree's arena.
+ *
+ * node - the node to be freed
+ */
+static inline void Node_free(Node * const node) {
+    QuadtreeArena *tree = (QuadtreeArena*)Arena_of(node);
+    tree->points -= !node->is_square;
+    tree->distinct -= node->is_bottom;
+    if (node->is_square && node->capacity > INLINE_CHILDREN) {
+        tree->arrays--;
+        Arena_free(node->children, sizeof(Node*) * node->capacity);
+    }
+    Arena_free((void*)node, Node_size(node));
+}
+
+/*
+ * Node_set_child
+ *
+ * Sets the child of square in the given quadrant, adding, replacing, or removing it. Once
+ * the children no longer fit in the square itself, they move to an array that grows by
+ * doubling, within the arena of the tree.
+ *
+ * square - the square to change
+ * quadrant - the quadrant, [0, 2^D)
+ * child - the new child; NULL to remove the child in the quadrant
+ */
+static void Node_set_child(Node * const square, const uint64_t quadrant, Node * const child) {
+    register uint64_t word = quadrant / 64, bit = 1ULL << quadrant % 64;
+    register uint64_t index = Node_child_index(square, quadrant);
+    Node **children = Node_children(square);
+
+    if (square->bitmap[word] & bit) {
+        if (child != NULL) {
+            children[index] = child;
+            return;
+        }
+        memmove(children + index, children + index + 1,
+            sizeof(Node*) * (square->num_children - index - 1));
+        square->num_children--;
+        square->bitmap[word] &= ~bit;
+        return;
+    }
+
+    if (child == NULL)
+        return;
+
+    if (square->num_children == square->capacity) {
+        register uint64_t capacity = 2 * square->capacity;
+        QuadtreeArena *tree = (QuadtreeArena*)Arena_of(square);
+        Node **larger_children = (Node**)Arena_alloc(&tree->arena, sizeof(Node*) * capacity);
+        memcpy(larger_children, children, sizeof(Node*) * square->num_children);
+        if (square->capacity > INLINE_CHILDREN)
+            Arena_free(children, sizeof(Node*) * square->capacity);
+        else
+            tree->arrays++;
+        square->children = children = larger_children;
+        square->capacity = capacity;
+    }
+
+    memmove(children + index + 1, children + index,
+        sizeof(Node*) * (square->num_children - index));
+    children[index] = child;
+    square->num_children++;
+    square->bitmap[word] |= bit;
+}
+
+/*
+ * Quadtree_depth
+ *
+ * Returns the number of times that root has to be halved to get a square of the given
+ * length, which is root's length over a power of two.
+ *
+ * root - the root square of the tree
+ * length - the length of the square
+ *
+ * Returns the depth of squares of the given length.
+ */
+static inline uint64_t Quadtree_depth(const Node * const root, const coord_t length) {
+#ifdef INTEGER_GRID
+    return __builtin_ctzll(root->length) - __builtin_ctzll(length);
+#else
+    register float64_t ratio = (float64_t)root->length / length;
+    return ratio < 0x1p63 ? 63 - __builtin_clzll((uint64_t)ratio) : 64;
+#endif
+}
+
+/*
+ * Quadtree_index_bits
+ *
+ * Returns the number of bits per dimension in the Morton keys of points within root,
+ * which is also the deepest depth that the index can tell apart.
+ *
+ * root - the root square of the tree
+ */
+static inline uint64_t Quadtree_index_bits(const Node * const root) {
+#ifdef INTEGER_GRID
+    return __builtin_ctzll(root->length);
+#else
+    return MORTON_BITS;
+#endif
+}
+
+/*
+ * Quadtree_index_key
+ *
+ * Hashes a depth together with the Morton prefix of that length of a point, which
+ * identifies the square of that depth that the point is in.
+ *
+ * key - the Morton key of the point
+ * bits - the number of bits per dimension in key
+ * depth - the depth of the square, at most bits
+ *
+ * Returns the key of the square in the index.
+ */
+static inline uint64_t Quadtree_index_key(const uint64_t * const key, const uint64_t bits,
+        const uint64_t depth) {
+    register uint64_t hash = (depth + 1) * 0x9e3779b97f4a7c15ULL, i;
+    for (i = 0; i < D; i++)
+        hash = (hash ^ (key[i] >> (bits - depth))) * 0x9e3779b97f4a7c15ULL;
+    return hash ^ (hash >> 32);
+}
+
+/*
+ * fattest
+ *
+ * Returns the number in (low, high] with the most trailing zeros, which is where a
+ * binary search over (low, high] looks first.
+ *
+ * Invariant: low < high.
+ */
+static inline uint64_t fattest(const uint64_t low, const uint64_t high) {
+    return high & -(1ULL << (63 - __builtin_clzll(low ^ high)));
+}
+
+/*
+ * Quadtree_index_handle
+ *
+ * Finds the key that a square on the bottom-most level goes under in the index.
+ *
+ * A square spans the depths from that of its parent, exclusive, to its own, and is
+ * indexed at the fattest of them: the depth that any binary search ends up looking at
+ * first among them, since no other depth in the span has as many trailing zeros.
+ *
+ * tree - the tree of the square, which must be indexed
+ * square - the square to index
+ * key - buffer for the key
+ *
+ * Returns false if the square is the root or too deep to index.
+ */
+static bool Quadtree_index_handle(const QuadtreeArena * const tree, const Node * const square,
+        uint64_t * const key) {
+    if (!square->is_square || square->parent == NULL)
+        return false;
+
+    register uint64_t bits = Quadtree_index_bits(tree->root);
+    register uint64_t depth = fattest(Quadtree_depth(tree->root, square->parent->length),
+        Quadtree_depth(tree->root, square->length));
+    if (depth > bits)
+        return false;
+
+    MortonPoint center;
+    MortonPoint_init(&center, tree->root, &square->center, 0);
+    *key = Quadtree_index_key(center.key, bits, depth);
+    return true;
+}
+
+/*
+ * Quadtree_index_add
+ *
+ * Adds square to the index of its tree, if the tree is indexed and square is a square on
+ * the bottom-most level. Must be called whenever such a square is created or moved to a
+ * different parent.
+ *
+ * square - the node to add
+ */
+static void Quadtree_index_add(Node * const square) {
+    QuadtreeArena *tree = (QuadtreeArena*)Arena_of(square);
+    uint64_t key;
+    if (tree->index != NULL && square->down == NULL && Quadtree_index_handle(tree, square, &key))
+        HashTable_put(tree->index, key, square);
+}
+
+/*
+ * Quadtree_index_remove
+ *
+ * Removes square from the index of its tree, if it is in there. Must be called while
+ * square still has the parent it was added with.
+ *
+ * square - the node to remove
+ */
+static void Quadtree_index_remove(Node * const square) {
+    QuadtreeArena *tree = (QuadtreeArena*)Arena_of(square);
+    uint64_t key;
+    if (tree->index != NULL && square->down == NULL && Quadtree_index_handle(tree, square, &key))
+        HashTable_remove(tree->index, key, square);
+}
+
+/*
+ * Quadtree_index_locate
+ *
+ * Finds the smallest square on the bottom-most level that contains p through the index.
+ *
+ * The depth of that square is known to be in [low, high], starting from the whole range
+ * of depths. A square found at the fattest depth in (low, high] that contains p raises low
+ * to its own depth. Otherwise, the chain of squares containing p ends above that depth,
+ * since the square spanning that depth would have been indexed there, and high drops
+ * below it.
+ *
+ * Invariant: tree is indexed and p is within tree->root.
+ *
+ * tree - the tree to search
+ * p - the point to locate
+ *
+ * Returns a square containing p, which is the smallest one unless it is too deep to be
+ * indexed; Quadtree_search_helper finishes the search from there in any case.
+ */
+static Node* Quadtree_index_locate(const QuadtreeArena * const tree, const Point * const p) {
+    Node *square = tree->root, *found;
+    register uint64_t bits = Quadtree_index_bits(tree->root), low = 0, high = bits, depth, found_depth;
+    MortonPoint point;
+    MortonPoint_init(&point, tree->root, p, 0);
+
+    while (low < high) {
+        depth = fattest(low, high);
+        found = (Node*)HashTable_get(tree->index, Quadtree_index_key(point.key, bits, depth));
+        // a square of another depth can only come from a collision of keys, but it is
+        // taken as long as it is no shallower and contains p, which keeps the search going
+        if (found != NULL && (found_depth = Quadtree_depth(tree->root, found->length)) >= depth &&
+                in_range(found, p)) {
+            square = found;
+            low = found_depth;
+        }
+        else
+            high = depth - 1;
+    }
+
+    return square;
+}
+
+/*
+ * Quadtree_search_helper
+ *
+ * Iterative helper function to traverse the tree horizontally before dropping levels.
+ *
+ * Invariant: node is always a square.
+ *
+ * node - the square to look in
+ * p - the point to search for
+ *
+ * Returns the node of p on the topmost level that it is found on, or NULL if p is not in
+ * node.
+ */
+Node* Quadtree_search_helper(Node * node, const Point *p) {
+    if (!in_range(node, p))
+        return NULL;
+
+    Node *child;
+    while (true) {
+        child = Node_child(node, get_quadrant(&node->center, p));
+
+        // if the child is a square containing p, move to it
+        if (child != NULL && child->is_square && in_range(child, p)) {
+            node = child;
+            continue;
+        }
+
+        // otherwise, we check if the child point matches, if it is a point node
+        if (child != NULL && !child->is_square && Point_equals(&child->center, p))
+            return child;
+
+        // if we're here, then we need to branch down a level
+        if (node->down == NULL)
+            return NULL;
+        node = node->down;
+    }
+}
+
+/*
+ * Quadtree_find
+ *
+ * Searches for p in the tree that node is in, as Quadtree_search does.
+ *
+ * node - any node of the tree, such as the root
+ * p - the point to search for
+ *
+ * Returns the node of p on the topmost level that it is found on, or NULL if p is not in
+ * the tree.
+ */
+static Node* Quadtree_find(const Quadtree * const node, const Point * const p) {
+    Node *current = (Node*)node;
+
+    if (current == NULL)
+        return NULL;
+
+    // with an index, jump straight to the smallest square containing p
+    QuadtreeArena *tree = (QuadtreeArena*)Arena_of(current);
+    if (tree->index != NULL)
+        return in_range(tree->root, p) ? Quadtree_search_helper(Quadtree_index_locate(tree, p), p) : NULL;
+
+    while (current->up != NULL)
+        current = current->up;
+
+    return Quadtree_search_helper(current, p);
+}
+
+bool Quadtree_search(const Quadtree * const node, const Point p) {
+    return Quadtree_find(node, &p) != NULL;
+}
+
+/*
+ * Quadtree_finger_square
+ *
+ * Finds the smallest square on the bottom-most level that contains p, starting from
+ * finger and climbing up through parent only as far as needed.
+ *
+ * finger - any node of the tree, on any level
+ * p - the point to find the square of
+ *
+ * Returns the smallest square containing p, or NULL if p is outside of the tree.
+ */
+static Node* Quadtree_finger_square(Node *finger, const Point * const p) {
+    Node *child;
+
+    // every node has a copy on the bottom-most level, and every point there has a parent
+    while (finger->down != NULL)
+        finger = finger->down;
+    if (!finger->is_square)
+        finger = finger->parent;
+
+    while (!in_range(finger, p)) {
+        if (finger->parent == NULL)
+            return NULL;
+        finger = finger->parent;
+    }
+
+    while ((child = Node_child(finger, get_quadrant(&finger->center, p))) != NULL &&
+            child->is_square && in_range(child, p))
+        finger = child;
+
+    return finger;
+}
+
+bool Quadtree_search_from(Node ** const finger, const Point p) {
+    Node *square = Quadtree_finger_square(*finger, &p);
+    if (square == NULL)
+        return false;
+
+    Node *child = Node_child(square, get_quadrant(&square->center, &p));
+    if (child != NULL && !child->is_square && Point_equals(&child->center, &p)) {
+        *finger = child;
+        return true;
+    }
+
+    *finger = square;
+    return false;
+}
+
+/*
+ * struct QuadtreeSearch_t
+ *
+ * Stores the state of one of the searches that Quadtree_search_batch runs at once.
+ *
+ * square - the square the search is at; NULL if the slot is free
+ * child - the child of square that p falls into, once fetched
+ * fetched - whether child has been read from square yet
+ * index - the index of the point being searched for
+ */
+typedef struct QuadtreeSearch_t {
+    const Node *square, *child;
+    bool fetched;
+    uint64_t index;
+} QuadtreeSearch;
+
+uint64_t Quadtree_search_batch(const Quadtree * const node, const Point * const points,
+        const uint64_t n, bool * const results) {
+    const Node *top = node;
+    while (top->up != NULL)
+        top = top->up;
+
+    QuadtreeSearch searches[SEARCH_BATCH_WIDTH], *search;
+    register uint64_t next = 0, found = 0, active, i;
+    const Point *p;
+
+    for (i = 0; i < SEARCH_BATCH_WIDTH; i++)
+        searches[i].square = NULL;
+
+    // every round advances each search by one step, which touches only memory that was
+    // prefetched during the previous round
+    do {
+        for (i = 0, active = 0; i < SEARCH_BATCH_WIDTH; i++) {
+            search = searches + i;
+
+            // start the next search in a free slot
+            if (search->square == NULL) {
+                if (next == n)
+                    continue;
+                search->index = next++;
+                search->fetched = false;
+                if (results != NULL)
+                    results[search->index] = false;
+                if (!in_range(top, points + search->index))
+                    continue;
+                search->square = top;
+            }
+            active++;
+            p = points + search->index;
+
+            // fetch the child that p falls into, and come back to it next round
+            if (!search->fetched) {
+                search->child = Node_child(search->square, get_quadrant(&search->square->center, p));
+                if (search->child != NULL) {
+                    __builtin_prefetch(search->child);
+                    search->fetched = true;
+                    continue;
+                }
+            }
+            else {
+                search->fetched = false;
+
+                // if the child is a square containing p, move to it
+                if (search->child->is_square && in_range(search->child, p)) {
+                    search->square = search->child;
+                    __builtin_prefetch(Node_children(search->square) +
+                        Node_child_index(search->square, get_quadrant(&search->square->center, p)));
+                    continue;
+                }
+
+                // otherwise, we check if the child point matches, if it is a point node
+                if (!search->child->is_square && Point_equals(&search->child->center, p)) {
+                    if (results != NULL)
+                        results[search->index] = true;
+                    found++;
+                    search->square = NULL;
+                    continue;
+                }
+            }
+
+            // if we're here, then we need to branch down a level
+            search->square = search->square->down;
+            if (search->square != NULL)
+                __builtin_prefetch(search->square);
+        }
+    } while (active > 0 || next < n);
+
+    return found;
+}
+
+#ifdef AGGREGATES
+/*
+ * Quadtree_weight
+ *
+ * Returns the weight of p in the tree that node is in, as given by its weight function.
+ *
+ * node - any node of the tree
+ * p - the point to weigh
+ */
+static inline float64_t Quadtree_weight(const Node * const node, const Point * const p) {
+    const QuadtreeArena * const tree = (const QuadtreeArena*)Arena_of(node);
+    return tree->weight == NULL ? 1 : tree->weight(p, tree->weight_ctx);
+}
+
+/*
+ * Quadtree_bounds
+ *
+ * Recomputes the bounding box in the aggregate of square from its children.
+ *
+ * square - the square to recompute the bounding box of
+ */
+static void Quadtree_bounds(Node * const square) {
+    register uint64_t i;
+    Node *child;
+    for (i = 0; i < D; i++) {
+        square->aggregate.lo.data[i] = COORD_MAX;
+        square->aggregate.hi.data[i] = -COORD_MAX;
+    }
+    for (i = 0; i < square->num_children; i++) {
+        child = Node_children(square)[i];
+        if (child->is_square)
+            QuadtreeAggregate_extend(&square->aggregate, &child->aggregate.lo, &child->aggregate.hi);
+        else
+            QuadtreeAggregate_extend(&square->aggregate, &child->center, &child->center);
+    }
+}
+#endif
+
+/*
+ * Node_count
+ *
+ * Returns the number of points at or below node on its level: 1 for a point, or with
+ * MULTISET defined, the multiplicity of a point on the bottom-most level.
+ */
+static inline uint64_t Node_count(const Node * const node) {
+    if (node->is_square)
+        return node->count;
+#ifdef MULTISET
+    if (node->is_bottom)
+        return node->multiplicity;
+#endif
+    return 1;
+}
+
+/*
+ * Quadtree_summary_add
+ *
+ * Adds p to the count of points, and with AGGREGATES defined to the aggregate, of square
+ * and of every square above it on its level.
+ *
+ * square - the square that p was added under
+ * p - the point that was added
+ */
+static inline void Quadtree_summary_add(Node *square, const Point * const p) {
+#ifdef AGGREGATES
+    register const float64_t weight = Quadtree_weight(square, p);
+#endif
+    for (; square != NULL; square = square->parent) {
+        square->count++;
+#ifdef AGGREGATES
+        QuadtreeAggregate_add(&square->aggregate, p, weight);
+#endif
+    }
+}
+
+/*
+ * Quadtree_summary_remove
+ *
+ * Removes p from the count of points, and with AGGREGATES defined from the aggregate, of
+ * square and of every square above it on its level.
+ *
+ * A bounding box only has to be recomputed while p was on its boundary, and only if p is
+ * gone. Once p is inside the box of a square, it is inside the boxes of all the squares
+ * above it too.
+ *
+ * square - the square that p was removed from
+ * p - the point that was removed
+ * gone - whether square no longer has p as a child, rather than one copy less of it
+ */
+static inline void Quadtree_summary_remove(Node *square, const Point * const p,
+        const bool gone) {
+#ifdef AGGREGATES
+    register const float64_t weight = Quadtree_weight(square, p);
+    register uint64_t i;
+    bool on_boundary = gone;
+#endif
+    for (; square != NULL; square = square->parent) {
+        square->count--;
+#ifdef AGGREGATES
+        square->aggregate.weight -= weight;
+        for (i = 0; i < D; i++)
+            square->aggregate.sum[i] -= weight * p->data[i];
+        if (on_boundary) {
+            for (i = 0, on_boundary = false; i < D && !on_boundary; i++)
+                on_boundary = p->data[i] == square->aggregate.lo.data[i] ||
+                    p->data[i] == square->aggregate.hi.data[i];
+            if (on_boundary)
+                Quadtree_bounds(square);
+        }
+#endif
+    }
+}
+
+#ifdef MULTISET
+/*
+ * Quadtree_repeat
+ *
+ * Counts a point that is already in the tree once more. Only the node of the point on the
+ * bottom-most level keeps the count, so besides it, only the counts and aggregates of the
+ * squares above it on that level change.
+ *
+ * node - the node of the point, on any level
+ *
+ * Returns the node of the point on the bottom-most level.
+ */
+static inline Node* Quadtree_repeat(Node *node) {
+    while (node->down != NULL)
+        node = node->down;
+    node->multiplicity++;
+    Quadtree_summary_add(node->parent, &node->center);
+    return node;
+}
+#endif
+
+/*
+ * Quadtree_insert_helper
+ *
+ * Helper function that inserts p into the square it belongs in on each level, from the
+ * bottom-most level upward, using each new node as the down of the one on the level
+ * above it.
+ *
+ * Invariant: p is not on any of the levels yet, and parents[i] is the deepest square on
+ * level i that contains p.
+ *
+ * parents - the square to insert p into on each level, bottom-most level first
+ * levels - the number of levels to insert p on
+ * p - the point to add
+ *
+ * Returns the node added on the topmost level.
+ */
+Node* Quadtree_insert_helper(Node * const * const parents, const uint64_t levels,
+        const Point * const p) {
+    Node *parent, *down_node = NULL, *new_node = NULL;
+    register uint64_t level;
+    for (level = 0; level < levels; level++, down_node = new_node) {
+        parent = parents[level];
+
+        new_node = Leaf_init(parent, *p, down_node == NULL);
+        new_node->parent = parent;
+
+        if (down_node != NULL) {
+            new_node->down = down_node;
+            down_node->up = new_node;
+        }
+
+        // time to try inserting onto this level
+        register uint64_t quadrant = get_quadrant(&parent->center, p);
+
+        // if the slot is empty, it's trivial
+        Node *sibling = Node_child(parent, quadrant);
+        if (sibling == NULL) {
+            Node_set_child(parent, quadrant, new_node);
+            Quadtree_summary_add(parent, p);
+            continue;
+        }
+
+        // if it's not empty, that means there's already a node there, the sibling-to-be
+
+        // create a new square to contain the sibling and the new node, small enough that
+        // they are in different quadrants
+        uint64_t square_quadrant = quadrant;
+        Point square_center;
+        coord_t square_length;
+        get_split_square(parent, &sibling->center, p, &square_center, &square_length);
+        Node *square = Square_init(parent, square_length, square_center);
+        square->parent = parent;
+        square->count = Node_count(sibling);
+#ifdef AGGREGATES
+        if (sibling->is_square)
+            square->aggregate = sibling->aggregate;
+        else
+            QuadtreeAggregate_add(&square->aggregate, &sibling->center,
+                Quadtree_weight(square, &sibling->center) * square->count);
+#endif
+
+        // okay, now we have separate quadrants to use
+        Node_set_child(square, get_quadrant(&square->center, p), new_node);
+        Node_set_child(square, get_quadrant(&square->center, &sibling->center), sibling);
+
+        // now, we need to find the down square to this square, if we're not on the last level
+        if (parent->down != NULL) {
+            Node *down_square = parent->down;
+            while (!Point_equals(&down_square->center, &square->center) ||
+                    abs(down_square->length - square->length) > PRECISION)
+                down_square = Node_child(down_square, get_quadrant(&down_square->center, &square->center));
+            square->down = down_square;
+            down_square->up = square;
+        }
+
+        // the sibling moves under the new square, which changes where the index keeps it
+        Quadtree_index_remove(sibling);
+        Node_set_child(square->parent, square_quadrant, square);
+        new_node->parent = square;
+        sibling->parent = square;
+        Quadtree_index_add(square);
+        Quadtree_index_add(sibling);
+        Quadtree_summary_add(square, p);
+    }
+
+    return new_node;
+}
+
+/*
+ * Quadtree_add_helper
+ *
+ * Iterative helper function to add new points to the tree.
+ *
+ * The process is three-part:
+ * 1. We traverse node on the topmost level to where p should be added.
+ * 2. We then drop down a level from there and repeat, remembering the parent square
+ *    that p belongs in on every level.
+ * 3. We then insert from the bottom-most level upward with Quadtree_insert_helper.
+ *
+ * node - the node to start inserting at; should be a square
+ * p - the point to add
+ * gap_depth - the number of levels we need to go through before actually inserting nodes
+ *
+ * Returns the node added on the topmost inserted level, or NULL if the action failed.
+ */
+Node* Quadtree_add_helper(Node * node, const Point * const p, const uint64_t gap_depth) {
+    if (!in_range(node, p))
+        return NULL;
+
+    register uint64_t levels = 0, level;
+    Node *current;
+    for (current = node; current != NULL; current = current->down)
+        levels++;
+
+    // per-level stack of the squares that p gets added to, bottom-most level first
+    Node *parents[levels];
+
+    Node *parent;
+    for (level = 0; level < levels; level++) {
+        // horizontal traversal
+        do {
+            parent = node;
+            node = Node_child(parent, get_quadrant(&parent->center, p));
+        } while(node != NULL && node->is_square && in_range(node, p));
+
+        // check for duplication
+        if (level >= gap_depth && node != NULL && !node->is_square && Point_equals(&node->center, p))
+#ifdef MULTISET
+            return Quadtree_repeat(node);
+#else
+            return NULL;
+#endif
+
+        parents[levels - 1 - level] = parent;
+        node = parent->down;
+    }
+
+    return Quadtree_insert_helper(parents, levels - gap_depth, p);
+}
+
+/*
+ * Quadtree_add_node
+ *
+ * Adds p to the tree as Quadtree_add does.
+ *
+ * node - the root node of the tree to add to
+ * p - the point being added
+ *
+ * Returns the node of p added on the topmost level, or NULL if p was not added.
+ */
+static Node* Quadtree_add_node(Quadtree * const node, const Point * const p) {
+    Node *current = node;
+    register uint64_t height;
+
+    for (height = Quadtree_height(node, p); height > 1; height--) {
+        if (current->up == NULL) {
+            current->up = Square_init(current, current->length, current->center);
+            current->up->down = current;
+        }
+        current = current->up;
+    }
+    
+    register uint64_t gap_depth = 0;  // number of layers to ignore when inserting
+
+    while (current->up != NULL) {
+        gap_depth++;
+        current = current->up;
+    }
+
+    return Quadtree_add_helper(current, p, gap_depth);
+}
+
+bool Quadtree_add(Quadtree * const node, const Point p) {
+    return Quadtree_add_node(node, &p) != NULL;
+}
+
+uint64_t Quadtree_add_batch(Quadtree * const node, const Point * const points,
+        const uint64_t n, bool * const results) {
+    MortonPoint *sorted = (MortonPoint*)malloc(sizeof(*sorted) * n);
+    register uint64_t count = 0, added = 0, levels, height, level, i;
+    Node *current;
+    bool duplicate;
+
+    if (results != NULL)
+        for (i = 0; i < n; i++)
+            results[i] = false;
+    if (sorted == NULL)
+        return 0;
+
+    // only points within the root square can be added
+    for (i = 0; i < n; i++)
+        if (in_range(node, &points[i]))
+            MortonPoint_init(&sorted[count++], node, &points[i], i);
+    qsort(sorted, count, sizeof(*sorted), MortonPoint_compare);
+
+    Node *top = node;
+    for (levels = 1; top->up != NULL; levels++)
+        top = top->up;
+
+    // per-level squares that p gets added to, and the deepest square that the previous
+    // point was added to, which is where the search for the next point resumes from; no
+    // point goes on more than MAX_HEIGHT levels, so neither ever has to grow
+    Node *parents[MAX_HEIGHT], *last[MAX_HEIGHT];
+    for (current = node, level = 0; current != NULL; current = current->up, level++)
+        last[level] = current;
+
+    const Point *p;
+    Node *square, *child, *down_square;
+    for (i = 0; i < count; i++) {
+        p = &sorted[i].point;
+
+        // add any levels that p goes on but the tree does not have yet
+        height = Quadtree_height(node, p);
+        while (levels < height) {
+            top->up = Square_init(top, top->length, top->center);
+            top->up->down = top;
+            top = top->up;
+            last[levels++] = top;
+        }
+
+        // find the square that p belongs in on every level, from the top down
+        duplicate = false;
+        for (level = levels, down_square = NULL; level-- > 0 && !duplicate; down_square = square->down) {
+            // resume from the deepest square that both p and the previous point are in,
+            // unless the level above has already led deeper than that
+            square = last[level];
+            while (!in_range(square, p))
+                square = square->parent;
+            if (down_square != NULL && down_square->length < square->length)
+                square = down_square;
+
+            // horizontal traversal
+            while ((child = Node_child(square, get_quadrant(&square->center, p))) != NULL &&
+                    child->is_square && in_range(child, p))
+                square = child;
+
+            // check for duplication
+            duplicate = level < height && child != NULL && !child->is_square &&
+                Point_equals(&child->center, p);
+
+            parents[level] = last[level] = square;
+        }
+        if (duplicate) {
+#ifdef MULTISET
+            Quadtree_repeat(child);
+            if (results != NULL)
+                results[sorted[i].index] = true;
+            added++;
+#endif
+            continue;
+        }
+
+        // any square added on a level is on the path to p, so p's parents are the deepest
+        current = Quadtree_insert_helper(parents, height, p);
+        for (level = height; level-- > 0; current = current->down)
+            last[level] = current->parent;
+
+        if (results != NULL)
+            results[sorted[i].index] = true;
+        added++;
+    }
+
+    free(sorted);
+
+    return added;
+}
+
+bool Quadtree_add_from(Node ** const finger, const Point p) {
+    Node *square = Quadtree_finger_square(*finger, &p), *child;
+    if (square == NULL)
+        return false;
+
+    // check for duplication, which only has to be done on the bottom-most level
+    child = Node_child(square, get_quadrant(&square->center, &p));
+    if (child != NULL && !child->is_square && Point_equals(&child->center, &p)) {
+        *finger = child;
+#ifdef MULTISET
+        Quadtree_repeat(child);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // per-level squares that p gets added to, bottom-most level first; they are allocated
+    // up front, so that running out of memory fails the add before any level is added
+    register uint64_t height, levels = Quadtree_height(square, &p);
+    Node *local_parents[16], **parents = local_parents;
+    if (levels > 16 && (parents = (Node**)malloc(sizeof(*parents) * levels)) == NULL)
+        return false;
+    parents[0] = square;
+
+    for (height = 1; height < levels; height++) {
+        // climb to the nearest square that has a copy on the level above, adding the level
+        // if there is none, and go back down on that level
+        square = parents[height - 1];
+        while (square->up == NULL && square->parent != NULL)
+            square = square->parent;
+        if (square->up == NULL) {
+            square->up = Square_init(square, square->length, square->center);
+            square->up->down = square;
+        }
+        square = square->up;
+        while ((child = Node_child(square, get_quadrant(&square->center, &p))) != NULL &&
+                child->is_square && in_range(child, &p))
+            square = child;
+        parents[height] = square;
+    }
+
+    Node *node = Quadtree_insert_helper(parents, height, &p);
+    while (node->down != NULL)
+        node = node->down;
+    *finger = node;
+
+    if (parents != local_parents)
+        free(parents);
+
+    return true;
+}
+
+/*
+ * Quadtree_bulk_load_level
+ *
+ * Helper function to build a single level of a tree from points in Morton order.
+ *
+ * The squares on the path to the last added point are kept on a stack. Since the points
+ * are sorted, each point is placed by popping the squares that do not contain it and
+ * continuing from the deepest one left, usually without descending at all.
+ *
+ * root - the empty root square of the level
+ * points - the points to add, in Morton order
+ * nodes - on entry, each point's node on the level below, all NULL on the bottom level;
+ *     on return, each point's node on this level, or NULL if the point was a duplicate
+ * n - the number of points
+ * stack - buffer for at least n + 1 squares
+ */
+static void Quadtree_bulk_load_level(Node * const root, const MortonPoint * const points,
+        Node ** const nodes, const uint64_t n, Node ** const stack) {
+    register uint64_t stack_size = 0, i, quadrant;
+    Node *square, *child, *new_node;
+    const Point *p;
+
+    stack[stack_size++] = root;
+    for (i = 0; i < n; i++) {
+        p = &points[i].point;
+
+        // drop the squares that the previous point is in but p is not
+        while (!in_range(stack[stack_size - 1], p))
+            stack_size--;
+
+        // then move down to the square that p belongs in
+        square = stack[stack_size - 1];
+        while ((child = Node_child(square, quadrant = get_quadrant(&square->center, p))) != NULL &&
+                child->is_square && in_range(child, p))
+            stack[stack_size++] = square = child;
+
+        // check for duplication, which only happens on the bottom-most level
+        if (child != NULL && !child->is_square && Point_equals(&child->center, p)) {
+#ifdef MULTISET
+            child->multiplicity++;
+#endif
+            nodes[i] = NULL;
+            continue;
+        }
+
+        new_node = Leaf_init(square, *p, nodes[i] == NULL);
+        new_node->parent = square;
+        if (nodes[i] != NULL) {
+            new_node->down = nodes[i];
+            nodes[i]->up = new_node;
+        }
+        nodes[i] = new_node;
+
+        // if the slot is empty, it's trivial
+        if (child == NULL) {
+            Node_set_child(square, quadrant, new_node);
+            continue;
+        }
+
+        // otherwise, create a new square to contain child and the new node
+        Point split_center;
+        coord_t split_length;
+        get_split_square(square, &child->center, p, &split_center, &split_length);
+        Node *split = Square_init(square, split_length, split_center);
+        split->parent = square;
+        Node_set_child(split, get_quadrant(&split->center, p), new_node);
+        Node_set_child(split, get_quadrant(&split->center, &child->center), child);
+
+        // the same square is already on the level below, if there is one
+        if (square->down != NULL) {
+            Node *down_square = square->down;
+            while (!Point_equals(&down_square->center, &split->center) ||
+                    abs(down_square->length - split->length) > PRECISION)
+                down_square = Node_child(down_square, get_quadrant(&down_square->center, &split->center));
+            split->down = down_square;
+            down_square->up = split;
+        }
+
+        Node_set_child(square, quadrant, split);
+        new_node->parent = split;
+        child->parent = split;
+        stack[stack_size++] = split;
+    }
+}
+
+/*
+ * Quadtree_summarize
+ *
+ * Recursively recomputes the count of points, and with AGGREGATES defined the aggregate,
+ * of square and of every square below it, such as once a level has been built.
+ *
+ * square - the square to summarize the points of
+ *
+ * Returns the number of points below square.
+ */
+static uint64_t Quadtree_summarize(Node * const square) {
+    register uint64_t i;
+    Node *child;
+    square->count = 0;
+#ifdef AGGREGATES
+    QuadtreeAggregate_clear(&square->aggregate);
+#endif
+    for (i = 0; i < square->num_children; i++) {
+        child = Node_children(square)[i];
+        if (child->is_square) {
+            square->count += Quadtree_summarize(child);
+#ifdef AGGREGATES
+            QuadtreeAggregate_merge(&square->aggregate, &child->aggregate);
+#endif
+        }
+        else {
+            square->count += Node_count(child);
+#ifdef AGGREGATES
+            QuadtreeAggregate_add(&square->aggregate, &child->center,
+                Quadtree_weight(square, &child->center) * Node_count(child));
+#endif
+        }
+    }
+    return square->count;
+}
+
+/*
+ * Quadtree_bulk_load_sorted
+ *
+ * Builds every level of the tree rooted at root from points in Morton order, as
+ * Quadtree_bulk_load does once they are sorted.
+ *
+ * root - the empty root of the tree, whose promotion probability decides the levels
+ * sorted - the points, in Morton order, which get reordered
+ * n - the number of points
+ * multiplicities - with MULTISET defined, the multiplicity of each point by its index,
+ *     or NULL to count the duplicates among the points instead
+ *
+ * Returns whether the tree was built, which fails before anything is added if memory
+ * runs out.
+ */
+static bool Quadtree_bulk_load_sorted(Quadtree * const root, MortonPoint * const sorted,
+        const uint64_t n, const uint64_t * const multiplicities) {
+    Quadtree *level = root;
+    Node **nodes = (Node**)malloc(sizeof(*nodes) * n);
+    Node **stack = (Node**)malloc(sizeof(*stack) * (n + 1));
+    register uint64_t count = n, levels = 1, promoted, i;
+
+    if ((nodes == NULL && n > 0) || stack == NULL) {
+        free(nodes);
+        free(stack);
+        return false;
+    }
+
+    for (i = 0; i < n; i++)
+        nodes[i] = NULL;
+
+    while (true) {
+        Quadtree_bulk_load_level(level, sorted, nodes, count, stack);
+#ifdef MULTISET
+        if (levels == 1 && multiplicities != NULL)
+            for (i = 0; i < count; i++)
+                if (nodes[i] != NULL)
+                    nodes[i]->multiplicity = multiplicities[sorted[i].index];
+#endif
+        Quadtree_summarize(level);
+
+        // promote the points that go on the next level too, as in Quadtree_add
+        for (i = 0, promoted = 0; i < count; i++)
+            if (nodes[i] != NULL && Quadtree_height(root, &sorted[i].point) > levels) {
+                sorted[promoted] = sorted[i];
+                nodes[promoted++] = nodes[i];
+            }
+        if (promoted == 0)
+            break;
+        count = promoted;
+        levels++;
+
+        level->up = Square_init(level, root->length, root->center);
+        level->up->down = level;
+        level = level->up;
+    }
+
+    free(nodes);
+    free(stack);
+
+    return true;
+}
+
+Quadtree* Quadtree_bulk_load(const Point * const points, const uint64_t n,
+        const coord_t length, const Point center) {
+    Quadtree *root = Quadtree_init(length, center);
+    MortonPoint *sorted = (MortonPoint*)malloc(sizeof(*sorted) * n);
+    register uint64_t count = 0, i;
+
+    if (sorted == NULL && n > 0) {
+        Quadtree_free(root);
+        return NULL;
+    }
+
+    // only points within the root square can be added
+    for (i = 0; i < n; i++)
+        if (in_range(root, &points[i]))
+            MortonPoint_init(&sorted[count++], root, &points[i], i);
+    qsort(sorted, count, sizeof(*sorted), MortonPoint_compare);
+
+    if (!Quadtree_bulk_load_sorted(root, sorted, count, NULL)) {
+        Quadtree_free(root);
+        root = NULL;
+    }
+
+    free(sorted);
+
+    return root;
+}
+
+/*
+ * Quadtree_build_index_helper
+ *
+ * Recursively adds the squares below square to the index.
+ *
+ * square - the square whose descendants to add
+ */
+static void Quadtree_build_index_helper(Node * const square) {
+    register uint64_t i;
+    Node *child;
+    for (i = 0; i < square->num_children; i++) {
+        child = Node_children(square)[i];
+        if (child->is_square) {
+            Quadtree_index_add(child);
+            Quadtree_build_index_helper(child);
+        }
+    }
+}
+
+uint64_t Quadtree_build_index(Quadtree * const root) {
+    QuadtreeArena *tree = (QuadtreeArena*)Arena_of(root);
+    if (tree->index != NULL)
+        return tree->index->size;
+
+    // the tree stays unindexed if memory runs out
+    HashTable *index = (HashTable*)malloc(sizeof(*index));
+    if (index == NULL || !HashTable_init(index, tree->points / 2)) {
+        free(index);
+        return 0;
+    }
+
+    // only the bottom-most level is indexed, which holds every point
+    for (tree->root = root; tree->root->down != NULL; tree->root = tree->root->down);
+    tree->index = index;
+    Quadtree_build_index_helper(tree->root);
+
+    return tree->index->size;
+}
+
+/*
+ * Quadtree_remove_node
+ *
+ * Helper function to remove all instances of the given node and properly relink pointers
+ * to it.
+ *
+ * Nodes left behind that may also need removing, namely a parent square left with fewer
+ * than two children and the node's copies on the levels above and below, are kept on an
+ * explicit stack and handled in the same order a recursive implementation would. If the
+ * stack cannot grow, they are handled by recursing instead, so the remove still finishes.
+ *
+ * Invariant: node must have either a parent or a down.
+ *
+ * node - the node to remove
+ *
+ * Returns true if removal is successful, false otherwise.
+ */
+bool Quadtree_remove_node(Node * const node) {
+    Node *local_stack[REMOVE_STACK_SIZE], **stack = local_stack, *current;
+    register uint64_t stack_size = 0, stack_capacity = REMOVE_STACK_SIZE;
+    bool removed = false;
+
+    stack[stack_size++] = node;
+    while (stack_size > 0) {
+        current = stack[--stack_size];
+
+        if (current->down == NULL && current->parent == NULL)
+            continue;
+
+        // if is square, determine whether need to remove, and if so, which node to move up
+        if (current->is_square) {
+            register uint64_t num_children = current->num_children;
+            Node *child = num_children > 0 ? Node_children(current)[0] : NULL;
+
+            // cannot remove square if more than 1 child
+            if (num_children > 1)
+                continue;
+
+            // if we have a child, then we relink parent to point to this child, and unlink
+            // ourself from the parent
+            if (num_children == 1) {
+                // however this cannot happen at the root. If we're going to remove a copy of
+                // the root, we want no children on that node
+                if (current->parent == NULL)
+                    continue;
+
+                // if all goes well, we can relink, moving the child in the index as well
+                Quadtree_index_remove(current);
+                Quadtree_index_remove(child);
+                Node_set_child(current->parent, get_quadrant(&current->parent->center, &current->center), child);
+                child->parent = current->parent;
+                current->parent = NULL;
+                Quadtree_index_add(child);
+            }
+            else
+                Quadtree_index_remove(current);
+
+            // otherwise, 0 children, and no problem
+        }
+
+        // now, get rid of pointers from the parent
+        Node *parent = current->parent, *up = current->up, *down = current->down;
+        if (parent != NULL && Node_child(parent, get_quadrant(&parent->center, &current->center)) == current)
+            Node_set_child(parent, get_quadrant(&parent->center, &current->center), NULL);
+        if (!current->is_square)
+            Quadtree_summary_remove(parent, &current->center, true);
+
+        // next, unlink pointers from up and down
+        if (current->up != NULL) {
+            current->up->down = NULL;
+            current->up = NULL;
+        }
+        if (current->down != NULL) {
+            current->down->up = NULL;
+            current->down = NULL;
+        }
+
+        // now, we can get rid of our node
+        Node_free(current);
+        removed |= current == node;
+
+        // make room for up to three more nodes; if memory runs out, they are removed right
+        // away instead, in the order that they would have been popped in
+        if (stack_size + 3 > stack_capacity) {
+            Node **larger_stack = (Node**)malloc(sizeof(*stack) * 2 * stack_capacity);
+            if (larger_stack == NULL) {
+                if (parent != NULL && parent->num_children < 2)
+                    Quadtree_remove_node(parent);
+                if (up != NULL)
+                    Quadtree_remove_node(up);
+                if (down != NULL)
+                    Quadtree_remove_node(down);
+                continue;
+            }
+            stack_capacity *= 2;
+            memcpy(larger_stack, stack, sizeof(*stack) * stack_size);
+            if (stack != local_stack)
+                free(stack);
+            stack = larger_stack;
+        }
+
+        // pushed in reverse: down, then up, then the parent, which is visited first
+        if (down != NULL)
+            stack[stack_size++] = down;
+        if (up != NULL)
+            stack[stack_size++] = up;
+        if (parent != NULL && parent->num_children < 2)
+            stack[stack_size++] = parent;
+    }
+
+    if (stack != local_stack)
+        free(stack);
+
+    return removed;
+}
+
+/*
+ * Quadtree_remove_helper
+ *
+ * Iterative helper function to remove nodes. Removal starts at highest-level occurance
+ * and progresses downward.
+ *
+ * node - the node to start at
+ * p - the point to remove
+ *
+ * Returns true if the node was successfully removed, false if not.
+ */
+bool Quadtree_remove_helper(Node * node, const Point * const p) {
+    if (!in_range(node, p))
+        return false;
+
+    Node *child;
+    while (true) {
+        child = Node_child(node, get_quadrant(&node->center, p));
+
+        // if the child is a square containing p, move to it
+        if (child != NULL && child->is_square && in_range(child, p)) {
+            node = child;
+            continue;
+        }
+
+        // otherwise, we check if the child point matches, if it is a point node
+        if (child != NULL && !child->is_square && Point_equals(&child->center, p)) {
+#ifdef MULTISET
+            // the node only goes with the last copy of p
+            for (node = child; node->down != NULL; node = node->down);
+            if (node->multiplicity > 1) {
+                node->multiplicity--;
+                Quadtree_summary_remove(node->parent, &node->center, false);
+                return true;
+            }
+#endif
+            return Quadtree_remove_node(child);
+        }
+
+        // if we're here, then we need to branch down a level
+        if (node->down == NULL)
+            return false;
+        node = node->down;
+    }
+}
+
+bool Quadtree_remove(Quadtree * const node, const Point p) {
+    Node *current = node;
+
+    while (current->up != NULL)
+        current = current->up;
+
+    return Quadtree_remove_helper(current, &p);
+}
+
+uint64_t Quadtree_multiplicity(const Quadtree * const node, const Point p) {
+    Node *point = Quadtree_find(node, &p);
+    if (point == NULL)
+        return 0;
+
+#ifdef MULTISET
+    while (point->down != NULL)
+        point = point->down;
+    return point->multiplicity;
+#else
+    return 1;
+#endif
+}
+
+/*
+ * Quadtree_put_value
+ *
+ * QuadtreeUpsert that replaces the value of a point with ctx, for Quadtree_put.
+ */
+static void* Quadtree_put_value(void * const value, const bool present, void * const ctx) {
+    return ctx;
+}
 
-#include "../types.h"
-#include "../Quadtree.h"
-#include "../Point.h"
+bool Quadtree_put(Quadtree * const node, const Point p, void * const value) {
+    return Quadtree_upsert(node, p, Quadtree_put_value, value);
+}
 
-// rlu_self, included to make compiler happy
-__thread rlu_thread_data_t *rlu_self = NULL;
+bool Quadtree_get(const Quadtree * const node, const Point p, void ** const value) {
+    Node *point = Quadtree_find(node, &p);
+    if (point == NULL)
+        return false;
 
-// rand() functions
-#ifdef QUADTREE_TEST
-extern uint32_t test_rand();
-#define rand() test_rand()
-#else
-extern uint32_t Marsaglia_rand();
-#define rand() Marsaglia_rand()
-extern void Marsaglia_srand(uint32_t);
-#define srand(x) Marsaglia_srand(x)
-#endif
+    // only the copy on the bottom-most level holds the value
+    while (point->down != NULL)
+        point = point->down;
+    if (value != NULL)
+        *value = point->value;
+    return true;
+}
 
-// quadtree counter
-#ifdef QUADTREE_TEST
-uint64_t QUADTREE_NODE_COUNT = 0;
-#endif
+bool Quadtree_upsert(Quadtree * const node, const Point p, QuadtreeUpsert update,
+        void * const ctx) {
+    Node *point = Quadtree_find(node, &p);
+    const bool present = point != NULL;
 
-Node* Node_init(const float64_t length, const Point center) {
-    Node *node = (Node*)malloc(sizeof(Node));
-    node->is_square = false;
-    node->length = length;
-    node->center = center;
-    node->parent = NULL;
-    node->up = NULL;
-    node->down = NULL;
-    uint64_t i;
-    for(i = 0; i < (1LL << D); i++) {
-        node->children[i] = NULL;
+    // the structure of the tree only changes if p has to be added
+    if (!present && (point = Quadtree_add_node(node, &p)) == NULL)
+        return false;
+
+    while (point->down != NULL)
+        point = point->down;
+    point->value = update(point->value, present, ctx);
+    return true;
+}
+
+/*
+ * Quadtree_range_query_helper
+ *
+ * Recursive helper function to report the points under node that lie within [lo, hi].
+ * Only traverses the level that node is on.
+ *
+ * node - the node to look in
+ * lo - the corner of the box with the smallest coordinate values
+ * hi - the corner of the box with the largest coordinate values
+ * contained - whether node is already known to lie completely within the box
+ * callback - called once for each point in the box
+ * ctx - passed through to callback
+ * count - the number of points reported so far
+ *
+ * Returns false if callback asked to stop, true otherwise.
+ */
+bool Quadtree_range_query_helper(const Node * const node, const Point * const lo,
+        const Point * const hi, bool contained, QuadtreeCallback callback, void * const ctx,
+        uint64_t * const count) {
+    if (!node->is_square) {
+        if (!in_box(&node->center, lo, hi))
+            return true;
+        (*count)++;
+        return callback(&node->center, ctx);
     }
-#ifdef QUADTREE_TEST
-    node->id = QUADTREE_NODE_COUNT++;
-#endif
-    return node;
+
+    if (!contained) {
+        if (!box_intersects(node, lo, hi))
+            return true;
+        contained = box_contains(node, lo, hi);
+    }
+
+    register uint64_t i;
+    for (i = 0; i < node->num_children; i++)
+        if (!Quadtree_range_query_helper(Node_children(node)[i], lo, hi, contained, callback, ctx, count))
+            return false;
+
+    return true;
 }
 
-Quadtree* Quadtree_init(const float64_t length, const Point center) {
-    Quadtree *qtree = Node_init(length, center);
-    qtree->is_square = true;
-    return qtree;
+uint64_t Quadtree_range_query(const Quadtree * const node, const Point lo, const Point hi,
+        QuadtreeCallback callback, void * const ctx) {
+    const Node *current = node;
+    uint64_t count = 0;
+
+    if (current == NULL)
+        return 0;
+
+    // every point lives on the bottom-most level, so that is the only one we need
+    while (current->down != NULL)
+        current = current->down;
+
+    Quadtree_range_query_helper(current, &lo, &hi, false, callback, ctx, &count);
+
+    return count;
 }
 
 /*
- * Node_free
+ * Quadtree_range_count_helper
  *
- * Frees the memory used to represent this node.
+ * Recursive helper function to count the points under node that lie within [lo, hi].
+ * Only traverses the level that node is on.
  *
- * node - the node to be freed
+ * node - the node to look in
+ * lo - the corner of the box with the smallest coordinate values
+ * hi - the corner of the box with the largest coordinate values
+ *
+ * Returns the number of points under node in the box.
  */
-static inline void Node_free(Node * const node) {
-    free((void*)node);
+static uint64_t Quadtree_range_count_helper(const Node * const node, const Point * const lo,
+        const Point * const hi) {
+    if (!node->is_square)
+        return in_box(&node->center, lo, hi) ? Node_count(node) : 0;
+
+    if (!box_intersects(node, lo, hi))
+        return 0;
+    if (box_contains(node, lo, hi))
+        return node->count;
+
+    register uint64_t count = 0, i;
+    for (i = 0; i < node->num_children; i++)
+        count += Quadtree_range_count_helper(Node_children(node)[i], lo, hi);
+
+    return count;
+}
+
+uint64_t Quadtree_range_count(const Quadtree * const node, const Point lo, const Point hi) {
+    const Node *current = node;
+
+    if (current == NULL)
+        return 0;
+
+    // every point lives on the bottom-most level, so that is the only one we need
+    while (current->down != NULL)
+        current = current->down;
+
+    return Quadtree_range_count_helper(current, &lo, &hi);
+}
+
+#ifdef AGGREGATES
+void Quadtree_set_weight(Quadtree * const root, QuadtreeWeight weight, void * const ctx) {
+    QuadtreeArena *tree = (QuadtreeArena*)Arena_of(root);
+    tree->weight = weight;
+    tree->weight_ctx = ctx;
+
+    Node *level = root;
+    while (level->down != NULL)
+        level = level->down;
+    for (; level != NULL; level = level->up)
+        Quadtree_summarize(level);
 }
 
 /*
- * Quadtree_search_helper
+ * Quadtree_range_aggregate_helper
+ *
+ * Recursive helper function to aggregate the points under node that lie within [lo, hi].
+ * Only traverses the level that node is on.
+ *
+ * node - the node to look in
+ * lo - the corner of the box with the smallest coordinate values
+ * hi - the corner of the box with the largest coordinate values
+ * aggregate - the aggregate to add the points in the box to
+ *
+ * Returns the number of points under node in the box.
+ */
+static uint64_t Quadtree_range_aggregate_helper(const Node * const node, const Point * const lo,
+        const Point * const hi, QuadtreeAggregate * const aggregate) {
+    if (!node->is_square) {
+        if (!in_box(&node->center, lo, hi))
+            return 0;
+        QuadtreeAggregate_add(aggregate, &node->center,
+            Quadtree_weight(node, &node->center) * Node_count(node));
+        return Node_count(node);
+    }
+
+    if (!box_intersects(node, lo, hi))
+        return 0;
+    if (box_contains(node, lo, hi)) {
+        QuadtreeAggregate_merge(aggregate, &node->aggregate);
+        return node->count;
+    }
+
+    register uint64_t count = 0, i;
+    for (i = 0; i < node->num_children; i++)
+        count += Quadtree_range_aggregate_helper(Node_children(node)[i], lo, hi, aggregate);
+
+    return count;
+}
+
+uint64_t Quadtree_range_aggregate(const Quadtree * const node, const Point lo, const Point hi,
+        QuadtreeAggregate * const aggregate) {
+    const Node *current = node;
+
+    QuadtreeAggregate_clear(aggregate);
+    if (current == NULL)
+        return 0;
+
+    // every point lives on the bottom-most level, so that is the only one we need
+    while (current->down != NULL)
+        current = current->down;
+
+    return Quadtree_range_aggregate_helper(current, &lo, &hi, aggregate);
+}
+#endif
+
+/*
+ * Quadtree_locate
  *
- * Recursive helper function to traverse the tree horizontally before dropping levels.
+ * Uses the skip levels to find the smallest square on the bottom-most level that
+ * contains p, moving horizontally while a child square contains p and dropping a level
+ * otherwise.
  *
  * Invariant: node is always a square.
  *
- * node - the square to look in
- * p - the point to search for
+ * node - the square to start at, normally the root on the topmost level
+ * p - the point to locate
  *
- * Returns whether p is in node.
+ * Returns the smallest bottom-level square containing p, or the bottom-level root if p
+ * is not within the bounds of the tree at all.
  */
-bool Quadtree_search_helper(Node * const node, const Point *p) {
-    if (!in_range(node, p))
-        return false;
+Node* Quadtree_locate(Node * node, const Point * const p) {
+    Node *child;
 
-    register uint64_t quadrant = get_quadrant(&node->center, p);
+    if (!in_range(node, p)) {
+        while (node->down != NULL)
+            node = node->down;
+        return node;
+    }
 
-    // if the target child is NULL, we try to drop down a level
-    if (node->children[quadrant] == NULL) {
-        if (node->down != NULL)
-            return Quadtree_search_helper(node->down, p);
-        // otherwise, we're on the bottom-most level and just can't find the point
+    while (true) {
+        child = Node_child(node, get_quadrant(&node->center, p));
+        if (child != NULL && child->is_square && in_range(child, p))
+            node = child;
+        else if (node->down != NULL)
+            node = node->down;
         else
-            return false;
+            return node;
+    }
+}
+
+/*
+ * Quadtree_nearest_helper
+ *
+ * Best-first search for the k points closest to p. Starts in the square containing p
+ * and only moves out to the siblings of an ancestor while a point outside the explored
+ * square could still beat the k-th best distance found so far.
+ *
+ * With a positive eps, the search is approximate: a node is only visited if it could
+ * beat the k-th best distance by more than a factor of (1 + eps), so every neighbor
+ * returned is within (1 + eps) times the distance of the true neighbor it stands for.
+ *
+ * Invariant: k is at least 1.
+ *
+ * start - the bottom-level square to start at; should contain p
+ * p - the point to search around
+ * k - the number of neighbors to find
+ * eps - the allowed relative error in distance; 0 for an exact search
+ * out - the buffer for the neighbors, in order of increasing distance
+ *
+ * Returns the number of neighbors written to out, or 0 if the heaps could not be
+ * allocated.
+ */
+uint64_t Quadtree_nearest_helper(Node * const start, const Point * const p, const uint64_t k,
+        const float64_t eps, Point * const out) {
+    // best is keyed by negated distance, so that the k-th best is always on top; it only
+    // grows as neighbors are found, so that k does not decide the allocation
+    Heap candidates, best;
+    uint64_t found = 0;
+    bool allocated = Heap_init(&candidates, 64);
+    if (!Heap_init(&best, (k < NEAREST_HEAP_SIZE ? k : NEAREST_HEAP_SIZE) + 1) || !allocated)
+        goto nearest_done;
+
+    Node *region = start, *previous, *node, *child;
+    register uint64_t i;
+    register float64_t exit;
+
+    // distances are squared, so the error factor is as well
+    const float64_t factor = (1 + eps) * (1 + eps);
+
+    if (!Heap_push(&candidates, min_distance_squared(start, p), start))
+        goto nearest_done;
+
+    while (true) {
+        // visit nodes closest-first until none of them can beat the k-th best
+        while (candidates.size > 0 &&
+                (best.size < k || candidates.entries[0].key * factor < -best.entries[0].key)) {
+            HeapEntry entry = Heap_pop(&candidates);
+            node = (Node*)entry.value;
+
+            if (!node->is_square) {
+                if (!Heap_push(&best, -entry.key, node))
+                    goto nearest_done;
+                if (best.size > k)
+                    Heap_pop(&best);
+                continue;
+            }
+
+            for (i = 0; i < node->num_children; i++) {
+                child = Node_children(node)[i];
+                if (!Heap_push(&candidates, child->is_square ? min_distance_squared(child, p) :
+                        Point_distance_squared(&child->center, p), child))
+                    goto nearest_done;
+            }
+        }
+
+        if (region->parent == NULL)
+            break;
+
+        // nothing outside of region is closer than the way out of it
+        exit = exit_distance(region, p);
+        if (best.size == k && exit > 0 && -best.entries[0].key <= factor * exit * exit)
+            break;
+
+        // otherwise, widen the search to the rest of the parent square
+        previous = region;
+        region = region->parent;
+        for (i = 0; i < region->num_children; i++)
+            if ((child = Node_children(region)[i]) != previous &&
+                    !Heap_push(&candidates, child->is_square ? min_distance_squared(child, p) :
+                        Point_distance_squared(&child->center, p), child))
+                goto nearest_done;
     }
 
-    // here, the child exists
+    // the farthest neighbor comes out first, so fill out from the back
+    found = best.size;
+    while (best.size > 0) {
+        node = (Node*)Heap_pop(&best).value;
+        out[best.size] = node->center;
+    }
 
-    // if is a square, move to it and recurse
-    if (node->children[quadrant]->is_square)
-        return Quadtree_search_helper(node->children[quadrant], p);
+nearest_done:
+    Heap_free(&candidates);
+    Heap_free(&best);
 
-    // otherwise, we check if the child point matches, since it's a point node
-    if (Point_equals(&node->children[quadrant]->center, p))
-        return true;
+    return found;
+}
 
-    // if we're here, then we need to branch down a level
-    if (node->down != NULL)
-        return Quadtree_search_helper(node->down, p);
+uint64_t Quadtree_knn(const Quadtree * const node, const Point p, const uint64_t k,
+        Point * const out) {
+    Node *current = (Node*)node;
 
-    // here, we have nowhere else to search for, so we give up
-    return false;
+    if (current == NULL || k == 0)
+        return 0;
+
+    while (current->up != NULL)
+        current = current->up;
+
+    return Quadtree_nearest_helper(Quadtree_locate(current, &p), &p, k, 0, out);
 }
 
-bool Quadtree_search(const Quadtree * const node, const Point p) {
+bool Quadtree_ann(const Quadtree * const node, const Point p, const float64_t eps,
+        Point * const out) {
     Node *current = (Node*)node;
 
     if (current == NULL)
@@ -117,264 +1923,367 @@ bool Quadtree_search(const Quadtree * const node, const Point p) {
     while (current->up != NULL)
         current = current->up;
 
-    return Quadtree_search_helper(current, &p);
+    return Quadtree_nearest_helper(Quadtree_locate(current, &p), &p, 1, eps, out) > 0;
 }
 
 /*
- * Quadtree_add_helper
+ * Quadtree_radius_query_helper
  *
- * Recursive helper function to add new points to the tree.
+ * Recursive helper function to report the points under node that are within distance
+ * sqrt(radius2) of p. Only traverses the level that node is on.
  *
- * The process is three-part:
- * 1. We traverse node on the topmost level to where p should be added.
- * 2. We then branch down to create lower-level nodes first.
- * 3. We then take the lower-level node and use it as our down for this level.
- *
- * node - the node to start inserting at; should be a square
- * p - the point to add
- * gap_depth - the number of levels we need to go through before actually inserting nodes
+ * node - the node to look in
+ * p - the center of the ball
+ * radius2 - the squared radius of the ball
+ * callback - called once for each point in the ball
+ * ctx - passed through to callback
+ * count - the number of points reported so far
  *
- * Returns the corresponding node, one level lower, or NULL if the action failed.
+ * Returns false if callback asked to stop, true otherwise.
  */
-Node* Quadtree_add_helper(Node * node, const Point * const p, const uint64_t gap_depth) {
-    if (!in_range(node, p))
-        return NULL;
-
-    // horizontal traversal
-    Node *parent, *node_param = node;
-    do {
-        parent = node;
-        node = parent->children[get_quadrant(&parent->center, p)];
-    } while(node != NULL && node->is_square && in_range(node, p));
-
-    // check for duplication
-    if (!gap_depth && node != NULL && !node->is_square && Point_equals(&node->center, p))
-        return NULL;
+bool Quadtree_radius_query_helper(const Node * const node, const Point * const p,
+        const float64_t radius2, QuadtreeCallback callback, void * const ctx,
+        uint64_t * const count) {
+    if (!node->is_square) {
+        if (Point_distance_squared(&node->center, p) > radius2)
+            return true;
+        (*count)++;
+        return callback(&node->center, ctx);
+    }
 
-    // branch down a level if possible
-    Node *down_node = NULL;
-    if (parent->down != NULL)
-        if ((down_node = Quadtree_add_helper(parent->down, p,
-                (gap_depth > 0) & (gap_depth - 1))) == NULL)
-            return NULL;
+    if (min_distance_squared(node, p) > radius2)
+        return true;
 
-    // if gap_depth is not zero, we shouldn't actually add anything
-    if (gap_depth)
-        return down_node;
+    register uint64_t i;
+    for (i = 0; i < node->num_children; i++)
+        if (!Quadtree_radius_query_helper(Node_children(node)[i], p, radius2, callback, ctx, count))
+            return false;
 
-    Node *new_node = Node_init(0.5 * parent->length, *p);
-    new_node->parent = parent;
+    return true;
+}
 
-    if (down_node != NULL) {
-        new_node->down = down_node;
-        down_node->up = new_node;
-    }
+uint64_t Quadtree_radius_query(const Quadtree * const node, const Point p, const float64_t r,
+        QuadtreeCallback callback, void * const ctx) {
+    const Node *current = node;
+    uint64_t count = 0;
 
-    // time to try inserting onto this level
-    register uint64_t quadrant = get_quadrant(&parent->center, p);
+    if (current == NULL)
+        return 0;
 
-    // if the slot is empty, it's trivial
-    if (parent->children[quadrant] == NULL) {
-        parent->children[quadrant] = new_node;
-        return new_node;
-    }
-    // if it's not empty, that means there's already a node there...
-    else {
-        // grab the sibling-to-be
-        Node *sibling = parent->children[quadrant];
+    // every point lives on the bottom-most level, so that is the only one we need
+    while (current->down != NULL)
+        current = current->down;
 
-        // create a new square to contain the sibling and the new node
-        uint64_t square_quadrant = quadrant;
-        Node *square = Quadtree_init(0.5 * parent->length, get_new_center(parent, quadrant));
-        square->parent = parent;
+    Quadtree_radius_query_helper(current, &p, r * r, callback, ctx, &count);
 
-        // now, we keep splitting until the new node and the sibling are in different quadrants
-        register uint64_t sibling_quadrant;
-        while ( (sibling_quadrant = get_quadrant(&square->center, &sibling->center)) ==
-                (quadrant = get_quadrant(&square->center, &new_node->center))) {
-            Point new_square_center = get_new_center(square, quadrant);
-            Point_copy(&new_square_center, &square->center);
-            square->length *= 0.5;
-        }
+    return count;
+}
 
-        // okay, now we have separate quadrants to use
-        square->children[quadrant] = new_node;
-        square->children[sibling_quadrant] = sibling;
+/*
+ * Quadtree_any_within_helper
+ *
+ * Recursive helper function to check whether any point under node is within distance
+ * sqrt(radius2) of p. Returns as soon as one is found.
+ *
+ * node - the node to look in
+ * p - the center of the ball
+ * radius2 - the squared radius of the ball
+ *
+ * Returns whether some point under node is in the ball.
+ */
+bool Quadtree_any_within_helper(const Node * const node, const Point * const p,
+        const float64_t radius2) {
+    if (!node->is_square)
+        return Point_distance_squared(&node->center, p) <= radius2;
 
-        // now, we need to find the down square to this square, if we're not on the last level
-        if (parent->down != NULL) {
-            Node *down_square = parent->down;
-            while (!Point_equals(&down_square->center, &square->center) ||
-                    abs(down_square->length - square->length) > PRECISION)
-                down_square = down_square->children[get_quadrant(&down_square->center, &square->center)];
-            square->down = down_square;
-            down_square->up = square;
-        }
+    if (min_distance_squared(node, p) > radius2)
+        return false;
 
-        square->parent->children[square_quadrant] = square;
-        new_node->parent = square;
-        sibling->parent = square;
-    }
+    register uint64_t i;
+    for (i = 0; i < node->num_children; i++)
+        if (Quadtree_any_within_helper(Node_children(node)[i], p, radius2))
+            return true;
 
-    return new_node;
+    return false;
 }
 
-bool Quadtree_add(Quadtree * const node, const Point p) {
-    Node *current = node;
+bool Quadtree_any_within(const Quadtree * const node, const Point p, const float64_t r) {
+    Node *current = (Node*)node, *region, *previous;
+    register uint64_t i;
 
-    while (rand() % 100 < 50) {
-        if (current->up == NULL) {
-            current->up = Quadtree_init(current->length, current->center);
-            current->up->down = current;
-        }
-        current = current->up;
-    }
-    
-    register uint64_t gap_depth = 0;  // number of layers to ignore when inserting
+    if (current == NULL)
+        return false;
 
-    while (current->up != NULL) {
-        gap_depth++;
+    while (current->up != NULL)
         current = current->up;
+
+    // the square containing p is the likeliest place for a hit, so look there first
+    region = Quadtree_locate(current, &p);
+    if (Quadtree_any_within_helper(region, &p, r * r))
+        return true;
+
+    // then move outward only while the ball reaches past the explored square
+    while (region->parent != NULL && exit_distance(region, &p) < r) {
+        previous = region;
+        region = region->parent;
+        for (i = 0; i < region->num_children; i++)
+            if (Node_children(region)[i] != previous &&
+                    Quadtree_any_within_helper(Node_children(region)[i], &p, r * r))
+                return true;
     }
 
-    return Quadtree_add_helper(current, &p, gap_depth) != NULL;
+    return false;
 }
 
 /*
- * Quadtree_remove_node
+ * Quadtree_first
  *
- * Helper function to remove all instances of the given node and properly relink pointers
- * to it.
+ * Returns the first point under node in Morton order, or NULL if there is none.
+ */
+static inline Node* Quadtree_first(Node *node) {
+    while (node != NULL && node->is_square)
+        node = node->num_children > 0 ? Node_children(node)[0] : NULL;
+    return node;
+}
+
+/*
+ * Quadtree_cursor_seek
  *
- * Invariant: node must have either a parent or a down.
+ * Finds the first point under root that is not before start in Morton order, or, with
+ * after set, the first point after it.
  *
- * node - the node to remove
+ * Follows the path to start down from root, remembering the first child after the path
+ * at the deepest square that has one. The path ends at an empty quadrant, a point, or a
+ * square that does not contain start, and the last two lie wholly before or after
+ * start. Whatever comes after start first is where the search ends up.
  *
- * Returns true if removal is successful, false otherwise.
+ * root - the square to look in
+ * start - the point to look from
+ * after - whether a point equal to start is skipped
+ *
+ * Returns the node of the point found, or NULL if there is none.
  */
-bool Quadtree_remove_node(Node * const node) {
-    if (node->down == NULL && node->parent == NULL)
-        return false;
+static Node* Quadtree_cursor_seek(Node * const root, const Point * const start, const bool after) {
+    Node *square = root, *next = NULL, *child;
+    register uint64_t quadrant, index;
+    MortonPoint key, child_key;
+    MortonPoint_init(&key, root, start, 0);
+
+    while (true) {
+        quadrant = get_quadrant(&square->center, start);
+        child = Node_child(square, quadrant);
+        index = Node_child_index(square, quadrant) + (child != NULL);
+        if (index < square->num_children)
+            next = Node_children(square)[index];
+
+        if (child == NULL)
+            break;
+        if (child->is_square && in_range(child, start)) {
+            square = child;
+            continue;
+        }
 
-    // if is square, determine whether need to remove, and if so, which node to move up
-    if (node->is_square) {
-        register uint64_t num_children = 0, i;
-        Node *child = NULL;
-        for (i = 0; i < (1LL << D); i++)
-            if (node->children[i] != NULL) {
-                num_children++;
-                child = node->children[i];
-            }
+        if (!child->is_square && Point_equals(&child->center, start)) {
+            if (!after)
+                next = child;
+        }
+        else {
+            MortonPoint_init(&child_key, root, &child->center, 0);
+            if (MortonPoint_compare(&child_key, &key) > 0)
+                next = child;
+        }
+        break;
+    }
 
-        // cannot remove square if more than 1 child
-        if (num_children > 1)
-            return false;
+    return Quadtree_first(next);
+}
 
-        // if we have a child, then we relink parent to point to this child, and unlink
-        // ourself from the parent
-        if (num_children == 1) {
-            // however this cannot happen at the root. If we're going to remove a copy of
-            // the root, we want no children on that node
-            if (node->parent == NULL)
-                return false;
+void Quadtree_cursor_init(QuadtreeCursor * const cursor, const Quadtree * const node,
+        const Point * const start) {
+    Node *root = (Node*)node;
 
-            // if all goes well, we can relink
-            node->parent->children[get_quadrant(&node->parent->center, &node->center)] = child;
-            child->parent = node->parent;
-            node->parent = NULL;
-        }
+    // every point lives on the bottom-most level, so that is the only one we need
+    while (root->down != NULL)
+        root = root->down;
 
-        // otherwise, 0 children, and no problem
-    }
+    cursor->root = root;
+    cursor->node = start == NULL ? Quadtree_first(root) : Quadtree_cursor_seek(root, start, false);
+    cursor->parent = cursor->node == NULL ? NULL : cursor->node->parent;
+    cursor->index = cursor->node == NULL ? 0 : Node_child_index(cursor->parent,
+        get_quadrant(&cursor->parent->center, &cursor->node->center));
+    cursor->seek = cursor->after = false;
+}
 
-    // now, get rid of pointers from the parent
-    Node *parent = node->parent, *up = node->up, *down = node->down;
-    if (parent != NULL && parent->children[get_quadrant(&parent->center, &node->center)] == node)
-        parent->children[get_quadrant(&parent->center, &node->center)] = NULL;
+bool Quadtree_cursor_next(QuadtreeCursor * const cursor, Point * const p) {
+    Node *node = cursor->node, *parent;
+    register uint64_t index = cursor->index;
 
-    // next, unlink pointers from up and down
-    if (node->up != NULL) {
-        node->up->down = NULL;
-        node->up = NULL;
+    if (node == NULL)
+        return false;
+    *p = node->center;
+
+    // climb to the nearest square with a child after the one we came from, and go down to
+    // the first point of that child; as the parent and position of the current point are
+    // kept, the point itself is never read again, which keeps its cache miss off the
+    // path to the next one
+    parent = cursor->parent;
+    while (parent != NULL && index + 1 >= parent->num_children) {
+        node = parent;
+        parent = node->parent;
+        if (parent != NULL)
+            index = Node_child_index(parent, get_quadrant(&parent->center, &node->center));
     }
-    if (node->down != NULL) {
-        node->down->up = NULL;
-        node->down = NULL;
+    if (parent == NULL) {
+        cursor->node = NULL;
+        return true;
     }
 
-    // now, we can get rid of our node
-    Node_free(node);
+    node = Node_children(parent)[++index];
+    while (node->is_square) {
+        parent = node;
+        node = Node_children(node)[0];
+        index = 0;
+    }
+    cursor->parent = parent;
+    cursor->node = node;
+    cursor->index = index;
+
+    return true;
+}
 
-    // then, recurse up the parent as necessary
-    if (parent != NULL) {
-        register uint64_t num_children = 0, i;
-        for (i = 0; i < (1LL << D); i++)
-            num_children += parent->children[i] != NULL;
-        if (num_children < 2)
-            Quadtree_remove_node(parent);
+void Quadtree_cursor_close(QuadtreeCursor * const cursor) {
+    cursor->root = cursor->node = cursor->parent = NULL;
+}
+
+uint64_t Quadtree_rank(const Quadtree * const node, const Point p) {
+    Node *root = (Node*)node, *square, *child;
+    register uint64_t rank = 0, quadrant, index, i;
+    MortonPoint key, child_key;
+
+    // every point lives on the bottom-most level, so that is the only one we need
+    while (root->down != NULL)
+        root = root->down;
+    if (!in_range(root, &p))
+        return 0;
+    MortonPoint_init(&key, root, &p, 0);
+
+    // as in Quadtree_cursor_seek, the path ends at an empty quadrant, p itself, or a node
+    // that lies wholly before or after p
+    for (square = root; true; square = child) {
+        quadrant = get_quadrant(&square->center, &p);
+        index = Node_child_index(square, quadrant);
+        for (i = 0; i < index; i++)
+            rank += Node_count(Node_children(square)[i]);
+
+        child = Node_child(square, quadrant);
+        if (child == NULL)
+            break;
+        if (child->is_square && in_range(child, &p))
+            continue;
+
+        if (child->is_square || !Point_equals(&child->center, &p)) {
+            MortonPoint_init(&child_key, root, &child->center, 0);
+            if (MortonPoint_compare(&child_key, &key) < 0)
+                rank += Node_count(child);
+        }
+        break;
     }
 
-    // finally, recurse on up and down
-    if (up != NULL)
-        Quadtree_remove_node(up);
-    if (down != NULL)
-        Quadtree_remove_node(down);
+    return rank;
+}
+
+bool Quadtree_select(const Quadtree * const node, const uint64_t k, Point * const p) {
+    const Node *current = node, *child;
+    register uint64_t rank = k, i;
+
+    // every point lives on the bottom-most level, so that is the only one we need
+    while (current->down != NULL)
+        current = current->down;
+    if (rank >= current->count)
+        return false;
+
+    // skip the children wholly before the point, and go down the one it is in
+    while (current->is_square) {
+        for (i = 0; rank >= Node_count(child = Node_children(current)[i]); i++)
+            rank -= Node_count(child);
+        current = child;
+    }
+    *p = current->center;
 
     return true;
 }
 
 /*
- * Quadtree_remove_helper
+ * Quadtree_save_helper
  *
- * Recursive helper function to remove nodes. Removal starts at highest-level occurance
- * and progresses downward.
+ * Recursive helper function to write the points under node to a snapshot, in Morton
+ * order. Only traverses the level that node is on.
  *
- * node - the node to start at
- * p - the point to remove
+ * node - the node to write
+ * stream - the stream to write to
  *
- * Returns true if the node was successfully removed, false if not.
+ * Returns false if a write failed, true otherwise.
  */
-bool Quadtree_remove_helper(Node * const node, const Point * const p) {
-    if (!in_range(node, p))
-        return false;
+static bool Quadtree_save_helper(const Node * const node, QuadtreeStream * const stream) {
+    if (!node->is_square)
+        return QuadtreeStream_put_point(stream, node);
 
-    register uint64_t quadrant = get_quadrant(&node->center, p);
-
-    // if the target child is NULL, we try to drop down a level
-    if (node->children[quadrant] == NULL) {
-        if (node->down != NULL)
-            return Quadtree_remove_helper(node->down, p);
-        // otherwise, we're on the bottom-most level and just can't find the point
-        else
+    register uint64_t i;
+    for (i = 0; i < node->num_children; i++)
+        if (!Quadtree_save_helper(Node_children(node)[i], stream))
             return false;
-    }
 
-    // here, the child exists
+    return true;
+}
+
+bool Quadtree_save(const Quadtree * const root, const int fd) {
+    const Node *current = root;
+    QuadtreeStream *stream = QuadtreeStream_new(fd);
+    if (stream == NULL)
+        return false;
 
-    // if is a square, move to it and recurse if in range
-    if (node->children[quadrant]->is_square && in_range(node->children[quadrant], p))
-        return Quadtree_remove_helper(node->children[quadrant], p);
+    // every point lives on the bottom-most level, each once however often it was added
+    while (current->down != NULL)
+        current = current->down;
 
-    // otherwise, we check if the child point matches, since it's a point node
-    if (Point_equals(&node->children[quadrant]->center, p))
-        return Quadtree_remove_node(node->children[quadrant]);
+    const QuadtreeArena * const tree = (const QuadtreeArena*)Arena_of(current);
+    bool success = QuadtreeStream_put_header(stream, current, tree->promotion, tree->distinct) &&
+        Quadtree_save_helper(current, stream) && QuadtreeStream_flush(stream);
 
-    // if we're here, then we need to branch down a level
-    if (node->down != NULL)
-        return Quadtree_remove_helper(node->down, p);
+    free(stream);
 
-    // here, we have nowhere else to search for, so we give up
-    return false;
- 
+    return success;
 }
 
-bool Quadtree_remove(Quadtree * const node, const Point p) {
-    Node *current = node;
+Quadtree* Quadtree_load(const int fd) {
+    QuadtreeStream *stream = QuadtreeStream_new(fd);
+    Quadtree *root = NULL;
+    MortonPoint *sorted = NULL;
+    uint64_t *multiplicities = NULL, n;
+    coord_t length;
+    Point center;
+    float64_t promotion;
+    int error;
+
+    if (stream == NULL || !QuadtreeStream_get_header(stream, &length, &center, &promotion, &n))
+        goto load_done;
+
+    root = Quadtree_init(length, center);
+    Quadtree_set_promotion(root, promotion);
+    if (!QuadtreeStream_get_points(stream, root, &sorted, &multiplicities, n) ||
+            !Quadtree_bulk_load_sorted(root, sorted, n, multiplicities)) {
+        error = errno;
+        Quadtree_free(root);
+        root = NULL;
+        errno = error;
+    }
 
-    while (current->up != NULL)
-        current = current->up;
+load_done:
+    free(stream);
+    free(sorted);
+    free(multiplicities);
 
-    return Quadtree_remove_helper(current, &p);
+    return root;
 }
 
 /*
@@ -394,11 +2303,10 @@ bool Quadtree_free_helper(Node * const node, QuadtreeFreeResult * const result)
     bool success = true;
     if (node->is_square) {
         register uint64_t i;
-        for (i = 0; i < (1LL << D); i++)
-            if (node->children[i] != NULL) {
-                success &= Quadtree_free_helper(node->children[i], result);
-                node->children[i] = NULL;
-            }
+        for (i = 0; i < node->num_children; i++)
+            success &= Quadtree_free_helper(Node_children(node)[i], result);
+        node->num_children = 0;
+        Quadtree_index_remove(node);
     }
 
     // up and down
@@ -424,6 +2332,22 @@ QuadtreeFreeResult Quadtree_free(Quadtree * const root) {
     while (current->up != NULL)
         current = current->up;
 
+    // a whole tree is released at once, along with its arena
+    if (current->parent == NULL) {
+        QuadtreeArena *tree = (QuadtreeArena*)Arena_of(current);
+        for (; current != NULL; current = current->down)
+            result.levels++;
+        result.total = tree->arena.count - tree->arrays;
+        result.leaf = tree->points;
+        if (tree->index != NULL) {
+            HashTable_free(tree->index);
+            free(tree->index);
+        }
+        Arena_destroy(&tree->arena);
+        free(tree);
+        return result;
+    }
+
     while (current != NULL) {
         Node *next_current = current->down;
         result.levels += Quadtree_free_helper(current, &result);
@@ -7,6 +7,7 @@ Testing suite for correctness of Quadtrees
 //extern __thread rlu_thread_data_t *rlu_self;
 extern bool in_range(const Node*, const Point*);
 extern void Point_string(const Point*, char*);
+extern uint64_t QUADTREE_NODE_COUNT;
 
 void print_Quadtree(Quadtree *root) {
     register uint64_t i;
@@ -19,7 +20,7 @@ void print_Quadtree(Quadtree *root) {
 #endif
     Point_string(&root->center, buffer);
     printf("center=%s, length=%lf, is_square=%d", 
-        buffer + 5, root->length, root->is_square);
+        buffer + 5, root->is_square ? (float64_t)root->length : 0.0, root->is_square);
 
     if (root->parent != NULL
             #ifdef PARALLEL
@@ -54,16 +55,16 @@ void print_Quadtree(Quadtree *root) {
         printf(", down=%p", root->down);
 #endif
 
-    for (i = 0; i < (1LL << D); i++) {
-        if (root->children[i] != NULL
+    for (i = 0; root->is_square && i < (1LL << D); i++) {
+        if (Node_child(root, i) != NULL
                 #ifdef PARALLEL
-                && !root->children[i]->dirty
+                && !Node_child(root, i)->dirty
                 #endif
                 )
 #ifdef QUADTREE_TEST
-            printf(", children[%llu]=%llu", (unsigned long long)i, (unsigned long long)root->children[i]->id);
+            printf(", children[%llu]=%llu", (unsigned long long)i, (unsigned long long)Node_child(root, i)->id);
 #else
-            printf(", children[%llu]=%p", (unsigned long long)i, root->children[i]);
+            printf(", children[%llu]=%p", (unsigned long long)i, Node_child(root, i));
 #endif
     }
 
@@ -77,13 +78,13 @@ void print_Quadtree(Quadtree *root) {
             )
         print_Quadtree(root->up);
 
-    for (i = 0; i < (1LL << D); i++) {
-        if (root->children[i] != NULL
+    for (i = 0; root->is_square && i < (1LL << D); i++) {
+        if (Node_child(root, i) != NULL
                 #ifdef PARALLEL
-                && !root->children[i]->dirty
+                && !Node_child(root, i)->dirty
                 #endif
                 )
-            print_Quadtree(root->children[i]);
+            print_Quadtree(Node_child(root, i));
     }
 }
 
@@ -95,11 +96,38 @@ void test_sizes() {
     printf("sizeof(Node*)     = %lu\n", sizeof(Node*));
     printf("sizeof(Point)     = %lu\n", sizeof(Point));
     printf("\n===Testing Quadtree size===\n");
-    // Quadtree is normally 40 bytes, but we add an id parameter for testing, so it is 48 bytes.
-    // Then, each dimension adds 8 * 2 ^ D bytes for children, e.g. 2 dimensions -> 32 bytes.
-    // Also, each dimension adds 8 * D bytes, e.g. 2 dimensions -> 16 bytes.
+    // The fields that all nodes have are normally 32 bytes, but we add an id parameter for
+    // testing, so they are 40 bytes.
+    // Then, the length of a square adds 8 bytes, the bitmap of children adds 8 bytes for
+    // every 64 quadrants, the count of points adds 8 bytes with SUBTREE_COUNTS, and each
+    // child kept in the square adds 8 bytes, e.g. 2 dimensions -> 8 + 8 + 8 + 32 bytes.
+    // Points on the lowest level share that space for their value, plus 8 bytes for the
+    // multiplicity with MULTISET. Also, each dimension adds 8 * D bytes, e.g. 2 dimensions
+    // -> 16 bytes. With float coordinates, the center takes 4 * D bytes, padded to a
+    // multiple of 8.
     #ifndef PARALLEL
-    assertLong(48 + 8 * (1LL << D) + 8 * D, sizeof(Quadtree), "sizeof(Quadtree)");
+    const uint64_t coords = (sizeof(coord_t) * D + 7) / 8 * 8;
+    #ifdef AGGREGATES
+    const uint64_t aggregate = sizeof(QuadtreeAggregate);
+    #else
+    const uint64_t aggregate = 0;
+    #endif
+    #ifdef SUBTREE_COUNTS
+    const uint64_t count = 8;
+    #else
+    const uint64_t count = 0;
+    #endif
+    #ifdef MULTISET
+    const uint64_t multiplicity = 8;
+    #else
+    const uint64_t multiplicity = 0;
+    #endif
+    assertLong(48 + count + 8 * CHILD_WORDS + aggregate + 8 * INLINE_CHILDREN + coords,
+        sizeof(Quadtree), "sizeof(Quadtree)");
+    // Points on the lowest level stop after the value and multiplicity, and their copies on
+    // the levels above before both.
+    assertLong(48 + multiplicity + coords, BOTTOM_NODE_SIZE, "BOTTOM_NODE_SIZE");
+    assertLong(40 + coords, POINT_NODE_SIZE, "POINT_NODE_SIZE");
     #endif
 }
 
@@ -126,6 +154,50 @@ void test_in_range() {
     sprintf(buffer, "in_range(node, %s)", point_buffer);
     assertFalse(in_range(node, &p2), buffer);
 
+    // a point that get_quadrant places on the upper side of the boundary that node shares
+    // with its neighbor is within the neighbor only
+    for (i = 0; i < D; i++) coords[i] = 1 - QUADRANT_PRECISION / 2;
+    Point p3 = Point_from_array(coords);
+    for (i = 0; i < D; i++) coords[i] = 2;
+    Quadtree *neighbor = Quadtree_init(2.0, Point_from_array(coords));
+    for (i = 0; i < D; i++) coords[i] = 1;
+    Point corner = Point_from_array(coords);
+
+    Point_string(&p3, point_buffer);
+    assertLong((1LL << D) - 1, get_quadrant(&corner, &p3), "get_quadrant(corner, p3)");
+    sprintf(buffer, "in_range(node, %s)", point_buffer);
+    assertFalse(in_range(node, &p3), buffer);
+    sprintf(buffer, "in_range(neighbor, %s)", point_buffer);
+    assertTrue(in_range(neighbor, &p3), buffer);
+    // and the box and distance helpers agree with in_range on which square holds it
+    #ifndef TIGHT_BOUNDS
+    assertFalse(box_intersects(node, &p3, &p3), "box_intersects(node, p3, p3)");
+    assertTrue(box_intersects(neighbor, &p3, &p3), "box_intersects(neighbor, p3, p3)");
+    // exactly on the boundary without QUADRANT_PRECISION, where the distance is 0
+    assertTrue(QUADRANT_PRECISION == 0 || min_distance_squared(node, &p3) > 0, "min_distance_squared(node, p3) > 0");
+    assertTrue(min_distance_squared(neighbor, &p3) == 0, "min_distance_squared(neighbor, p3) == 0");
+    #endif
+    assertTrue(exit_distance(node, &p3) <= 0, "exit_distance(node, p3) <= 0");
+    assertTrue(exit_distance(neighbor, &p3) >= 0, "exit_distance(neighbor, p3) >= 0");
+
+    // a point just below node's lower boundary that get_quadrant places on its upper side is
+    // within node, not the neighbor below
+    for (i = 0; i < D; i++) coords[i] = -1 - QUADRANT_PRECISION / 2;
+    Point p4 = Point_from_array(coords);
+    for (i = 0; i < D; i++) coords[i] = -2;
+    Quadtree *below = Quadtree_init(2.0, Point_from_array(coords));
+    for (i = 0; i < D; i++) coords[i] = -1;
+    corner = Point_from_array(coords);
+
+    Point_string(&p4, point_buffer);
+    assertLong((1LL << D) - 1, get_quadrant(&corner, &p4), "get_quadrant(corner, p4)");
+    sprintf(buffer, "in_range(node, %s)", point_buffer);
+    assertTrue(in_range(node, &p4), buffer);
+    sprintf(buffer, "in_range(below, %s)", point_buffer);
+    assertFalse(in_range(below, &p4), buffer);
+
+    Quadtree_free(below);
+    Quadtree_free(neighbor);
     Quadtree_free(node);
 }
 
@@ -171,6 +243,51 @@ void test_get_new_center() {
     Quadtree_free(q1);
 }
 
+void test_get_split_square() {
+    register uint64_t i, j, k;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords);
+    Quadtree *q1 = Quadtree_init(s1, p1);
+
+    // pairs of points in the same quadrant, from far apart to almost equal
+    for (k = 0; k < 200; k++) {
+        Point a, b;
+        float64_t scale = s1 / (1LL << (k % 40));
+        for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() - 0.5) * s1;
+        a = Point_from_array(coords);
+        for (j = 0; j < D; j++) coords[j] += (Marsaglia_random() - 0.5) * scale;
+        b = Point_from_array(coords);
+        if (Point_equals(&a, &b) || !in_range(q1, &b) ||
+                get_quadrant(&q1->center, &a) != get_quadrant(&q1->center, &b))
+            continue;
+
+        // the square found by halving one level at a time
+        Node square;
+        uint64_t quadrant = get_quadrant(&q1->center, &a);
+        square.center = get_new_center(q1, quadrant);
+        square.length = 0.5 * q1->length;
+        while ((quadrant = get_quadrant(&square.center, &a)) == get_quadrant(&square.center, &b)) {
+            square.center = get_new_center(&square, quadrant);
+            square.length *= 0.5;
+        }
+
+        Point center;
+        coord_t length;
+        get_split_square(q1, &a, &b, &center, &length);
+        sprintf(buffer, "get_split_square(q1, pair %llu) length", (unsigned long long)k);
+        assertDouble(square.length, length, buffer);
+        sprintf(buffer, "get_split_square(q1, pair %llu) center", (unsigned long long)k);
+        assertPoint(square.center, center, buffer);
+    }
+
+    Quadtree_free(q1);
+}
+
 void test_quadtree_create() {
     register uint64_t i;
 
@@ -187,7 +304,6 @@ void test_quadtree_create() {
 
     printf("\n---Quadtree_init Node Test---\n");
     Node *q2 = Node_init(s1, p1);
-    assertDouble(s1, q2->length, "q2->length");
     assertPoint(p1, q2->center, "q2->center");
     assertFalse(q2->is_square, "q2->is_square");
 
@@ -223,7 +339,7 @@ void test_quadtree_add() {
 
     printf("\n---Quadtree_add One Node Test---\n");
     WRAP(assertTrue(Quadtree_add(q1, p2), "Quadtree_add(q1, p2)"));
-    Node *q2 = q1->children[get_quadrant(&q1->center, &p2)];
+    Node *q2 = Node_child(q1, get_quadrant(&q1->center, &p2));
 
     int count_q1_levels = 0;
     Node *node;
@@ -242,7 +358,7 @@ void test_quadtree_add() {
 
     printf("\n---Quadtree_add Conflicting Node Test---\n");
     WRAP(assertTrue(Quadtree_add(q1, p3), "Quadtree_add(q1, p3)"));
-    Node *square1 = q1->children[get_quadrant(&q1->center, &p2)];
+    Node *square1 = Node_child(q1, get_quadrant(&q1->center, &p2));
     for (i = 0; i < D; i++) coords[i] = 4;
     assertPoint(Point_from_array(coords), square1->center, "square1->center");
 
@@ -251,7 +367,7 @@ void test_quadtree_add() {
 
     sprintf(buffer, "(q1->children[%llu]->children[%llu] == NULL)",
         (unsigned long long)get_quadrant(&q1->center, &p2), (unsigned long long)get_quadrant(&square1->center, &p3));
-    Node *q3 = square1->children[get_quadrant(&square1->center, &p3)];
+    Node *q3 = Node_child(square1, get_quadrant(&square1->center, &p3));
     assertFalse(q3 == NULL, buffer);
 
     if (q3 != NULL) {
@@ -275,7 +391,7 @@ void test_quadtree_add() {
     }
 
     sprintf(buffer, "(q1->children[%llu]->children[0] == NULL)", (unsigned long long)get_quadrant(&q1->center, &p2));
-    assertFalse(square1->children[0] == NULL, buffer);
+    assertFalse(Node_child(square1, 0) == NULL, buffer);
 
     Point_string(&square1->center, str1);
     Point_string(&q2->center, str2);
@@ -285,14 +401,14 @@ void test_quadtree_add() {
     printf("\n---Quadtree_add Inner Square Generation Test---\n");
     WRAP(assertTrue(Quadtree_add(q1, p4), "Quadtree_add(q1, p4)"));
     Node *square2 = NULL;
-    if (square1->children[get_quadrant(&square1->center, &p4)] != NULL) {
-        square2 = square1->children[get_quadrant(&square1->center, &p4)];
+    if (Node_child(square1, get_quadrant(&square1->center, &p4)) != NULL) {
+        square2 = Node_child(square1, get_quadrant(&square1->center, &p4));
         for (i = 0; i < D; i++) coords[i] = 2;
         assertPoint(Point_from_array(coords), square2->center, "square2->center");
 
-        if (square2->children[get_quadrant(&square2->center, &p4)] != NULL) {
+        if (Node_child(square2, get_quadrant(&square2->center, &p4)) != NULL) {
             sprintf(buffer, "square2->children[%llu]->center", (unsigned long long)get_quadrant(&square2->center, &p4));
-            assertPoint(p4, square2->children[get_quadrant(&square2->center, &p4)]->center, buffer);
+            assertPoint(p4, Node_child(square2, get_quadrant(&square2->center, &p4))->center, buffer);
         }
         else {
             sprintf(buffer, "square2->children[%llu]->center is not NULL", (unsigned long long)get_quadrant(&square2->center, &p4));
@@ -309,13 +425,13 @@ void test_quadtree_add() {
     printf("\n---Quadtree_add Greater Depth Test---\n");
     WRAP(assertTrue(Quadtree_add(q1, p5), "Quadtree_add(q1, p5)"));
     sprintf(buffer, "(q1->children[%llu] != NULL)", (unsigned long long)get_quadrant(&q1->center, &p5));
-    assertTrue(q1->children[get_quadrant(&q1->center, &p5)] != NULL, buffer);
-    if (q1->children[get_quadrant(&q1->center, &p5)] != NULL) {
+    assertTrue(Node_child(q1, get_quadrant(&q1->center, &p5)) != NULL, buffer);
+    if (Node_child(q1, get_quadrant(&q1->center, &p5)) != NULL) {
         sprintf(buffer, "q1->children[%llu]->is_square", (unsigned long long)get_quadrant(&q1->center, &p5));
-        assertFalse(q1->children[get_quadrant(&q1->center, &p5)]->is_square, buffer);
+        assertFalse(Node_child(q1, get_quadrant(&q1->center, &p5))->is_square, buffer);
         sprintf(buffer, "q1->children[%llu]->center", (unsigned long long)get_quadrant(&q1->center, &p5));
         for (i = 0; i < D; i++) coords[i] = -2;
-        assertPoint(Point_from_array(coords), q1->children[get_quadrant(&q1->center, &p5)]->center, buffer);
+        assertPoint(Point_from_array(coords), Node_child(q1, get_quadrant(&q1->center, &p5))->center, buffer);
     }
     else {
         sprintf(buffer, "q1->children[%llu]->is_square is not NULL", (unsigned long long)get_quadrant(&q1->center, &p5));
@@ -327,46 +443,48 @@ void test_quadtree_add() {
     printf("\n---Quadtree_add Alternating Quadrant Test---\n");
     WRAP(assertTrue(Quadtree_add(q1, p6), "Quadtree_add(q1, p6)"));
     Node *square3 = NULL;
-    if (square2 != NULL && square2->children[get_quadrant(&square2->center, &p6)] != NULL) {
-        square3 = square2->children[get_quadrant(&square2->center, &p6)];
+    if (square2 != NULL && Node_child(square2, get_quadrant(&square2->center, &p6)) != NULL) {
+        square3 = Node_child(square2, get_quadrant(&square2->center, &p6));
         for (i = 0; i < D; i++) coords[i] = 1;
         assertPoint(Point_from_array(coords), square3->center, "square3->center");
     }
     else
         assertError("square3->center is not NULL");
 
-    if (square3 != NULL && square3->children[get_quadrant(&square3->center, &p2)] != NULL) {
-        sprintf(buffer, "square3->children[%llu]->center", (unsigned long long)get_quadrant(&square3->center, &p2));
-        assertPoint(p2, square3->children[get_quadrant(&square3->center, &p2)]->center, buffer);
-    }
-    else {
-        sprintf(buffer, "square3->children[%llu]->center is not NULL", (unsigned long long)get_quadrant(&square3->center, &p2));
-        assertError(buffer);
-    }
+    if (square3 != NULL) {  // square3 == NULL was reported above
+        if (Node_child(square3, get_quadrant(&square3->center, &p2)) != NULL) {
+            sprintf(buffer, "square3->children[%llu]->center", (unsigned long long)get_quadrant(&square3->center, &p2));
+            assertPoint(p2, Node_child(square3, get_quadrant(&square3->center, &p2))->center, buffer);
+        }
+        else {
+            sprintf(buffer, "square3->children[%llu]->center is not NULL", (unsigned long long)get_quadrant(&square3->center, &p2));
+            assertError(buffer);
+        }
 
-    if (square3 != NULL && square3->children[get_quadrant(&square3->center, &p6)] != NULL) {
-        sprintf(buffer, "square3->children[%llu]->center", (unsigned long long)get_quadrant(&square3->center, &p6));
-        assertPoint(p6, square3->children[get_quadrant(&square3->center, &p6)]->center, buffer);
-    }
-    else {
-        sprintf(buffer, "square3->children[%llu]->center is not NULL", (unsigned long long)get_quadrant(&square3->center, &p6));
-        assertError(buffer);
-    }
+        if (Node_child(square3, get_quadrant(&square3->center, &p6)) != NULL) {
+            sprintf(buffer, "square3->children[%llu]->center", (unsigned long long)get_quadrant(&square3->center, &p6));
+            assertPoint(p6, Node_child(square3, get_quadrant(&square3->center, &p6))->center, buffer);
+        }
+        else {
+            sprintf(buffer, "square3->children[%llu]->center is not NULL", (unsigned long long)get_quadrant(&square3->center, &p6));
+            assertError(buffer);
+        }
 
-    if (square3 != NULL && square3->children[get_quadrant(&square3->center, &p6)] != NULL &&
-            square3->children[get_quadrant(&square3->center, &p6)]->up != NULL) {
-        sprintf(buffer, "square3->children[%llu]->up->center", (unsigned long long)get_quadrant(&square3->center, &p6));
-        assertPoint(p6, square3->children[get_quadrant(&square3->center, &p6)]->up->center, buffer);
-    }
-    else {
-        sprintf(buffer, "square3->children[%llu]->up->center is not NULL", (unsigned long long)get_quadrant(&square3->center, &p6));
-        assertError(buffer);
+        if (Node_child(square3, get_quadrant(&square3->center, &p6)) != NULL &&
+                Node_child(square3, get_quadrant(&square3->center, &p6))->up != NULL) {
+            sprintf(buffer, "square3->children[%llu]->up->center", (unsigned long long)get_quadrant(&square3->center, &p6));
+            assertPoint(p6, Node_child(square3, get_quadrant(&square3->center, &p6))->up->center, buffer);
+        }
+        else {
+            sprintf(buffer, "square3->children[%llu]->up->center is not NULL", (unsigned long long)get_quadrant(&square3->center, &p6));
+            assertError(buffer);
+        }
     }
 
     if (square3 != NULL && square3->up != NULL) {
-        if (square3->up->children[get_quadrant(&square3->up->center, &p6)] != NULL) {
+        if (Node_child(square3->up, get_quadrant(&square3->up->center, &p6)) != NULL) {
             sprintf(buffer, "square3->up->children[%llu]->center", (unsigned long long)get_quadrant(&square3->up->center, &p6));
-            assertPoint(p6, square3->up->children[get_quadrant(&square3->up->center, &p6)]->center, buffer);
+            assertPoint(p6, Node_child(square3->up, get_quadrant(&square3->up->center, &p6))->center, buffer);
         }
         else {
             sprintf(buffer, "square3->up->children[%llu]->center is not NULL", (unsigned long long)get_quadrant(&square3->up->center, &p6));
@@ -548,67 +666,2063 @@ void test_randomized() {
     Quadtree_free(q1);
 }
 
-void test_performance() {
-    register uint64_t i, j;
+bool count_query_callback(const Point * const p, void * const ctx) {
+    // every variant counts points through Quadtree_range_query, which returns how many it
+    // reported, while only those with SUBTREE_COUNTS defined offer Quadtree_range_count
+    return true;
+}
+
+void test_quadtree_random_operations() {
+    register uint64_t i, j, k;
 
     float64_t coords[D];
     char buffer[1000];
 
-    float64_t s1 = 1 << 16;  // size1; chose to use S instead of L
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
     for (i = 0; i < D; i++) coords[i] = 0;
     Point p1 = Point_from_array(coords);
     Quadtree *q1 = Quadtree_init(s1, p1);
 
     test_rand_off();
 
-    const uint64_t num_samples = 1L << 17;
+    // a single RLU thread for the whole test, so that writes of one operation are still
+    // pending when the next one locks the same nodes
+    RLU_THREAD_INIT(rlu_self);
+
+    // few distinct points in the middle of grid cells, so that adds and removes keep
+    // hitting points already in the tree and squares emptied by earlier removes
+    const uint64_t num_points = 256, num_operations = 20000;
+    const float64_t cell = 1.0 / 16;
+    Point points[num_points];
+    uint64_t counts[num_points];
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++)
+            coords[j] = ((Marsaglia_rand() % (uint64_t)(s1 / cell)) + 0.5) * cell - s1 / 2;
+        points[i] = Point_from_array(coords);
+        counts[i] = 0;
+        for (j = 0; j < i; j++)
+            if (Point_equals(points + j, points + i))
+                break;
+        if (j < i)
+            i--;
+    }
 
-    float64_t time_samples[num_samples];
-    uint64_t total_cycles = 0;
+    printf("\n---Random Adds, Removes and Searches Test---\n");
+    // each answer is checked against how often the point was added and removed so far
+    uint64_t wrong_adds = 0, wrong_removes = 0, wrong_searches = 0;
+    bool answer;
+    for (i = 0; i < num_operations; i++) {
+        k = Marsaglia_rand() % num_points;
+        switch (Marsaglia_rand() % 3) {
+        case 0:
+            answer = Quadtree_add(q1, points[k]);
+            wrong_adds += answer != (COUNT_REPEATS || counts[k] == 0);
+            counts[k] += answer;
+            break;
+        case 1:
+            answer = Quadtree_remove(q1, points[k]);
+            wrong_removes += answer != (counts[k] > 0);
+            counts[k] -= answer && counts[k] > 0;
+            break;
+        default:
+            wrong_searches += Quadtree_search(q1, points[k]) != (counts[k] > 0);
+        }
+    }
+    assertLong(0, wrong_adds, "wrong answers of Quadtree_add(q1, points[k])");
+    assertLong(0, wrong_removes, "wrong answers of Quadtree_remove(q1, points[k])");
+    assertLong(0, wrong_searches, "wrong answers of Quadtree_search(q1, points[k])");
+
+    bool counted = true;
+    uint64_t num_present = 0;
+    for (i = 0; i < num_points; i++) {
+        counted &= Quadtree_multiplicity(q1, points[i]) == counts[i];
+        num_present += counts[i] > 0;
+    }
+    assertTrue(counted, "Quadtree_multiplicity(q1, points[i])");
+    Point lo, hi;
+    for (i = 0; i < D; i++) {
+        lo.data[i] = -s1;
+        hi.data[i] = s1;
+    }
+    sprintf(buffer, "Quadtree_range_query(q1, lo, hi)");
+    assertLong(num_present, Quadtree_range_query(q1, lo, hi, count_query_callback, NULL), buffer);
 
-    for (i = 0; i < num_samples; i++) {
+    RLU_THREAD_FINISH(rlu_self);
+
+    Quadtree_free(q1);
+}
+
+typedef struct {
+    Point lo, hi;
+    uint64_t count, outside;
+} BoxQuery;
+
+bool add_point(Quadtree * const q, const Point p) {
+    // with MULTISET defined, adding a point already in the tree succeeds, so tests that want
+    // distinct points check for it first
+    return !Quadtree_search(q, p) && Quadtree_add(q, p);
+}
+
+bool box_query_callback(const Point * const p, void * const ctx) {
+    BoxQuery *query = (BoxQuery*)ctx;
+    query->count++;
+    query->outside += !in_box(p, &query->lo, &query->hi);
+    return true;
+}
+
+bool stop_query_callback(const Point * const p, void * const ctx) {
+    (*(uint64_t*)ctx)++;
+    return false;
+}
+
+void test_quadtree_range_query() {
+    register uint64_t i, j, k;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords);
+    Quadtree *q1 = Quadtree_init(s1, p1);
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    const uint64_t num_points = 500;
+    Point points[num_points];
+    for (i = 0; i < num_points; i++) {
         for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() - 0.5) * s1;
-        Point p = Point_from_array(coords);
-        clock_t start = clock();
-        bool result = Quadtree_add(q1, p);
-        clock_t end = clock();
-        if (result) {
-            time_samples[i] = ((float64_t)(end - start)); // / CLOCKS_PER_SEC;
-            total_cycles += (end - start);
+        points[i] = Point_from_array(coords);
+        if (!add_point(q1, points[i]))
+            i--;
+    }
+
+    printf("\n---Quadtree_range_query Whole Tree Test---\n");
+    BoxQuery query;
+    for (i = 0; i < D; i++) coords[i] = -s1;
+    query.lo = Point_from_array(coords);
+    for (i = 0; i < D; i++) coords[i] = s1;
+    query.hi = Point_from_array(coords);
+    query.count = query.outside = 0;
+    uint64_t reported;
+    reported = Quadtree_range_query(q1, query.lo, query.hi, box_query_callback, &query);
+    assertLong(num_points, reported, "Quadtree_range_query(q1, whole tree)");
+    assertLong(num_points, query.count, "callback count");
+
+    printf("\n---Quadtree_range_query Random Boxes Test---\n");
+    for (k = 0; k < 20; k++) {
+        for (i = 0; i < D; i++) {
+            float64_t a = (Marsaglia_random() - 0.5) * s1, b = (Marsaglia_random() - 0.5) * s1;
+            query.lo.data[i] = a < b ? a : b;
+            query.hi.data[i] = a < b ? b : a;
+        }
+        uint64_t expected = 0;
+        for (i = 0; i < num_points; i++)
+            expected += in_box(points + i, &query.lo, &query.hi);
+        query.count = query.outside = 0;
+        reported = Quadtree_range_query(q1, query.lo, query.hi, box_query_callback, &query);
+        sprintf(buffer, "Quadtree_range_query(q1, box %llu)", (unsigned long long)k);
+        assertLong(expected, reported, buffer);
+        sprintf(buffer, "points outside box %llu", (unsigned long long)k);
+        assertLong(0, query.outside, buffer);
+    }
+
+    printf("\n---Quadtree_range_query Early Stop Test---\n");
+    uint64_t calls = 0;
+    for (i = 0; i < D; i++) coords[i] = -s1;
+    Point lo = Point_from_array(coords);
+    for (i = 0; i < D; i++) coords[i] = s1;
+    Point hi = Point_from_array(coords);
+    Quadtree_range_query(q1, lo, hi, stop_query_callback, &calls);
+    assertLong(1, calls, "calls before stopping");
+
+    printf("\n---Quadtree_range_query Boundary Sliver Test---\n");
+    // a point just below the boundary at 1 is kept in the square above it, which a box that
+    // ends short of the boundary still has to look in
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Quadtree *q2 = Quadtree_init(4.0, Point_from_array(coords));
+    for (i = 0; i < D; i++) coords[i] = 1.5;
+    Quadtree_add(q2, Point_from_array(coords));
+    for (i = 0; i < D; i++) coords[i] = 1 - 5e-7;
+    Point sliver = Point_from_array(coords);
+    Quadtree_add(q2, sliver);
+    for (i = 0; i < D; i++) {
+        lo.data[i] = 0.5;
+        hi.data[i] = 1 - 4e-7;
+    }
+    assertTrue(Quadtree_search(q2, sliver), "Quadtree_search(q2, sliver)");
+    assertLong(1, Quadtree_range_query(q2, lo, hi, count_query_callback, NULL), "Quadtree_range_query(q2, sliver box)");
+    #ifdef SUBTREE_COUNTS
+    assertLong(1, Quadtree_range_count(q2, lo, hi), "Quadtree_range_count(q2, sliver box)");
+    #endif
+    #ifdef AGGREGATES
+    QuadtreeAggregate aggregate;
+    assertLong(1, Quadtree_range_aggregate(q2, lo, hi, &aggregate), "Quadtree_range_aggregate(q2, sliver box)");
+    #endif
+
+    RLU_THREAD_FINISH(rlu_self);
+
+    Quadtree_free(q1);
+    Quadtree_free(q2);
+}
+
+void test_quadtree_knn() {
+    register uint64_t i, j, k;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords);
+    Quadtree *q1 = Quadtree_init(s1, p1);
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    printf("\n---Quadtree_knn Empty Tree Test---\n");
+    Point neighbors[10];
+    assertLong(0, Quadtree_knn(q1, p1, 3, neighbors), "Quadtree_knn(q1, p1, 3)");
+
+    const uint64_t num_points = 500;
+    Point points[num_points];
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() - 0.5) * s1;
+        points[i] = Point_from_array(coords);
+        if (!add_point(q1, points[i]))
+            i--;
+    }
+
+    printf("\n---Quadtree_knn Random Queries Test---\n");
+    const uint64_t num_neighbors = 5;
+    for (k = 0; k < 20; k++) {
+        // queries a little outside of the tree's bounds as well
+        for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() - 0.5) * 1.25 * s1;
+        Point query = Point_from_array(coords);
+
+        // brute force: repeatedly pick the closest point farther than the previous one
+        float64_t expected[num_neighbors], previous = -1;
+        for (j = 0; j < num_neighbors; j++) {
+            expected[j] = -1;
+            for (i = 0; i < num_points; i++) {
+                float64_t distance = Point_distance_squared(points + i, &query);
+                if (distance > previous && (expected[j] < 0 || distance < expected[j]))
+                    expected[j] = distance;
+            }
+            previous = expected[j];
+        }
+
+        sprintf(buffer, "Quadtree_knn(q1, query %llu, %llu)", (unsigned long long)k,
+            (unsigned long long)num_neighbors);
+        assertLong(num_neighbors, Quadtree_knn(q1, query, num_neighbors, neighbors), buffer);
+
+        bool matches = true;
+        for (j = 0; j < num_neighbors; j++)
+            matches &= Point_distance_squared(neighbors + j, &query) == expected[j];
+        sprintf(buffer, "neighbors of query %llu match brute force", (unsigned long long)k);
+        assertTrue(matches, buffer);
+    }
+
+    printf("\n---Quadtree_knn Unbounded k Test---\n");
+    // k only bounds the answer, so every point comes back, from the closest out
+    Point all_neighbors[num_points];
+    assertLong(num_points, Quadtree_knn(q1, p1, UINT64_MAX, all_neighbors),
+        "Quadtree_knn(q1, p1, UINT64_MAX)");
+    bool ordered = true;
+    for (i = 1; i < num_points; i++)
+        ordered &= Point_distance_squared(all_neighbors + i - 1, &p1) <=
+            Point_distance_squared(all_neighbors + i, &p1);
+    assertTrue(ordered, "neighbors of p1 in order of increasing distance");
+
+    printf("\n---Quadtree_knn More Than Size Test---\n");
+    Quadtree *q2 = Quadtree_init(s1, p1);
+    Quadtree_add(q2, points[0]);
+    Quadtree_add(q2, points[1]);
+    assertLong(2, Quadtree_knn(q2, p1, 10, neighbors), "Quadtree_knn(q2, p1, 10)");
+
+    printf("\n---Quadtree_knn Boundary Sliver Test---\n");
+    // the query is in the square [0, 1) with two points of its own, while a closer one lies
+    // just below 1 and so is kept in the square above; the search has to widen to it, as
+    // the way out of [0, 1) is nearer than the second point inside
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Quadtree *q3 = Quadtree_init(4.0, Point_from_array(coords));
+    const float64_t xs[] = {0.2, 1 - 3.5e-5, 1 - 3.97e-5, 1 - 5e-7};
+    Point sliver;
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < D; j++) coords[j] = 0.5;
+        coords[0] = xs[i];
+        Quadtree_add(q3, sliver = Point_from_array(coords));
+    }
+    for (j = 0; j < D; j++) coords[j] = 0.5;
+    coords[0] = 1 - 2e-5;
+    Point query = Point_from_array(coords);
+    assertLong(2, Quadtree_knn(q3, query, 2, neighbors), "Quadtree_knn(q3, query, 2)");
+    assertTrue(Point_equals(neighbors + 1, &sliver), "second neighbor of query is the sliver point");
+
+    RLU_THREAD_FINISH(rlu_self);
+
+    Quadtree_free(q1);
+    Quadtree_free(q2);
+    Quadtree_free(q3);
+}
+
+void test_quadtree_ann() {
+    register uint64_t i, j, k;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords);
+    Quadtree *q1 = Quadtree_init(s1, p1);
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    printf("\n---Quadtree_ann Empty Tree Test---\n");
+    Point neighbor;
+    assertFalse(Quadtree_ann(q1, p1, 0.5, &neighbor), "Quadtree_ann(q1, p1, 0.5)");
+
+    const uint64_t num_points = 500;
+    Point points[num_points];
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() - 0.5) * s1;
+        points[i] = Point_from_array(coords);
+        if (!add_point(q1, points[i]))
+            i--;
+    }
+
+    printf("\n---Quadtree_ann Error Bound Test---\n");
+    const float64_t epsilons[3] = {0, 0.1, 1};
+    for (k = 0; k < 20; k++) {
+        for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() - 0.5) * s1;
+        Point query = Point_from_array(coords);
+
+        float64_t nearest = -1;
+        for (i = 0; i < num_points; i++) {
+            float64_t distance = Point_distance_squared(points + i, &query);
+            if (nearest < 0 || distance < nearest)
+                nearest = distance;
+        }
+
+        for (j = 0; j < 3; j++) {
+            sprintf(buffer, "Quadtree_ann(q1, query %llu, %.1lf)", (unsigned long long)k, epsilons[j]);
+            assertTrue(Quadtree_ann(q1, query, epsilons[j], &neighbor), buffer);
+            sprintf(buffer, "neighbor of query %llu within %.1lf", (unsigned long long)k, epsilons[j]);
+            assertTrue(Point_distance_squared(&neighbor, &query) <=
+                (1 + epsilons[j]) * (1 + epsilons[j]) * nearest, buffer);
         }
+    }
+
+    RLU_THREAD_FINISH(rlu_self);
+
+    Quadtree_free(q1);
+}
+
+typedef struct {
+    Point center;
+    float64_t radius;
+    uint64_t count, outside;
+} BallQuery;
+
+bool ball_query_callback(const Point * const p, void * const ctx) {
+    BallQuery *query = (BallQuery*)ctx;
+    query->count++;
+    query->outside += Point_distance_squared(p, &query->center) > query->radius * query->radius;
+    return true;
+}
+
+void test_quadtree_radius_query() {
+    register uint64_t i, j, k;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords);
+    Quadtree *q1 = Quadtree_init(s1, p1);
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    printf("\n---Quadtree_any_within Empty Tree Test---\n");
+    assertFalse(Quadtree_any_within(q1, p1, s1), "Quadtree_any_within(q1, p1, s1)");
+
+    const uint64_t num_points = 500;
+    Point points[num_points];
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() - 0.5) * s1;
+        points[i] = Point_from_array(coords);
+        if (!add_point(q1, points[i]))
+            i--;
+    }
+
+    printf("\n---Quadtree_radius_query Random Balls Test---\n");
+    BallQuery query;
+    uint64_t reported;
+    for (k = 0; k < 20; k++) {
+        for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() - 0.5) * s1;
+        query.center = Point_from_array(coords);
+        query.radius = Marsaglia_random() * 0.25 * s1;
+
+        uint64_t expected = 0;
+        for (i = 0; i < num_points; i++)
+            expected += Point_distance_squared(points + i, &query.center) <= query.radius * query.radius;
+
+        query.count = query.outside = 0;
+        reported = Quadtree_radius_query(q1, query.center, query.radius, ball_query_callback, &query);
+        sprintf(buffer, "Quadtree_radius_query(q1, ball %llu)", (unsigned long long)k);
+        assertLong(expected, reported, buffer);
+        sprintf(buffer, "points outside ball %llu", (unsigned long long)k);
+        assertLong(0, query.outside, buffer);
+
+        sprintf(buffer, "Quadtree_any_within(q1, ball %llu)", (unsigned long long)k);
+        if (expected > 0)
+            assertTrue(Quadtree_any_within(q1, query.center, query.radius), buffer);
         else
+            assertFalse(Quadtree_any_within(q1, query.center, query.radius), buffer);
+    }
+
+    printf("\n---Quadtree_any_within Exact Point Test---\n");
+    assertTrue(Quadtree_any_within(q1, points[0], 0), "Quadtree_any_within(q1, points[0], 0)");
+
+    printf("\n---Quadtree_radius_query Boundary Sliver Test---\n");
+    // a ball around a point kept in the square above the boundary at 1, which it lies just
+    // below, has to reach into that square
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Quadtree *q2 = Quadtree_init(4.0, Point_from_array(coords));
+    for (i = 0; i < D; i++) coords[i] = 1.5;
+    Quadtree_add(q2, Point_from_array(coords));
+    for (i = 0; i < D; i++) coords[i] = 1 - 5e-7;
+    Point sliver = Point_from_array(coords);
+    Quadtree_add(q2, sliver);
+    assertLong(1, Quadtree_radius_query(q2, sliver, 1e-7, count_query_callback, NULL), "Quadtree_radius_query(q2, sliver, 1e-7)");
+    assertTrue(Quadtree_any_within(q2, sliver, 1e-7), "Quadtree_any_within(q2, sliver, 1e-7)");
+
+    RLU_THREAD_FINISH(rlu_self);
+
+    Quadtree_free(q1);
+    Quadtree_free(q2);
+}
+
+/*
+ * Checks that the subtree under node is a properly linked compressed quadtree: every
+ * child is within its parent and points back to it, every square besides the root has
+ * at least two children, and every copy on the level below matches.
+ */
+bool valid_subtree(const Node * const node) {
+    register uint64_t i, num_children = 0;
+    if (node->down != NULL && (node->down->up != node || !Point_equals(&node->center, &node->down->center)))
+        return false;
+    if (!node->is_square)
+        return true;
+    for (i = 0; i < (1LL << D); i++) {
+        const Node *child = Node_child(node, i);
+        if (child == NULL)
+            continue;
+        if (Node_children(node)[num_children++] != child)
+            return false;
+        if (child->parent != node || !in_range(node, &child->center) ||
+                get_quadrant(&node->center, &child->center) != i || !valid_subtree(child))
+            return false;
+    }
+    return num_children == node->num_children && (node->parent == NULL || num_children >= 2);
+}
+
+void test_quadtree_bulk_load() {
+    register uint64_t i, j;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords);
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    printf("\n---Quadtree_bulk_load Empty Tree Test---\n");
+    Quadtree *q1 = Quadtree_bulk_load(NULL, 0, s1, p1);
+    assertTrue(q1 != NULL && q1->is_square && q1->up == NULL, "Quadtree_bulk_load(NULL, 0, s1, p1)");
+    assertFalse(Quadtree_search(q1, p1), "Quadtree_search(q1, p1)");
+    Quadtree_free(q1);
+
+    // unique points, followed by duplicates and points outside of the root
+    const uint64_t num_points = 500, num_extra = 50;
+    Point points[num_points + 2 * num_extra];
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() - 0.5) * s1;
+        points[i] = Point_from_array(coords);
+        for (j = 0; j < i; j++)
+            if (Point_equals(points + i, points + j))
+                break;
+        if (j < i)
             i--;
     }
+    for (i = 0; i < num_extra; i++) {
+        points[num_points + i] = points[i * 7];
+        for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() + 0.5) * s1;
+        points[num_points + num_extra + i] = Point_from_array(coords);
+    }
 
-    double time_samples_d1[num_samples - 1];  // first derivatives
-    for (i = 0; i < num_samples - 1; i++) {
-        time_samples_d1[i] = time_samples[i + 1] - time_samples[i];
+    printf("\n---Quadtree_bulk_load Structure Test---\n");
+    q1 = Quadtree_bulk_load(points, num_points + 2 * num_extra, s1, p1);
+    const Node *level;
+    for (level = q1, i = 0; level != NULL; level = level->up, i++) {
+        sprintf(buffer, "valid_subtree(level %llu)", (unsigned long long)i);
+        assertTrue(valid_subtree(level), buffer);
     }
 
-    printf("Total time for %llu inserts: %.8lf s\n", (unsigned long long)num_samples, total_cycles / (float64_t)CLOCKS_PER_SEC);
+    printf("\n---Quadtree_bulk_load Contents Test---\n");
+    BoxQuery query;
+    for (i = 0; i < D; i++) {
+        query.lo.data[i] = -0.5 * s1;
+        query.hi.data[i] = 0.5 * s1;
+    }
+    query.count = query.outside = 0;
+    assertLong(num_points, Quadtree_range_query(q1, query.lo, query.hi, box_query_callback, &query),
+        "Quadtree_range_query(q1, root)");
+    for (i = 0; i < num_points; i++) {
+        sprintf(buffer, "Quadtree_search(q1, points[%llu])", (unsigned long long)i);
+        assertTrue(Quadtree_search(q1, points[i]), buffer);
+    }
+    for (i = 0; i < num_extra; i++) {
+        sprintf(buffer, "Quadtree_search(q1, outside %llu)", (unsigned long long)i);
+        assertFalse(Quadtree_search(q1, points[num_points + num_extra + i]), buffer);
+    }
+
+    printf("\n---Quadtree_bulk_load Update Test---\n");
+    assertTrue(Quadtree_add(q1, points[0]) == COUNT_REPEATS, "Quadtree_add(q1, points[0]) == COUNT_REPEATS");
+    // with MULTISET defined, points[0] is in q1 three times: twice from points, and the add
+    assertLong(COUNT_REPEATS ? 3 : 1, Quadtree_multiplicity(q1, points[0]), "Quadtree_multiplicity(q1, points[0])");
+    for (i = 1; i < (COUNT_REPEATS ? 3 : 1); i++) {
+        sprintf(buffer, "Quadtree_remove(q1, points[0]) repeat %llu", (unsigned long long)i);
+        assertTrue(Quadtree_remove(q1, points[0]), buffer);
+    }
+    assertTrue(Quadtree_remove(q1, points[0]), "Quadtree_remove(q1, points[0])");
+    assertFalse(Quadtree_search(q1, points[0]), "Quadtree_search(q1, points[0])");
+    assertTrue(Quadtree_add(q1, points[0]), "Quadtree_add(q1, points[0]) again");
+    assertTrue(Quadtree_search(q1, points[0]), "Quadtree_search(q1, points[0]) again");
+
+    RLU_THREAD_FINISH(rlu_self);
 
     Quadtree_free(q1);
 }
 
-int main(int argc, char *argv[]) {
-    setbuf(stdout, 0);
-    mtrace();
-    Marsaglia_srand(time(NULL));
-    printf("[Beginning tests]\n");
+void test_quadtree_add_batch() {
+    register uint64_t i, j;
 
-    // initialize RLU
-    RLU_INIT(RLU_TYPE_FINE_GRAINED, 8);
-    rlu_self = (rlu_thread_data_t*)malloc(sizeof(*rlu_self));
-    
-    start_test(test_sizes, "Struct sizes");
-    start_test(test_in_range, "in_range");
-    start_test(test_get_quadrant, "get_quadrant");
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords);
+    Quadtree *q1 = Quadtree_init(s1, p1);
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    printf("\n---Quadtree_add_batch Empty Batch Test---\n");
+    assertLong(0, Quadtree_add_batch(q1, NULL, 0, NULL), "Quadtree_add_batch(q1, NULL, 0, NULL)");
+
+    // some points already in the tree
+    const uint64_t num_existing = 100;
+    Point existing[num_existing];
+    for (i = 0; i < num_existing; i++) {
+        for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() - 0.5) * s1;
+        existing[i] = Point_from_array(coords);
+        if (!add_point(q1, existing[i]))
+            i--;
+    }
+
+    // new points in a few tight clusters, followed by points already in the tree, repeats
+    // of new points, and points outside of the root
+    const uint64_t num_points = 400, num_extra = 20, num_clusters = 4;
+    Point points[num_points + 3 * num_extra], centers[num_clusters];
+    bool results[num_points + 3 * num_extra];
+    for (i = 0; i < num_clusters; i++) {
+        for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() - 0.5) * 0.75 * s1;
+        centers[i] = Point_from_array(coords);
+    }
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++)
+            coords[j] = centers[i % num_clusters].data[j] + (Marsaglia_random() - 0.5) * 0.1 * s1;
+        points[i] = Point_from_array(coords);
+        for (j = 0; j < i && !Point_equals(points + i, points + j); j++);
+        if (j < i || Quadtree_search(q1, points[i]))
+            i--;
+    }
+    for (i = 0; i < num_extra; i++) {
+        points[num_points + i] = existing[i];
+        points[num_points + num_extra + i] = points[i];
+        for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() + 0.5) * s1;
+        points[num_points + 2 * num_extra + i] = Point_from_array(coords);
+    }
+
+    printf("\n---Quadtree_add_batch Results Test---\n");
+    // with MULTISET defined, repeats of points are counted, so all but the outside points
+    const uint64_t num_added = COUNT_REPEATS ? num_points + 2 * num_extra : num_points;
+    assertLong(num_added, Quadtree_add_batch(q1, points, num_points + 3 * num_extra, results),
+        "Quadtree_add_batch(q1, points)");
+    // only one of a point and its repeat is added, whichever comes first, unless both are
+    for (i = 0; i < num_points; i++) {
+        sprintf(buffer, "results[%llu]", (unsigned long long)i);
+        if (i < num_extra && !COUNT_REPEATS)
+            assertTrue(results[i] != results[num_points + num_extra + i], buffer);
+        else
+            assertTrue(results[i], buffer);
+    }
+    for (i = 0, j = 0; i < num_points + 3 * num_extra; i++)
+        j += results[i];
+    assertLong(num_added, j, "number of true results");
+    for (i = 0; i < num_extra; i++) {
+        sprintf(buffer, "results[existing %llu]", (unsigned long long)i);
+        assertTrue(results[num_points + i] == COUNT_REPEATS, buffer);
+        sprintf(buffer, "results[outside %llu]", (unsigned long long)i);
+        assertFalse(results[num_points + 2 * num_extra + i], buffer);
+    }
+
+    printf("\n---Quadtree_add_batch Structure Test---\n");
+    const Node *level;
+    for (level = q1, i = 0; level != NULL; level = level->up, i++) {
+        sprintf(buffer, "valid_subtree(level %llu)", (unsigned long long)i);
+        assertTrue(valid_subtree(level), buffer);
+    }
+    for (i = 0; i < num_points; i++) {
+        sprintf(buffer, "Quadtree_search(q1, points[%llu])", (unsigned long long)i);
+        assertTrue(Quadtree_search(q1, points[i]), buffer);
+    }
+    for (i = 0; i < num_existing; i++) {
+        sprintf(buffer, "Quadtree_search(q1, existing[%llu])", (unsigned long long)i);
+        assertTrue(Quadtree_search(q1, existing[i]), buffer);
+    }
+
+    RLU_THREAD_FINISH(rlu_self);
+
+    Quadtree_free(q1);
+}
+
+void test_quadtree_search_batch() {
+    register uint64_t i, j;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords);
+    Quadtree *q1 = Quadtree_init(s1, p1);
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    printf("\n---Quadtree_search_batch Empty Batch Test---\n");
+    assertLong(0, Quadtree_search_batch(q1, NULL, 0, NULL), "Quadtree_search_batch(q1, NULL, 0, NULL)");
+
+    // points in the tree, followed by random points and points outside of the root
+    const uint64_t num_points = 500, num_extra = 250;
+    Point points[num_points + 2 * num_extra];
+    bool results[num_points + 2 * num_extra];
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() - 0.5) * s1;
+        points[i] = Point_from_array(coords);
+        if (!add_point(q1, points[i]))
+            i--;
+    }
+    for (i = 0; i < num_extra; i++) {
+        for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() - 0.5) * s1;
+        points[num_points + i] = Point_from_array(coords);
+        for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() + 0.5) * s1;
+        points[num_points + num_extra + i] = Point_from_array(coords);
+    }
+
+    printf("\n---Quadtree_search_batch Results Test---\n");
+    uint64_t expected = num_points;
+    for (i = num_points; i < num_points + num_extra; i++)
+        expected += Quadtree_search(q1, points[i]);
+    assertLong(expected, Quadtree_search_batch(q1, points, num_points + 2 * num_extra, results),
+        "Quadtree_search_batch(q1, points)");
+    for (i = 0; i < num_points + 2 * num_extra; i++) {
+        sprintf(buffer, "results[%llu]", (unsigned long long)i);
+        assertTrue(results[i] == Quadtree_search(q1, points[i]), buffer);
+    }
+
+    RLU_THREAD_FINISH(rlu_self);
+
+    Quadtree_free(q1);
+}
+
+/*
+ * Counts the squares below square on the bottom-most level.
+ */
+uint64_t count_squares(const Node * const square) {
+    register uint64_t i, count = 0;
+    for (i = 0; i < square->num_children; i++)
+        if (Node_children(square)[i]->is_square)
+            count += 1 + count_squares(Node_children(square)[i]);
+    return count;
+}
+
+void test_quadtree_build_index() {
+    register uint64_t i, j;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords);
+    Quadtree *q1 = Quadtree_init(s1, p1);
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    printf("\n---Quadtree_build_index Empty Tree Test---\n");
+    assertLong(0, Quadtree_build_index(q1), "Quadtree_build_index(q1)");
+    assertFalse(Quadtree_search(q1, p1), "Quadtree_search(q1, p1)");
+
+    // points in the tree, in pairs a few cells of a fine grid apart so that squares get
+    // deep, and random points that are mostly not; points are in the middle of the grid
+    // cells, away from the boundaries of any square that separates them
+    const uint64_t num_points = 500, num_extra = 250;
+    const float64_t cell = 1.0 / 4096;
+    Point points[num_points], extra[num_extra];
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++)
+            coords[j] = i % 2 ? points[i - 1].data[j] + (points[i - 1].data[j] > 0 ? -cell : cell) *
+                (1 + Marsaglia_rand() % 4) : ((Marsaglia_rand() % (uint64_t)(s1 / cell)) + 0.5) * cell - s1 / 2;
+        points[i] = Point_from_array(coords);
+        if (!add_point(q1, points[i]))
+            i--;
+    }
+    for (i = 0; i < num_extra; i++) {
+        for (j = 0; j < D; j++)
+            coords[j] = ((Marsaglia_rand() % (uint64_t)(s1 / cell)) + 0.5) * cell - s1 / 2;
+        extra[i] = Point_from_array(coords);
+    }
+
+    Node *bottom = q1;
+    while (bottom->down != NULL)
+        bottom = bottom->down;
+
+    printf("\n---Quadtree_build_index Size Test---\n");
+    // ParallelSkipQuadtree keeps no index
+    uint64_t indexed = Quadtree_build_index(q1);
+    assertTrue(indexed == 0 || indexed == count_squares(bottom), "Quadtree_build_index(q1) == squares");
+    assertLong(indexed, Quadtree_build_index(q1), "Quadtree_build_index(q1) again");
+
+    printf("\n---Quadtree_build_index Search Test---\n");
+    bool found = true;
+    for (i = 0; i < num_points; i++)
+        found &= Quadtree_search(q1, points[i]);
+    assertTrue(found, "Quadtree_search(q1, points[i])");
+    for (i = 0; i < num_extra; i++) {
+        sprintf(buffer, "Quadtree_search(q1, extra[%llu])", (unsigned long long)i);
+        assertFalse(Quadtree_search(q1, extra[i]), buffer);
+    }
+    for (i = 0; i < D; i++) coords[i] = s1;
+    assertFalse(Quadtree_search(q1, Point_from_array(coords)), "Quadtree_search(q1, outside)");
+
+    printf("\n---Quadtree_build_index Add and Remove Test---\n");
+    // the index has to follow squares that are created, moved and removed
+    for (i = 0; i < num_extra; i++)
+        assertTrue(Quadtree_add(q1, extra[i]), "Quadtree_add(q1, extra[i])");
+    RLU_THREAD_FINISH(rlu_self);
+    // each remove in its own RLU thread, so that none of them has to wait on the writes
+    // of another
+    const uint64_t num_removes = 20;
+    for (i = 0; i < num_removes; i += 2)
+        WRAP(assertTrue(Quadtree_remove(q1, points[i]), "Quadtree_remove(q1, points[i])"));
+    RLU_THREAD_INIT(rlu_self);
+    found = true;
+    for (i = 0; i < num_points; i++)
+        found &= Quadtree_search(q1, points[i]) == (i >= num_removes || i % 2 == 1);
+    for (i = 0; i < num_extra; i++)
+        found &= Quadtree_search(q1, extra[i]);
+    assertTrue(found, "Quadtree_search(q1, p) after adds and removes");
+
+    RLU_THREAD_FINISH(rlu_self);
+
+    Quadtree_free(q1);
+}
+
+void test_quadtree_finger() {
+    register uint64_t i, j;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords);
+    Quadtree *q1 = Quadtree_init(s1, p1);
+    Node *finger = q1;
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    printf("\n---Quadtree_search_from Empty Tree Test---\n");
+    assertFalse(Quadtree_search_from(&finger, p1), "Quadtree_search_from(&finger, p1)");
+
+    // a random walk in the middle of the cells of a fine grid, as a track of nearby fixes
+    const uint64_t num_points = 500;
+    const float64_t cell = 1.0 / 1024;
+    Point points[num_points];
+    for (j = 0; j < D; j++) coords[j] = 0.5 * cell;
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++) {
+            coords[j] += ((int64_t)(Marsaglia_rand() % 9) - 4) * cell;
+            if (coords[j] < -s1 / 2 || coords[j] >= s1 / 2)
+                coords[j] = 0.5 * cell;
+        }
+        points[i] = Point_from_array(coords);
+    }
+
+    printf("\n---Quadtree_add_from Test---\n");
+    uint64_t added = 0;
+    bool expected;
+    for (i = 0; i < num_points; i++) {
+        // only the first copy of a point on the walk is added, unless MULTISET counts repeats
+        for (j = 0; j < i && !Point_equals(&points[i], &points[j]); j++);
+        expected = j == i;
+        sprintf(buffer, "Quadtree_add_from(&finger, points[%llu])", (unsigned long long)i);
+        assertTrue(Quadtree_add_from(&finger, points[i]) == (expected || COUNT_REPEATS), buffer);
+        added += expected;
+    }
+    bool found = true;
+    for (i = 0; i < num_points; i++)
+        found &= Quadtree_search(q1, points[i]);
+    assertTrue(found, "Quadtree_search(q1, points[i])");
+
+    printf("\n---Quadtree_search_from Test---\n");
+    found = true;
+    for (i = 0; i < num_points; i++)
+        found &= Quadtree_search_from(&finger, points[i]);
+    assertTrue(found, "Quadtree_search_from(&finger, points[i])");
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++) coords[j] = points[i].data[j] + 0.5 * cell;
+        sprintf(buffer, "Quadtree_search_from(&finger, points[%llu] + cell / 2)", (unsigned long long)i);
+        assertFalse(Quadtree_search_from(&finger, Point_from_array(coords)), buffer);
+    }
+    for (i = 0; i < D; i++) coords[i] = s1;
+    assertFalse(Quadtree_search_from(&finger, Point_from_array(coords)), "Quadtree_search_from(&finger, outside)");
+    assertFalse(Quadtree_add_from(&finger, Point_from_array(coords)), "Quadtree_add_from(&finger, outside)");
+
+    printf("\n---Quadtree_add_from Size Test---\n");
+    BoxQuery query;
+    for (i = 0; i < D; i++) {
+        query.lo.data[i] = -s1 / 2;
+        query.hi.data[i] = s1 / 2;
+    }
+    query.count = query.outside = 0;
+    assertLong(added, Quadtree_range_query(q1, query.lo, query.hi, box_query_callback, &query),
+        "Quadtree_range_query(q1, root)");
+
+    RLU_THREAD_FINISH(rlu_self);
+
+    Quadtree_free(q1);
+}
+
+void test_quadtree_cursor() {
+    register uint64_t i, j;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords), p;
+    Quadtree *q1 = Quadtree_init(s1, p1);
+    QuadtreeCursor cursor;
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    printf("\n---Quadtree_cursor Empty Tree Test---\n");
+    Quadtree_cursor_init(&cursor, q1, NULL);
+    assertFalse(Quadtree_cursor_next(&cursor, &p), "Quadtree_cursor_next(&cursor, &p)");
+    Quadtree_cursor_close(&cursor);
+
+    // points in the middle of the cells of a grid, along with their Morton order
+    const uint64_t num_points = 500;
+    const float64_t cell = 1.0 / 256;
+    MortonPoint sorted[num_points];
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++)
+            coords[j] = ((Marsaglia_rand() % (uint64_t)(s1 / cell)) + 0.5) * cell - s1 / 2;
+        p = Point_from_array(coords);
+        MortonPoint_init(&sorted[i], q1, &p, i);
+        if (!add_point(q1, p))
+            i--;
+    }
+    qsort(sorted, num_points, sizeof(*sorted), MortonPoint_compare);
+
+    printf("\n---Quadtree_cursor Full Traversal Test---\n");
+    bool ordered = true;
+    Quadtree_cursor_init(&cursor, q1, NULL);
+    for (i = 0; Quadtree_cursor_next(&cursor, &p); i++)
+        ordered &= i < num_points && Point_equals(&p, &sorted[i].point);
+    Quadtree_cursor_close(&cursor);
+    assertLong(num_points, i, "points returned");
+    assertTrue(ordered, "points returned in Morton order");
+
+    printf("\n---Quadtree_cursor Partial Traversal Test---\n");
+    for (i = 0; i < num_points; i += 50) {
+        // starting at a point of the tree, and just past it
+        Quadtree_cursor_init(&cursor, q1, &sorted[i].point);
+        sprintf(buffer, "Quadtree_cursor_init(&cursor, q1, sorted[%llu])", (unsigned long long)i);
+        assertTrue(Quadtree_cursor_next(&cursor, &p) && Point_equals(&p, &sorted[i].point), buffer);
+        Quadtree_cursor_close(&cursor);
+
+        for (j = 0; j < D; j++) coords[j] = sorted[i].point.data[j] + 0.25 * cell;
+        p1 = Point_from_array(coords);
+        Quadtree_cursor_init(&cursor, q1, &p1);
+        sprintf(buffer, "Quadtree_cursor_init(&cursor, q1, sorted[%llu] + cell / 4)", (unsigned long long)i);
+        if (i + 1 < num_points)
+            assertTrue(Quadtree_cursor_next(&cursor, &p) && Point_equals(&p, &sorted[i + 1].point), buffer);
+        Quadtree_cursor_close(&cursor);
+    }
+    for (i = 0; i < D; i++) coords[i] = s1;
+    p1 = Point_from_array(coords);
+    Quadtree_cursor_init(&cursor, q1, &p1);
+    assertFalse(Quadtree_cursor_next(&cursor, &p), "Quadtree_cursor_init(&cursor, q1, past the end)");
+    Quadtree_cursor_close(&cursor);
+
+    printf("\n---Quadtree_cursor Resume Test---\n");
+    // traverse part of the tree, remove what was returned, and carry on from there
+    const uint64_t num_removes = 20;
+    Quadtree_cursor_init(&cursor, q1, NULL);
+    for (i = 0; i < num_removes && Quadtree_cursor_next(&cursor, &p); i++);
+    Quadtree_cursor_close(&cursor);
+    RLU_THREAD_FINISH(rlu_self);
+    for (i = 0; i < num_removes; i++)
+        WRAP(Quadtree_remove(q1, sorted[i].point));
+    RLU_THREAD_INIT(rlu_self);
+    ordered = true;
+    Quadtree_cursor_init(&cursor, q1, &p);
+    for (i = num_removes; Quadtree_cursor_next(&cursor, &p); i++)
+        ordered &= i < num_points && Point_equals(&p, &sorted[i].point);
+    Quadtree_cursor_close(&cursor);
+    assertLong(num_points, i, "points returned");
+    assertTrue(ordered, "points returned in Morton order");
+
+    RLU_THREAD_FINISH(rlu_self);
+
+    Quadtree_free(q1);
+}
+
+uint64_t count_points(const Node * const square) {
+    register uint64_t i, count = 0;
+    for (i = 0; i < square->num_children; i++)
+        count += Node_children(square)[i]->is_square ? count_points(Node_children(square)[i]) : 1;
+    return count;
+}
+
+uint64_t count_levels(const Quadtree * const root, uint64_t * const sizes, const uint64_t max_levels) {
+    register uint64_t levels = 0;
+    const Node *level;
+    for (level = root; level != NULL && levels < max_levels; level = level->up)
+        sizes[levels++] = count_points(level);
+    return levels;
+}
+
+void test_quadtree_promotion() {
+    register uint64_t i, j;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords);
+
+    test_rand_off();
+
+    // points in the middle of the cells of a grid
+    const uint64_t num_points = 2000;
+    const float64_t cell = 1.0 / 256;
+    Point points[num_points];
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++)
+            coords[j] = ((Marsaglia_rand() % (uint64_t)(s1 / cell)) + 0.5) * cell - s1 / 2;
+        points[i] = Point_from_array(coords);
+        for (j = 0; j < i && !Point_equals(&points[i], &points[j]); j++);
+        if (j < i)
+            i--;
+    }
+
+    printf("\n---Quadtree_set_promotion Same Levels Test---\n");
+    Quadtree *q1 = Quadtree_init(s1, p1), *q3 = Quadtree_init(s1, p1);
+    Node *finger = q3;
+    RLU_THREAD_INIT(rlu_self);
+    for (i = 0; i < num_points; i++)
+        Quadtree_add(q1, points[i]);
+    for (i = num_points; i-- > 0;)
+        Quadtree_add_from(&finger, points[i]);
+    RLU_THREAD_FINISH(rlu_self);
+    Quadtree *q2 = Quadtree_bulk_load(points, num_points, s1, p1);
+
+    // every point goes on the same levels however it is added
+    const uint64_t max_levels = 80;
+    uint64_t sizes1[max_levels], sizes2[max_levels], sizes3[max_levels];
+    register uint64_t levels = count_levels(q1, sizes1, max_levels);
+    assertLong(levels, count_levels(q2, sizes2, max_levels), "levels of Quadtree_bulk_load");
+    assertLong(levels, count_levels(q3, sizes3, max_levels), "levels of Quadtree_add_from");
+    bool same = true;
+    for (i = 0; i < levels; i++)
+        same &= sizes1[i] == sizes2[i] && sizes1[i] == sizes3[i];
+    assertTrue(same, "points on each level");
+    assertLong(num_points, sizes1[0], "points on the bottom-most level");
+    assertTrue(sizes1[1] > 0.4 * num_points && sizes1[1] < 0.6 * num_points, "half of the points on the second level");
+
+    Quadtree_free(q1);
+    Quadtree_free(q2);
+    Quadtree_free(q3);
+
+    printf("\n---Quadtree_set_promotion Probability Test---\n");
+    q1 = Quadtree_init(s1, p1);
+    q2 = Quadtree_init(s1, p1);
+    assertTrue(Quadtree_set_promotion(q1, 0), "Quadtree_set_promotion(q1, 0)");
+    assertTrue(Quadtree_set_promotion(q2, 0.25), "Quadtree_set_promotion(q2, 0.25)");
+    // probabilities outside of [0, 1) are refused, and leave q2 at 0.25
+    assertFalse(Quadtree_set_promotion(q2, 1), "Quadtree_set_promotion(q2, 1)");
+    assertFalse(Quadtree_set_promotion(q2, -0.25), "Quadtree_set_promotion(q2, -0.25)");
+    assertFalse(Quadtree_set_promotion(q2, __builtin_nan("")), "Quadtree_set_promotion(q2, NaN)");
+    RLU_THREAD_INIT(rlu_self);
+    for (i = 0; i < num_points; i++) {
+        Quadtree_add(q1, points[i]);
+        Quadtree_add(q2, points[i]);
+    }
+    RLU_THREAD_FINISH(rlu_self);
+    assertLong(1, count_levels(q1, sizes1, max_levels), "levels with promotion 0");
+    assertLong(num_points, sizes1[0], "points with promotion 0");
+    levels = count_levels(q2, sizes2, max_levels);
+    assertTrue(levels > 1, "levels with promotion 0.25");
+    assertTrue(sizes2[1] > 0.15 * num_points && sizes2[1] < 0.35 * num_points, "a quarter of the points on the second level");
+    for (i = 1; i < levels && sizes2[i] <= sizes3[i]; i++);
+    assertTrue(i == levels, "fewer points on each level with promotion 0.25");
+
+    Quadtree_free(q1);
+    Quadtree_free(q2);
+}
+
+#ifdef SUBTREE_COUNTS
+void test_quadtree_range_count() {
+    register uint64_t i, j, k;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords);
+    Quadtree *q1 = Quadtree_init(s1, p1);
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    printf("\n---Quadtree_range_count Empty Tree Test---\n");
+    for (i = 0; i < D; i++) coords[i] = -s1;
+    Point lo = Point_from_array(coords);
+    for (i = 0; i < D; i++) coords[i] = s1;
+    Point hi = Point_from_array(coords);
+    assertLong(0, Quadtree_range_count(q1, lo, hi), "Quadtree_range_count(q1, whole tree)");
+
+    // points in the middle of the cells of a grid
+    const uint64_t num_points = 1000, num_removes = 20;
+    const float64_t cell = 1.0 / 256;
+    Point points[num_points];
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++)
+            coords[j] = ((Marsaglia_rand() % (uint64_t)(s1 / cell)) + 0.5) * cell - s1 / 2;
+        points[i] = Point_from_array(coords);
+        if (!add_point(q1, points[i]))
+            i--;
+    }
+    Quadtree *q2 = Quadtree_bulk_load(points, num_points, s1, p1);
+
+    printf("\n---Quadtree_range_count Whole Tree Test---\n");
+    assertLong(num_points, Quadtree_range_count(q1, lo, hi), "Quadtree_range_count(q1, whole tree)");
+    assertLong(num_points, Quadtree_range_count(q2, lo, hi), "Quadtree_range_count(q2, whole tree)");
+
+    printf("\n---Quadtree_range_count Random Boxes Test---\n");
+    bool matches = true, bulk_matches = true;
+    for (k = 0; k < 100; k++) {
+        for (i = 0; i < D; i++) {
+            float64_t a = (Marsaglia_random() - 0.5) * s1, b = (Marsaglia_random() - 0.5) * s1;
+            lo.data[i] = a < b ? a : b;
+            hi.data[i] = a < b ? b : a;
+        }
+        uint64_t expected = 0;
+        for (i = 0; i < num_points; i++)
+            expected += in_box(points + i, &lo, &hi);
+        matches &= Quadtree_range_count(q1, lo, hi) == expected;
+        bulk_matches &= Quadtree_range_count(q2, lo, hi) == expected;
+    }
+    assertTrue(matches, "Quadtree_range_count(q1, box) == points in box");
+    assertTrue(bulk_matches, "Quadtree_range_count(q2, box) == points in box");
+
+    printf("\n---Quadtree_range_count After Remove Test---\n");
+    bool removed[num_removes];
+    uint64_t num_removed = 0;
+    for (i = 0; i < num_removes; i++)
+        num_removed += removed[i] = Quadtree_remove(q1, points[i]);
+    matches = true;
+    for (k = 0; k < 100; k++) {
+        for (i = 0; i < D; i++) {
+            float64_t a = (Marsaglia_random() - 0.5) * s1, b = (Marsaglia_random() - 0.5) * s1;
+            lo.data[i] = a < b ? a : b;
+            hi.data[i] = a < b ? b : a;
+        }
+        uint64_t expected = 0;
+        for (i = 0; i < num_points; i++)
+            expected += (i >= num_removes || !removed[i]) && in_box(points + i, &lo, &hi);
+        matches &= Quadtree_range_count(q1, lo, hi) == expected;
+    }
+    assertTrue(matches, "Quadtree_range_count(q1, box) == points in box");
+    for (i = 0; i < D; i++) {
+        lo.data[i] = -s1;
+        hi.data[i] = s1;
+    }
+    sprintf(buffer, "Quadtree_range_count(q1, whole tree) after %llu removes", (unsigned long long)num_removed);
+    assertLong(num_points - num_removed, Quadtree_range_count(q1, lo, hi), buffer);
+
+    RLU_THREAD_FINISH(rlu_self);
+
+    Quadtree_free(q1);
+    Quadtree_free(q2);
+}
+
+void test_quadtree_rank() {
+    register uint64_t i, j, k;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords), p;
+    Quadtree *q1 = Quadtree_init(s1, p1);
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    printf("\n---Quadtree_rank and Quadtree_select Empty Tree Test---\n");
+    assertLong(0, Quadtree_rank(q1, p1), "Quadtree_rank(q1, p1)");
+    assertFalse(Quadtree_select(q1, 0, &p), "Quadtree_select(q1, 0, &p)");
+
+    // points in the middle of the cells of a grid, along with their Morton order
+    const uint64_t num_points = 500;
+    const float64_t cell = 1.0 / 256;
+    Point points[num_points];
+    MortonPoint sorted[num_points];
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++)
+            coords[j] = ((Marsaglia_rand() % (uint64_t)(s1 / cell)) + 0.5) * cell - s1 / 2;
+        points[i] = Point_from_array(coords);
+        MortonPoint_init(&sorted[i], q1, &points[i], i);
+        if (!add_point(q1, points[i]))
+            i--;
+    }
+    qsort(sorted, num_points, sizeof(*sorted), MortonPoint_compare);
+    Quadtree *q2 = Quadtree_bulk_load(points, num_points, s1, p1);
+
+    printf("\n---Quadtree_rank and Quadtree_select Points Test---\n");
+    bool ranked = true, selected = true, bulk_ranked = true, bulk_selected = true;
+    for (i = 0; i < num_points; i++) {
+        ranked &= Quadtree_rank(q1, sorted[i].point) == i;
+        selected &= Quadtree_select(q1, i, &p) && Point_equals(&p, &sorted[i].point);
+        bulk_ranked &= Quadtree_rank(q2, sorted[i].point) == i;
+        bulk_selected &= Quadtree_select(q2, i, &p) && Point_equals(&p, &sorted[i].point);
+    }
+    assertTrue(ranked, "Quadtree_rank(q1, sorted[i].point) == i");
+    assertTrue(selected, "Quadtree_select(q1, i, &p) == sorted[i].point");
+    assertTrue(bulk_ranked, "Quadtree_rank(q2, sorted[i].point) == i");
+    assertTrue(bulk_selected, "Quadtree_select(q2, i, &p) == sorted[i].point");
+    assertFalse(Quadtree_select(q1, num_points, &p), "Quadtree_select(q1, num_points, &p)");
+
+    printf("\n---Quadtree_rank Other Points Test---\n");
+    // points on the corners of the cells, none of which are in the tree
+    MortonPoint key;
+    ranked = true;
+    for (k = 0; k < 100; k++) {
+        for (j = 0; j < D; j++)
+            coords[j] = (Marsaglia_rand() % (uint64_t)(s1 / cell)) * cell - s1 / 2;
+        p = Point_from_array(coords);
+        MortonPoint_init(&key, q1, &p, 0);
+        for (i = 0; i < num_points && MortonPoint_compare(&sorted[i], &key) < 0; i++);
+        ranked &= Quadtree_rank(q1, p) == i;
+    }
+    assertTrue(ranked, "Quadtree_rank(q1, p) == points before p");
+    for (j = 0; j < D; j++) coords[j] = s1;
+    assertLong(0, Quadtree_rank(q1, Point_from_array(coords)), "Quadtree_rank(q1, outside)");
+
+    printf("\n---Quadtree_rank and Quadtree_select After Remove Test---\n");
+    // remove every fifth point in Morton order
+    bool removed[num_points];
+    uint64_t num_removed = 0;
+    for (i = 0; i < num_points; i++)
+        num_removed += removed[i] = i % 5 == 0 && Quadtree_remove(q1, sorted[i].point);
+    ranked = selected = true;
+    for (i = 0, k = 0; i < num_points; i++) {
+        ranked &= Quadtree_rank(q1, sorted[i].point) == k;
+        if (removed[i])
+            continue;
+        selected &= Quadtree_select(q1, k, &p) && Point_equals(&p, &sorted[i].point);
+        k++;
+    }
+    assertTrue(ranked, "Quadtree_rank(q1, sorted[i].point) == remaining points before it");
+    assertTrue(selected, "Quadtree_select(q1, k, &p) == k-th remaining point");
+    sprintf(buffer, "Quadtree_select(q1, %llu, &p)", (unsigned long long)(num_points - num_removed));
+    assertFalse(Quadtree_select(q1, num_points - num_removed, &p), buffer);
+
+    RLU_THREAD_FINISH(rlu_self);
+
+    Quadtree_free(q1);
+    Quadtree_free(q2);
+}
+#endif
+
+void* count_upsert(void * const value, const bool present, void * const ctx) {
+    (*(uint64_t*)ctx)++;
+    return (void*)((uintptr_t)value + 1);
+}
+
+void test_quadtree_values() {
+    register uint64_t i, j;
+
+    float64_t coords[D];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords);
+    Quadtree *q1 = Quadtree_init(s1, p1);
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    printf("\n---Quadtree_get Empty Tree Test---\n");
+    void *value = &value;
+    assertFalse(Quadtree_get(q1, p1, &value), "Quadtree_get(q1, p1, &value)");
+    assertTrue(value == &value, "value left unchanged");
+
+    // points in the middle of the cells of a grid
+    const uint64_t num_points = 500;
+    const float64_t cell = 1.0 / 256;
+    Point points[num_points];
+    uint64_t values[num_points];
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++)
+            coords[j] = ((Marsaglia_rand() % (uint64_t)(s1 / cell)) + 0.5) * cell - s1 / 2;
+        points[i] = Point_from_array(coords);
+        if (Quadtree_search(q1, points[i]))
+            i--;
+        else
+            Quadtree_put(q1, points[i], &values[i]);
+    }
+
+    printf("\n---Quadtree_put and Quadtree_get Test---\n");
+    bool found = true, matches = true;
+    for (i = 0; i < num_points; i++) {
+        found &= Quadtree_get(q1, points[i], &value);
+        matches &= value == &values[i];
+    }
+    assertTrue(found, "Quadtree_get(q1, points[i], &value)");
+    assertTrue(matches, "value == &values[i]");
+    assertTrue(Quadtree_get(q1, points[0], NULL), "Quadtree_get(q1, points[0], NULL)");
+
+    printf("\n---Quadtree_put Existing Points Test---\n");
+    // replacing the values adds no nodes
+    const uint64_t num_nodes = QUADTREE_NODE_COUNT;
+    bool stored = true;
+    for (i = 0; i < num_points; i++)
+        stored &= Quadtree_put(q1, points[i], &values[num_points - 1 - i]);
+    assertTrue(stored, "Quadtree_put(q1, points[i], &values[num_points - 1 - i])");
+    assertLong(num_nodes, QUADTREE_NODE_COUNT, "QUADTREE_NODE_COUNT");
+    matches = true;
+    for (i = 0; i < num_points; i++)
+        matches &= Quadtree_get(q1, points[i], &value) && value == &values[num_points - 1 - i];
+    assertTrue(matches, "value == &values[num_points - 1 - i]");
+    Point lo, hi;
+    for (j = 0; j < D; j++) {
+        lo.data[j] = -s1;
+        hi.data[j] = s1;
+    }
+    assertLong(num_points, Quadtree_range_query(q1, lo, hi, count_query_callback, NULL), "Quadtree_range_query(q1, lo, hi)");
+
+    printf("\n---Quadtree_upsert Test---\n");
+    uint64_t calls = 0;
+    for (j = 0; j < 3; j++)
+        Quadtree_upsert(q1, points[0], count_upsert, &calls);
+    for (j = 0; j < D; j++) coords[j] = 0.5 * cell;
+    Point p2 = Point_from_array(coords);
+    if (!Quadtree_search(q1, p2)) {
+        assertTrue(Quadtree_upsert(q1, p2, count_upsert, &calls), "Quadtree_upsert(q1, p2, ...)");
+        assertTrue(Quadtree_get(q1, p2, &value) && value == (void*)1, "value of p2 == 1");
+        Quadtree_remove(q1, p2);
+    }
+    assertTrue(calls >= 3, "update called");
+    assertTrue(Quadtree_get(q1, points[0], &value) &&
+        value == (void*)((uintptr_t)&values[num_points - 1] + 3), "value of points[0] updated 3 times");
+
+    printf("\n---Quadtree_put Other Points Test---\n");
+    // points added otherwise have no value
+    for (j = 0; j < D; j++) coords[j] = 1.5 * cell;
+    Point p3 = Point_from_array(coords);
+    if (!Quadtree_search(q1, p3)) {
+        Quadtree_add(q1, p3);
+        assertTrue(Quadtree_get(q1, p3, &value) && value == NULL, "value of an added point == NULL");
+    }
+    for (j = 0; j < D; j++) coords[j] = s1;
+    Point outside = Point_from_array(coords);
+    assertFalse(Quadtree_put(q1, outside, &values[0]), "Quadtree_put(q1, outside, &values[0])");
+    assertFalse(Quadtree_get(q1, outside, &value), "Quadtree_get(q1, outside, &value)");
+
+    printf("\n---Quadtree_get After Remove Test---\n");
+    // a removed point takes its value with it, and comes back with a new one
+    if (Quadtree_remove(q1, points[1])) {
+        assertFalse(Quadtree_get(q1, points[1], &value), "Quadtree_get(q1, points[1], &value)");
+        assertTrue(Quadtree_put(q1, points[1], &values[1]), "Quadtree_put(q1, points[1], &values[1])");
+        assertTrue(Quadtree_get(q1, points[1], &value) && value == &values[1], "value == &values[1]");
+    }
+
+    RLU_THREAD_FINISH(rlu_self);
+
+    Quadtree_free(q1);
+}
+
+void test_quadtree_multiset() {
+    register uint64_t i, j;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords), lo, hi;
+    Quadtree *q1 = Quadtree_init(s1, p1);
+    for (i = 0; i < D; i++) {
+        lo.data[i] = -s1;
+        hi.data[i] = s1;
+    }
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    // points in the middle of the cells of a grid, where point i is added i % 4 + 1 times,
+    // so that with MULTISET defined it has multiplicity i % 4 + 1, and 1 otherwise
+    const uint64_t num_points = 200;
+    const float64_t cell = 1.0 / 256;
+    Point points[num_points * 4];
+    uint64_t num_adds = 0;
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++)
+            coords[j] = ((Marsaglia_rand() % (uint64_t)(s1 / cell)) + 0.5) * cell - s1 / 2;
+        points[i] = Point_from_array(coords);
+        if (Quadtree_search(q1, points[i])) {
+            i--;
+            continue;
+        }
+        Quadtree_add(q1, points[i]);
+        for (j = 0; j < i % 4; j++)
+            points[num_points + num_adds++] = points[i];
+    }
+
+    printf("\n---Quadtree_add Repeated Points Test---\n");
+    // repeats add no nodes, and each succeeds only with MULTISET defined
+    const uint64_t num_nodes = QUADTREE_NODE_COUNT;
+    bool added = true;
+    for (i = 0; i < num_adds; i++)
+        added &= Quadtree_add(q1, points[num_points + i]) == COUNT_REPEATS;
+    assertTrue(added, "Quadtree_add(q1, repeated point) == COUNT_REPEATS");
+    assertLong(num_nodes, QUADTREE_NODE_COUNT, "QUADTREE_NODE_COUNT");
+    bool counted = true;
+    for (i = 0; i < num_points; i++)
+        counted &= Quadtree_multiplicity(q1, points[i]) == (COUNT_REPEATS ? i % 4 + 1 : 1);
+    assertTrue(counted, "Quadtree_multiplicity(q1, points[i])");
+    assertLong(num_points, Quadtree_range_query(q1, lo, hi, count_query_callback, NULL), "Quadtree_range_query(q1, lo, hi)");
+    for (j = 0; j < D; j++) coords[j] = s1;
+    assertLong(0, Quadtree_multiplicity(q1, Point_from_array(coords)), "Quadtree_multiplicity(q1, outside)");
+    #ifdef SUBTREE_COUNTS
+    // every copy counts, in range counts, ranks and aggregates alike
+    const uint64_t num_copies = num_points + (COUNT_REPEATS ? num_adds : 0);
+    assertLong(num_copies, Quadtree_range_count(q1, lo, hi), "Quadtree_range_count(q1, lo, hi)");
+    Point p;
+    counted = true;
+    for (i = 0; i < num_copies; i++) {
+        counted &= Quadtree_select(q1, i, &p);
+        register uint64_t rank = Quadtree_rank(q1, p);
+        counted &= rank <= i && i < rank + Quadtree_multiplicity(q1, p);
+    }
+    counted &= !Quadtree_select(q1, num_copies, &p);
+    assertTrue(counted, "Quadtree_rank(q1, p) <= k < rank + multiplicity for p = Quadtree_select(q1, k)");
+    #ifdef AGGREGATES
+    QuadtreeAggregate aggregate;
+    Quadtree_range_aggregate(q1, lo, hi, &aggregate);
+    assertTrue(abs(aggregate.weight - num_copies) < 1e-9, "weight of q1 == copies");
+    #endif
+    #endif
+
+    printf("\n---Quadtree_remove Repeated Points Test---\n");
+    // remove each point once; with MULTISET defined, only points added once go away
+    bool removed[num_points], found = true;
+    uint64_t remaining = 0;
+    for (i = 0; i < num_points; i++)
+        removed[i] = Quadtree_remove(q1, points[i]);
+    counted = true;
+    for (i = 0; i < num_points; i++) {
+        uint64_t expected = (COUNT_REPEATS ? i % 4 + 1 : 1) - removed[i];
+        counted &= Quadtree_multiplicity(q1, points[i]) == expected;
+        found &= Quadtree_search(q1, points[i]) == (expected > 0);
+        remaining += expected;
+    }
+    assertTrue(counted, "Quadtree_multiplicity(q1, points[i]) after remove");
+    assertTrue(found, "Quadtree_search(q1, points[i]) after remove");
+    #ifdef SUBTREE_COUNTS
+    assertLong(remaining, Quadtree_range_count(q1, lo, hi), "Quadtree_range_count(q1, lo, hi) after remove");
+    #ifdef AGGREGATES
+    Quadtree_range_aggregate(q1, lo, hi, &aggregate);
+    assertTrue(abs(aggregate.weight - remaining) < 1e-9, "weight of q1 == copies after remove");
+    #endif
+    #endif
+    assertLong(num_nodes, QUADTREE_NODE_COUNT, "QUADTREE_NODE_COUNT");
+
+    printf("\n---Quadtree_bulk_load and Quadtree_add_batch Repeated Points Test---\n");
+    Quadtree *q2 = Quadtree_bulk_load(points, num_points + num_adds, s1, p1);
+    Quadtree *q3 = Quadtree_init(s1, p1);
+    sprintf(buffer, "Quadtree_add_batch(q3, points)");
+    assertLong(COUNT_REPEATS ? num_points + num_adds : num_points,
+        Quadtree_add_batch(q3, points, num_points + num_adds, NULL), buffer);
+    counted = true;
+    for (i = 0; i < num_points; i++) {
+        counted &= Quadtree_multiplicity(q2, points[i]) == (COUNT_REPEATS ? i % 4 + 1 : 1);
+        counted &= Quadtree_multiplicity(q3, points[i]) == (COUNT_REPEATS ? i % 4 + 1 : 1);
+    }
+    assertTrue(counted, "Quadtree_multiplicity(q2 and q3, points[i])");
+    assertLong(num_points, Quadtree_range_query(q2, lo, hi, count_query_callback, NULL), "Quadtree_range_query(q2, lo, hi)");
+    assertLong(num_points, Quadtree_range_query(q3, lo, hi, count_query_callback, NULL), "Quadtree_range_query(q3, lo, hi)");
+    #ifdef SUBTREE_COUNTS
+    assertLong(num_copies, Quadtree_range_count(q2, lo, hi), "Quadtree_range_count(q2, lo, hi)");
+    assertLong(num_copies, Quadtree_range_count(q3, lo, hi), "Quadtree_range_count(q3, lo, hi)");
+    #endif
+
+    printf("\n---Quadtree_add_from Repeated Points Test---\n");
+    Node *finger = q2;
+    added = true;
+    for (i = 0; i < num_points; i++)
+        added &= Quadtree_add_from(&finger, points[i]) == COUNT_REPEATS;
+    assertTrue(added, "Quadtree_add_from(&finger, points[i]) == COUNT_REPEATS");
+    counted = true;
+    for (i = 0; i < num_points; i++)
+        counted &= Quadtree_multiplicity(q2, points[i]) == (COUNT_REPEATS ? i % 4 + 2 : 1);
+    assertTrue(counted, "Quadtree_multiplicity(q2, points[i]) after Quadtree_add_from");
+    #ifdef SUBTREE_COUNTS
+    assertLong(num_copies + (COUNT_REPEATS ? num_points : 0), Quadtree_range_count(q2, lo, hi),
+        "Quadtree_range_count(q2, lo, hi) after Quadtree_add_from");
+    #endif
+
+    RLU_THREAD_FINISH(rlu_self);
+
+    Quadtree_free(q1);
+    Quadtree_free(q2);
+    Quadtree_free(q3);
+}
+
+void test_quadtree_snapshot() {
+    register uint64_t i, j;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 1;
+    Point p1 = Point_from_array(coords), lo, hi, a, b;
+    for (i = 0; i < D; i++) {
+        lo.data[i] = -s1;
+        hi.data[i] = s1;
+    }
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    printf("\n---Quadtree_save and Quadtree_load Empty Tree Test---\n");
+    FILE *file = tmpfile();
+    int fd = fileno(file);
+    Quadtree *q1 = Quadtree_init(s1, p1);
+    assertTrue(Quadtree_save(q1, fd), "Quadtree_save(empty q1, fd)");
+    lseek(fd, 0, SEEK_SET);
+    Quadtree *q2 = Quadtree_load(fd);
+    assertTrue(q2 != NULL, "Quadtree_load(fd) != NULL");
+    assertLong(0, Quadtree_range_query(q2, lo, hi, count_query_callback, NULL), "Quadtree_range_query(q2, lo, hi)");
+    assertTrue(Quadtree_add(q2, p1), "Quadtree_add(q2, p1)");
+
+    // points in the middle of the cells of a grid, on either side of 0, and with MULTISET
+    // defined, every third one added twice
+    const uint64_t num_points = 1000;
+    const float64_t cell = 1.0 / 256;
+    Point points[num_points];
+    Quadtree_set_promotion(q1, 0.25);
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++)
+            coords[j] = ((Marsaglia_rand() % (uint64_t)(s1 / cell)) + 0.5) * cell - s1 / 2 + 1;
+        points[i] = Point_from_array(coords);
+        if (!add_point(q1, points[i]))
+            i--;
+        else if (COUNT_REPEATS && i % 3 == 0)
+            Quadtree_add(q1, points[i]);
+    }
+    Quadtree_put(q1, points[0], (void*)points);
+
+    printf("\n---Quadtree_save and Quadtree_load Round Trip Test---\n");
+    lseek(fd, 0, SEEK_SET);
+    assertTrue(Quadtree_save(q1, fd), "Quadtree_save(q1, fd)");
+    const off_t size = lseek(fd, 0, SEEK_CUR);
+    lseek(fd, 0, SEEK_SET);
+    Quadtree *q3 = Quadtree_load(fd);
+    assertTrue(q3 != NULL, "Quadtree_load(fd) != NULL");
+    assertLong(num_points, Quadtree_range_query(q3, lo, hi, count_query_callback, NULL), "Quadtree_range_query(q3, lo, hi)");
+
+    // the same points come back in the same order, on the same levels
+    QuadtreeCursor c1, c2;
+    Quadtree_cursor_init(&c1, q1, NULL);
+    Quadtree_cursor_init(&c2, q3, NULL);
+    bool same = true;
+    while (Quadtree_cursor_next(&c1, &a))
+        same &= Quadtree_cursor_next(&c2, &b) && Point_equals(&a, &b) &&
+            Quadtree_multiplicity(q1, a) == Quadtree_multiplicity(q3, b);
+    same &= !Quadtree_cursor_next(&c2, &b);
+    Quadtree_cursor_close(&c1);
+    Quadtree_cursor_close(&c2);
+    assertTrue(same, "points of q3 match q1");
+    #ifdef SUBTREE_COUNTS
+    assertLong(Quadtree_range_count(q1, lo, hi), Quadtree_range_count(q3, lo, hi), "Quadtree_range_count(q3, lo, hi)");
+    #endif
+    // levels are counted without RLU, so the writes of this thread are written back first
+    RLU_THREAD_FINISH(rlu_self);
+    const uint64_t max_levels = 64;
+    uint64_t sizes1[max_levels], sizes2[max_levels];
+    register uint64_t levels = count_levels(q1, sizes1, max_levels);
+    assertLong(levels, count_levels(q3, sizes2, max_levels), "levels of q3");
+    for (i = 0; i < levels; i++) {
+        sprintf(buffer, "points on level %llu of q3", (unsigned long long)i);
+        assertLong(sizes1[i], sizes2[i], buffer);
+    }
+    RLU_THREAD_INIT(rlu_self);
+
+    // values are not part of a snapshot
+    void *value = points;
+    assertTrue(Quadtree_get(q3, points[0], &value), "Quadtree_get(q3, points[0], &value)");
+    assertTrue(value == NULL, "value == NULL");
+
+    // the loaded tree can be changed like any other
+    assertTrue(Quadtree_remove(q3, points[1]), "Quadtree_remove(q3, points[1])");
+    assertLong(num_points - 1, Quadtree_range_query(q3, lo, hi, count_query_callback, NULL), "Quadtree_range_query(q3, lo, hi) after remove");
+
+    printf("\n---Quadtree_load Malformed Snapshot Test---\n");
+    // cut off partway through the points
+    ftruncate(fd, size / 2);
+    lseek(fd, 0, SEEK_SET);
+    errno = 0;
+    assertTrue(Quadtree_load(fd) == NULL, "Quadtree_load(truncated fd) == NULL");
+    assertLong(EINVAL, errno, "errno");
+    // not a snapshot at all
+    lseek(fd, 0, SEEK_SET);
+    write(fd, "not a quadtree", 14);
+    lseek(fd, 0, SEEK_SET);
+    errno = 0;
+    assertTrue(Quadtree_load(fd) == NULL, "Quadtree_load(garbage fd) == NULL");
+    assertLong(EINVAL, errno, "errno");
+    // a promotion probability of 1 or NaN, which would put points on endless levels
+    const float64_t promotions[] = {1, __builtin_nan("")};
+    for (i = 0; i < 2; i++) {
+        QuadtreeStream *stream = QuadtreeStream_new(fd);
+        lseek(fd, 0, SEEK_SET);
+        QuadtreeStream_put_header(stream, q1, promotions[i], 0);
+        QuadtreeStream_flush(stream);
+        free(stream);
+        lseek(fd, 0, SEEK_SET);
+        errno = 0;
+        sprintf(buffer, "Quadtree_load(promotion %lf fd) == NULL", promotions[i]);
+        assertTrue(Quadtree_load(fd) == NULL, buffer);
+        assertLong(EINVAL, errno, "errno");
+    }
+    // far more points than the snapshot holds, as many as would overflow the size of a
+    // buffer for them, or as would not fit in memory; either way, the snapshot ends first
+    const uint64_t counts[] = {UINT64_MAX, 1ULL << 40};
+    for (i = 0; i < 2; i++) {
+        QuadtreeStream *stream = QuadtreeStream_new(fd);
+        lseek(fd, 0, SEEK_SET);
+        QuadtreeStream_put_header(stream, q1, 0.5, counts[i]);
+        QuadtreeStream_flush(stream);
+        free(stream);
+        ftruncate(fd, lseek(fd, 0, SEEK_CUR));
+        lseek(fd, 0, SEEK_SET);
+        errno = 0;
+        sprintf(buffer, "Quadtree_load(%llu points fd) == NULL", (unsigned long long)counts[i]);
+        assertTrue(Quadtree_load(fd) == NULL, buffer);
+        assertLong(EINVAL, errno, "errno");
+    }
+
+    RLU_THREAD_FINISH(rlu_self);
+
+    fclose(file);
+    Quadtree_free(q1);
+    Quadtree_free(q2);
+    Quadtree_free(q3);
+}
+
+#ifdef AGGREGATES
+float64_t test_weight(const Point * const p, void * const ctx) {
+    return 1 + abs(p->data[0]) * *(float64_t*)ctx;
+}
+
+bool check_aggregate(const Quadtree * const q, const Point * const points, const bool * const present,
+        const uint64_t n, const Point * const lo, const Point * const hi, const float64_t scale) {
+    register uint64_t count = 0, i, j;
+    QuadtreeAggregate expected, actual;
+    QuadtreeAggregate_clear(&expected);
+    for (i = 0; i < n; i++)
+        if (present[i] && in_box(&points[i], lo, hi)) {
+            QuadtreeAggregate_add(&expected, &points[i], test_weight(&points[i], (void*)&scale));
+            count++;
+        }
+
+    if (Quadtree_range_aggregate(q, *lo, *hi, &actual) != count ||
+            abs(actual.weight - expected.weight) > 1e-6 * (1 + expected.weight))
+        return false;
+    for (j = 0; j < D; j++)
+        if (abs(actual.sum[j] - expected.sum[j]) > 1e-6 * (1 + abs(expected.sum[j])) ||
+                actual.lo.data[j] != expected.lo.data[j] || actual.hi.data[j] != expected.hi.data[j])
+            return false;
+    return true;
+}
+
+void test_quadtree_aggregate() {
+    register uint64_t i, j, k;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords);
+    Quadtree *q1 = Quadtree_init(s1, p1);
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    // points in the middle of the cells of a grid
+    const uint64_t num_points = 1000, num_removes = 100;
+    const float64_t cell = 1.0 / 256;
+    Point points[num_points];
+    bool present[num_points];
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++)
+            coords[j] = ((Marsaglia_rand() % (uint64_t)(s1 / cell)) + 0.5) * cell - s1 / 2;
+        points[i] = Point_from_array(coords);
+        if (!(present[i] = add_point(q1, points[i])))
+            i--;
+    }
+    Quadtree *q2 = Quadtree_bulk_load(points, num_points, s1, p1);
+
+    printf("\n---Quadtree_range_aggregate Unit Weight Test---\n");
+    float64_t scale = 0, centroid[D];
+    Point lo, hi;
+    for (i = 0; i < D; i++) {
+        lo.data[i] = -s1;
+        hi.data[i] = s1;
+    }
+    assertTrue(check_aggregate(q1, points, present, num_points, &lo, &hi, scale), "Quadtree_range_aggregate(q1, whole tree)");
+    QuadtreeAggregate aggregate;
+    Quadtree_range_aggregate(q1, lo, hi, &aggregate);
+    assertTrue(abs(aggregate.weight - num_points) < 1e-9, "weight of whole tree == points");
+    assertTrue(QuadtreeAggregate_centroid(&aggregate, centroid), "QuadtreeAggregate_centroid(&aggregate, centroid)");
+
+    printf("\n---Quadtree_range_aggregate Random Boxes Test---\n");
+    scale = 0.5;
+    Quadtree_set_weight(q1, test_weight, &scale);
+    Quadtree_set_weight(q2, test_weight, &scale);
+    bool matches = true, bulk_matches = true;
+    for (k = 0; k < 100; k++) {
+        for (i = 0; i < D; i++) {
+            float64_t a = (Marsaglia_random() - 0.5) * s1, b = (Marsaglia_random() - 0.5) * s1;
+            lo.data[i] = a < b ? a : b;
+            hi.data[i] = a < b ? b : a;
+        }
+        matches &= check_aggregate(q1, points, present, num_points, &lo, &hi, scale);
+        bulk_matches &= check_aggregate(q2, points, present, num_points, &lo, &hi, scale);
+    }
+    assertTrue(matches, "Quadtree_range_aggregate(q1, box) == aggregate of points in box");
+    assertTrue(bulk_matches, "Quadtree_range_aggregate(q2, box) == aggregate of points in box");
+
+    printf("\n---Quadtree_range_aggregate After Remove Test---\n");
+    for (i = 0; i < num_removes; i++)
+        present[i] = !Quadtree_remove(q1, points[i]);
+    matches = true;
+    for (k = 0; k < 100; k++) {
+        for (i = 0; i < D; i++) {
+            float64_t a = (Marsaglia_random() - 0.5) * s1, b = (Marsaglia_random() - 0.5) * s1;
+            lo.data[i] = a < b ? a : b;
+            hi.data[i] = a < b ? b : a;
+        }
+        matches &= check_aggregate(q1, points, present, num_points, &lo, &hi, scale);
+    }
+    assertTrue(matches, "Quadtree_range_aggregate(q1, box) == aggregate of points in box");
+
+    printf("\n---Quadtree_range_aggregate Empty Box Test---\n");
+    for (i = 0; i < D; i++) {
+        lo.data[i] = s1;
+        hi.data[i] = 2 * s1;
+    }
+    assertLong(0, Quadtree_range_aggregate(q1, lo, hi, &aggregate), "Quadtree_range_aggregate(q1, outside box)");
+    assertFalse(QuadtreeAggregate_centroid(&aggregate, centroid), "QuadtreeAggregate_centroid(&aggregate, centroid)");
+
+    RLU_THREAD_FINISH(rlu_self);
+
+    Quadtree_free(q1);
+    Quadtree_free(q2);
+}
+#endif
+
+#ifdef INTEGER_GRID
+void test_integer_grid() {
+    register uint64_t i, j;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    printf("\n---Point_from_array Rounding Test---\n");
+    for (i = 0; i < D; i++) coords[i] = (i - 1.75) / GRID_RESOLUTION;
+    Point p1 = Point_from_array(coords);
+    for (i = 0; i < D; i++) {
+        sprintf(buffer, "p1.data[%llu]", (unsigned long long)i);
+        assertLong((int64_t)i - 2, p1.data[i], buffer);
+    }
+    Point p2 = p1;
+    p2.data[D - 1]++;
+    assertFalse(Point_equals(&p1, &p2), "Point_equals(p1, p2)");
+
+    printf("\n---in_range Boundary Test---\n");
+    coord_t s1 = 16;
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Quadtree *q1 = Quadtree_init(s1, Point_from_array(coords));
+    for (i = 0; i < D; i++) p1.data[i] = -8;
+    assertTrue(in_range(q1, &p1), "in_range(q1, lower corner)");
+    for (i = 0; i < D; i++) p1.data[i] = 7;
+    assertTrue(in_range(q1, &p1), "in_range(q1, upper corner)");
+    p1.data[D - 1] = 8;
+    assertFalse(in_range(q1, &p1), "in_range(q1, past upper corner)");
+    p1.data[D - 1] = -9;
+    assertFalse(in_range(q1, &p1), "in_range(q1, past lower corner)");
+
+    printf("\n---get_split_square Adjacent Points Test---\n");
+    Point center;
+    coord_t length;
+    for (i = 0; i < D; i++) {
+        p1.data[i] = 2;
+        p2.data[i] = 3;
+    }
+    get_split_square(q1, &p1, &p2, &center, &length);
+    assertLong(2, length, "length");
+    for (i = 0; i < D; i++) p1.data[i] = 3;
+    assertPoint(p1, center, "center");
+    Quadtree_free(q1);
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    // random points with even coordinates, each followed by a neighbor one grid point away,
+    // which cannot be a duplicate
+    s1 = 1LL << 20;
+    for (i = 0; i < D; i++) coords[i] = 0;
+    q1 = Quadtree_init(s1, Point_from_array(coords));
+    const uint64_t num_points = 1000;
+    Point points[num_points];
+    for (i = 0; i < num_points; i++) {
+        if (i % 2 == 0)
+            for (j = 0; j < D; j++) points[i].data[j] = (coord_t)((Marsaglia_random() - 0.5) * s1) & ~1LL;
+        else {
+            points[i] = points[i - 1];
+            points[i].data[i / 2 % D] ^= 1;
+        }
+        if (!add_point(q1, points[i]))
+            i--;
+    }
+
+    printf("\n---Integer Grid Structure Test---\n");
+    const Node *level;
+    for (level = q1, i = 0; level != NULL; level = level->up, i++) {
+        sprintf(buffer, "valid_subtree(level %llu)", (unsigned long long)i);
+        assertTrue(valid_subtree(level), buffer);
+    }
+
+    printf("\n---Integer Grid Range Query Test---\n");
+    BoxQuery query;
+    for (i = 0; i < D; i++) {
+        query.lo.data[i] = points[0].data[i] - (s1 >> 2);
+        query.hi.data[i] = points[1].data[i];
+    }
+    uint64_t expected = 0;
+    for (i = 0; i < num_points; i++)
+        expected += in_box(points + i, &query.lo, &query.hi);
+    query.count = query.outside = 0;
+    assertLong(expected, Quadtree_range_query(q1, query.lo, query.hi, box_query_callback, &query),
+        "Quadtree_range_query(q1, box)");
+    assertLong(0, query.outside, "points outside box");
+
+    printf("\n---Integer Grid Snapshot Test---\n");
+    FILE *file = tmpfile();
+    assertTrue(Quadtree_save(q1, fileno(file)), "Quadtree_save(q1, fd)");
+    lseek(fileno(file), 0, SEEK_SET);
+    Quadtree *q2 = Quadtree_load(fileno(file));
+    assertTrue(q2 != NULL, "Quadtree_load(fd) != NULL");
+    bool found = true;
+    for (i = 0; i < num_points; i++)
+        found &= Quadtree_search(q2, points[i]);
+    assertTrue(found, "Quadtree_search(q2, points[i])");
+    Quadtree_free(q2);
+    fclose(file);
+
+    printf("\n---Integer Grid Remove Test---\n");
+    RLU_THREAD_FINISH(rlu_self);
+    // each remove in its own RLU thread, so that none of them has to wait on the writes
+    // of another
+    const uint64_t num_removes = 20;
+    for (i = 0; i < num_removes; i += 2) {
+        sprintf(buffer, "Quadtree_remove(q1, points[%llu])", (unsigned long long)i);
+        WRAP(assertTrue(Quadtree_remove(q1, points[i]), buffer));
+    }
+    RLU_THREAD_INIT(rlu_self);
+    for (i = 0; i < num_points; i++) {
+        sprintf(buffer, "Quadtree_search(q1, points[%llu])", (unsigned long long)i);
+        assertTrue(Quadtree_search(q1, points[i]) == (i >= num_removes || i % 2 == 1), buffer);
+    }
+    RLU_THREAD_FINISH(rlu_self);
+
+    Quadtree_free(q1);
+}
+#endif
+
+void test_arena() {
+    register uint64_t i;
+    char buffer[1000];
+
+    Arena arena;
+    Arena_init(&arena);
+
+    printf("\n---Arena_alloc Test---\n");
+    const uint64_t num_objects = 10000;
+    void *objects[num_objects];
+    bool aligned = true, owned = true;
+    for (i = 0; i < num_objects; i++) {
+        objects[i] = Arena_alloc(&arena, 8 + 8 * (i % 32));
+        aligned &= ((uintptr_t)objects[i] & (SLAB_ALIGNMENT - 1)) == 0;
+        owned &= Arena_of(objects[i]) == &arena;
+        memset(objects[i], 0xff, 8 + 8 * (i % 32));
+    }
+    assertTrue(aligned, "objects are aligned");
+    assertTrue(owned, "Arena_of(objects[i]) == &arena");
+    assertLong(num_objects, arena.count, "arena.count");
+
+    printf("\n---Arena_free Test---\n");
+    void *freed = objects[num_objects - 1];
+    Arena_free(freed, 8 + 8 * ((num_objects - 1) % 32));
+    assertLong(num_objects - 1, arena.count, "arena.count after Arena_free");
+    sprintf(buffer, "Arena_alloc(&arena, %llu) reuses freed object", (unsigned long long)(8 + 8 * ((num_objects - 1) % 32)));
+    assertTrue(Arena_alloc(&arena, 8 + 8 * ((num_objects - 1) % 32)) == freed, buffer);
+
+    printf("\n---Arena_destroy Test---\n");
+    assertTrue(Arena_destroy(&arena) > 0, "Arena_destroy(&arena)");
+    assertLong(0, arena.count, "arena.count after Arena_destroy");
+}
+
+/*
+ * Counts the nodes and the point nodes on every level of the tree with root node.
+ */
+void count_nodes(const Node * const node, uint64_t * const total, uint64_t * const leaf) {
+    register uint64_t i;
+    (*total)++;
+    *leaf += !node->is_square;
+    if (node->is_square)
+        for (i = 0; i < node->num_children; i++)
+            count_nodes(Node_children(node)[i], total, leaf);
+}
+
+void test_quadtree_free() {
+    register uint64_t i, j;
+
+    float64_t coords[D];
+
+    float64_t s1 = 16.0;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords);
+    Quadtree *q1 = Quadtree_init(s1, p1);
+
+    test_rand_off();
+
+    // a single RLU thread for the whole test, rather than one per operation
+    RLU_THREAD_INIT(rlu_self);
+
+    const uint64_t num_points = 500;
+    Point points[num_points];
+    for (i = 0; i < num_points; i++) {
+        for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() - 0.5) * s1;
+        points[i] = Point_from_array(coords);
+        if (!add_point(q1, points[i]))
+            i--;
+    }
+    for (i = 0; i < num_points; i += 5)
+        Quadtree_remove(q1, points[i]);
+
+    // also writes back any deferred updates
+    RLU_THREAD_FINISH(rlu_self);
+
+    uint64_t total = 0, leaf = 0, levels = 0;
+    const Node *level;
+    for (level = q1; level != NULL; level = level->up, levels++)
+        count_nodes(level, &total, &leaf);
+
+    printf("\n---Quadtree_free Result Test---\n");
+    QuadtreeFreeResult result = Quadtree_free(q1);
+    assertLong(total, result.total, "result.total");
+    assertLong(leaf, result.leaf, "result.leaf");
+    assertLong(levels, result.levels, "result.levels");
+}
+
+void test_performance() {
+    register uint64_t i, j;
+
+    float64_t coords[D];
+    char buffer[1000];
+
+    float64_t s1 = 1 << 16;  // size1; chose to use S instead of L
+    for (i = 0; i < D; i++) coords[i] = 0;
+    Point p1 = Point_from_array(coords);
+    Quadtree *q1 = Quadtree_init(s1, p1);
+
+    test_rand_off();
+
+    const uint64_t num_samples = 1L << 17;
+
+    float64_t time_samples[num_samples];
+    uint64_t total_cycles = 0;
+
+    for (i = 0; i < num_samples; i++) {
+        for (j = 0; j < D; j++) coords[j] = (Marsaglia_random() - 0.5) * s1;
+        Point p = Point_from_array(coords);
+        clock_t start = clock();
+        bool result = Quadtree_add(q1, p);
+        clock_t end = clock();
+        if (result) {
+            time_samples[i] = ((float64_t)(end - start)); // / CLOCKS_PER_SEC;
+            total_cycles += (end - start);
+        }
+        else
+            i--;
+    }
+
+    double time_samples_d1[num_samples - 1];  // first derivatives
+    for (i = 0; i < num_samples - 1; i++) {
+        time_samples_d1[i] = time_samples[i + 1] - time_samples[i];
+    }
+
+    printf("Total time for %llu inserts: %.8lf s\n", (unsigned long long)num_samples, total_cycles / (float64_t)CLOCKS_PER_SEC);
+
+    Quadtree_free(q1);
+}
+
+int main(int argc, char *argv[]) {
+    setbuf(stdout, 0);
+    mtrace();
+    Marsaglia_srand(time(NULL));
+    printf("[Beginning tests]\n");
+
+    // initialize RLU
+    RLU_INIT(RLU_TYPE_FINE_GRAINED, 8);
+    rlu_self = (rlu_thread_data_t*)malloc(sizeof(*rlu_self));
+    
+    start_test(test_sizes, "Struct sizes");
+#ifdef INTEGER_GRID
+    // the remaining tests use fractional coordinates, which collapse on the grid
+    start_test(test_integer_grid, "Integer grid");
+#else
+    start_test(test_in_range, "in_range");
+    start_test(test_get_quadrant, "get_quadrant");
     start_test(test_get_new_center, "get_new_center");
+    start_test(test_get_split_square, "get_split_square");
     start_test(test_quadtree_create, "Quadtree_init");
     start_test(test_quadtree_add, "Quadtree_add");
     start_test(test_quadtree_search, "Quadtree_search");
     start_test(test_quadtree_remove, "Quadtree_remove");
     start_test(test_randomized, "Randomized (in-environment)");
+    start_test(test_quadtree_random_operations, "Random operations");
+    start_test(test_quadtree_range_query, "Quadtree_range_query");
+    start_test(test_quadtree_knn, "Quadtree_knn");
+    start_test(test_quadtree_ann, "Quadtree_ann");
+    start_test(test_quadtree_radius_query, "Quadtree_radius_query");
+    start_test(test_quadtree_bulk_load, "Quadtree_bulk_load");
+    start_test(test_quadtree_add_batch, "Quadtree_add_batch");
+    start_test(test_quadtree_search_batch, "Quadtree_search_batch");
+    start_test(test_quadtree_build_index, "Quadtree_build_index");
+    start_test(test_quadtree_finger, "Quadtree_search_from and Quadtree_add_from");
+    start_test(test_quadtree_cursor, "Quadtree_cursor");
+    start_test(test_quadtree_promotion, "Quadtree_set_promotion");
+#ifdef SUBTREE_COUNTS
+    start_test(test_quadtree_range_count, "Quadtree_range_count");
+#endif
+#ifdef AGGREGATES
+    start_test(test_quadtree_aggregate, "Quadtree_range_aggregate");
+#endif
+#ifdef SUBTREE_COUNTS
+    start_test(test_quadtree_rank, "Quadtree_rank and Quadtree_select");
+#endif
+    start_test(test_quadtree_values, "Quadtree_put, Quadtree_get and Quadtree_upsert");
+    start_test(test_quadtree_multiset, "Quadtree_multiplicity");
+    start_test(test_quadtree_snapshot, "Quadtree_save and Quadtree_load");
+#endif
+    start_test(test_arena, "Arena");
+#ifndef INTEGER_GRID
+    start_test(test_quadtree_free, "Quadtree_free");
+#endif
     //start_test(test_performance, "Performance tests");
 
     // end RLU
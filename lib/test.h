@@ -8,6 +8,7 @@ Testing suite utilities header
 #include <omp.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include <assert.h>
@@ -55,6 +56,10 @@ void test_rand_close() {
     test_rand_trough.food = NULL;
 }
 
+bool test_rand_fed() {
+    return test_rand_trough.on && test_rand_trough.food != NULL;
+}
+
 int test_rand() {
     int next = rand();
     if (test_rand_trough.on) {
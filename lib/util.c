@@ -4,6 +4,7 @@ Some utility functions
 
 #include "./util.h"
 
+#include <assert.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -158,6 +159,198 @@ uint32_t* Marsaglia_parallel_get() {
     return NULL;
 }
 
+/*******************************
+** Min-heap
+*******************************/
+
+bool Heap_init(Heap * const heap, const uint64_t capacity) {
+    heap->entries = capacity > SIZE_MAX / sizeof(*heap->entries) ? NULL :
+        (HeapEntry*)malloc(sizeof(*heap->entries) * capacity);
+    heap->size = 0;
+    heap->capacity = heap->entries == NULL ? 0 : capacity;
+    return heap->entries != NULL;
+}
+
+bool Heap_push(Heap * const heap, const float64_t key, void * const value) {
+    if (heap->size == heap->capacity) {
+        register uint64_t capacity = heap->capacity == 0 ? 1 : 2 * heap->capacity;
+        HeapEntry *entries = capacity > SIZE_MAX / sizeof(*entries) ? NULL :
+            (HeapEntry*)realloc(heap->entries, sizeof(*entries) * capacity);
+        if (entries == NULL)
+            return false;
+        heap->entries = entries;
+        heap->capacity = capacity;
+    }
+
+    // sift up from the new leaf
+    register uint64_t i = heap->size++;
+    while (i > 0 && heap->entries[(i - 1) / 2].key > key) {
+        heap->entries[i] = heap->entries[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->entries[i] = (HeapEntry){ .key = key, .value = value };
+    return true;
+}
+
+HeapEntry Heap_pop(Heap * const heap) {
+    HeapEntry top = heap->entries[0], last = heap->entries[--heap->size];
+
+    // sift the last entry down from the root
+    register uint64_t i = 0, child;
+    while ((child = 2 * i + 1) < heap->size) {
+        if (child + 1 < heap->size && heap->entries[child + 1].key < heap->entries[child].key)
+            child++;
+        if (heap->entries[child].key >= last.key)
+            break;
+        heap->entries[i] = heap->entries[child];
+        i = child;
+    }
+    heap->entries[i] = last;
+
+    return top;
+}
+
+void Heap_free(Heap * const heap) {
+    free(heap->entries);
+    heap->entries = NULL;
+    heap->size = heap->capacity = 0;
+}
+
+/*******************************
+** Hash table
+*******************************/
+
+// stands in for a removed value, so that probing continues past its slot
+static char HashTable_removed;
+#define HASH_REMOVED ((void*)&HashTable_removed)
+
+bool HashTable_init(HashTable * const table, const uint64_t capacity) {
+    // at most half full
+    register uint64_t slots;
+    for (slots = 16; slots < 2 * capacity; slots *= 2);
+    HashEntry *entries = (HashEntry*)calloc(slots, sizeof(*entries));
+    if (entries == NULL)
+        return false;
+
+    table->entries = entries;
+    table->capacity = slots;
+    table->size = table->used = 0;
+    return true;
+}
+
+void HashTable_put(HashTable * const table, const uint64_t key, void * const value) {
+    // rebuild once three quarters of the slots are used, dropping removed values; if memory
+    // runs out, the current slots are used until a later rebuild succeeds
+    HashTable rebuilt;
+    if (4 * (table->used + 1) > 3 * table->capacity &&
+            HashTable_init(&rebuilt, table->size + 1)) {
+        register uint64_t i;
+        for (i = 0; i < table->capacity; i++)
+            if (table->entries[i].value != NULL && table->entries[i].value != HASH_REMOVED)
+                HashTable_put(&rebuilt, table->entries[i].key, table->entries[i].value);
+        free(table->entries);
+        *table = rebuilt;
+    }
+
+    register uint64_t mask = table->capacity - 1, i = key & mask;
+    while (table->entries[i].value != NULL)
+        i = (i + 1) & mask;
+    table->entries[i] = (HashEntry){ .key = key, .value = value };
+    table->size++;
+    table->used++;
+}
+
+void* HashTable_get(const HashTable * const table, const uint64_t key) {
+    register uint64_t mask = table->capacity - 1, i = key & mask;
+    for (; table->entries[i].value != NULL; i = (i + 1) & mask)
+        if (table->entries[i].key == key && table->entries[i].value != HASH_REMOVED)
+            return table->entries[i].value;
+    return NULL;
+}
+
+bool HashTable_remove(HashTable * const table, const uint64_t key, const void * const value) {
+    register uint64_t mask = table->capacity - 1, i = key & mask;
+    for (; table->entries[i].value != NULL; i = (i + 1) & mask)
+        if (table->entries[i].key == key && table->entries[i].value == value) {
+            table->entries[i].value = HASH_REMOVED;
+            table->size--;
+            return true;
+        }
+    return false;
+}
+
+void HashTable_free(HashTable * const table) {
+    free(table->entries);
+    table->entries = NULL;
+    table->capacity = table->size = table->used = 0;
+}
+
+/*******************************
+** Slab allocator
+*******************************/
+
+void Arena_init(Arena * const arena) {
+    arena->slabs = NULL;
+    register uint64_t i;
+    for (i = 0; i < SLAB_CLASSES; i++)
+        arena->classes[i] = (SlabClass){ .free = NULL, .next = NULL, .end = NULL };
+    arena->count = 0;
+}
+
+void* Arena_alloc(Arena * const arena, const uint64_t size) {
+    register uint64_t class_size = (size + SLAB_ALIGNMENT - 1) & -SLAB_ALIGNMENT;
+    assert(class_size > 0 && class_size <= SLAB_ALIGNMENT * SLAB_CLASSES);
+    SlabClass *class = arena->classes + class_size / SLAB_ALIGNMENT - 1;
+    void *object;
+
+    // reuse a freed object if there is one
+    if (class->free != NULL) {
+        object = class->free;
+        class->free = *(void**)object;
+        arena->count++;
+        return object;
+    }
+
+    // otherwise, bump the pointer, starting a new slab if this one is used up
+    if (class->next + class_size > class->end) {
+        Slab *slab;
+        if (posix_memalign((void**)&slab, SLAB_SIZE, SLAB_SIZE) != 0)
+            return NULL;
+        slab->arena = arena;
+        slab->next = arena->slabs;
+        arena->slabs = slab;
+        class->next = (char*)slab + ((sizeof(*slab) + SLAB_ALIGNMENT - 1) & -SLAB_ALIGNMENT);
+        class->end = (char*)slab + SLAB_SIZE;
+    }
+    object = class->next;
+    class->next += class_size;
+    arena->count++;
+    return object;
+}
+
+void Arena_free(void * const object, const uint64_t size) {
+    Arena *arena = Arena_of(object);
+    SlabClass *class = arena->classes + (size + SLAB_ALIGNMENT - 1) / SLAB_ALIGNMENT - 1;
+    *(void**)object = class->free;
+    class->free = object;
+    arena->count--;
+}
+
+Arena* Arena_of(const void * const object) {
+    return ((Slab*)((uintptr_t)object & -SLAB_SIZE))->arena;
+}
+
+uint64_t Arena_destroy(Arena * const arena) {
+    register uint64_t slabs = 0;
+    Slab *slab, *next;
+    for (slab = arena->slabs; slab != NULL; slab = next, slabs++) {
+        next = slab->next;
+        free(slab);
+    }
+    Arena_init(arena);
+    return slabs;
+}
+
 /*******************************
 ** pthread mutex attr
 *******************************/
@@ -101,6 +101,287 @@ uint32_t* Marsaglia_parallel_init(const uint64_t vid);
  */
 uint32_t* Marsaglia_parallel_get();
 
+/*******************************
+** Min-heap
+*******************************/
+
+/**
+ * struct HeapEntry_t
+ *
+ * An entry in a Heap.
+ *
+ * key - the priority of the entry; smaller keys come out first
+ * value - the payload of the entry
+ */
+typedef struct HeapEntry_t {
+    float64_t key;
+    void *value;
+} HeapEntry;
+
+/**
+ * struct Heap_t
+ *
+ * A binary min-heap of HeapEntry values that grows as needed.
+ *
+ * entries - the backing array, in heap order
+ * size - the number of entries in the heap
+ * capacity - the number of entries the backing array can hold
+ */
+typedef struct Heap_t {
+    HeapEntry *entries;
+    uint64_t size, capacity;
+} Heap;
+
+/**
+ * Heap_init
+ *
+ * Initializes an empty heap with room for capacity entries.
+ *
+ * heap - the heap to initialize
+ * capacity - the initial capacity; must be at least 1
+ *
+ * Returns whether the backing array could be allocated; if not, the heap is empty with
+ * no capacity, and can still be freed.
+ */
+bool Heap_init(Heap * const heap, const uint64_t capacity);
+
+/**
+ * Heap_push
+ *
+ * Adds value to the heap with the given key, doubling the backing array when it is full.
+ *
+ * heap - the heap to add to
+ * key - the priority of value
+ * value - the value to add
+ *
+ * Returns whether value was added, which is false only if the backing array could not
+ * grow; the heap is unchanged in that case.
+ */
+bool Heap_push(Heap * const heap, const float64_t key, void * const value);
+
+/**
+ * Heap_pop
+ *
+ * Removes and returns the entry with the smallest key. The heap must not be empty.
+ *
+ * heap - the heap to remove from
+ *
+ * Returns the removed entry.
+ */
+HeapEntry Heap_pop(Heap * const heap);
+
+/**
+ * Heap_free
+ *
+ * Deallocates the memory used by the heap's backing array.
+ *
+ * heap - the heap to free
+ */
+void Heap_free(Heap * const heap);
+
+/*******************************
+** Hash table
+*******************************/
+
+/**
+ * struct HashEntry_t
+ *
+ * A slot of a HashTable.
+ *
+ * key - the key of the entry
+ * value - the value of the entry; NULL if the slot has never been used
+ */
+typedef struct HashEntry_t {
+    uint64_t key;
+    void *value;
+} HashEntry;
+
+/**
+ * struct HashTable_t
+ *
+ * A hash table from 64-bit keys to non-NULL values, with open addressing and linear
+ * probing. Keys are used as hashes directly, so they should already be well mixed. A key
+ * may map to more than one value.
+ *
+ * entries - the slots of the table
+ * capacity - the number of slots, a power of two
+ * size - the number of values in the table
+ * used - the number of slots that are not empty, including those of removed values
+ */
+typedef struct HashTable_t {
+    HashEntry *entries;
+    uint64_t capacity, size, used;
+} HashTable;
+
+/**
+ * HashTable_init
+ *
+ * Initializes an empty hash table with room for about capacity values.
+ *
+ * table - the table to initialize
+ * capacity - the number of values to make room for
+ *
+ * Returns whether the slots could be allocated; if not, table is left untouched.
+ */
+bool HashTable_init(HashTable * const table, const uint64_t capacity);
+
+/**
+ * HashTable_put
+ *
+ * Adds a value under the given key, growing the table as needed. Values already under
+ * the key are kept.
+ *
+ * table - the table to add to
+ * key - the key of the value
+ * value - the value to add; must not be NULL
+ */
+void HashTable_put(HashTable * const table, const uint64_t key, void * const value);
+
+/**
+ * HashTable_get
+ *
+ * Looks up a value under the given key.
+ *
+ * table - the table to look in
+ * key - the key to look up
+ *
+ * Returns the first value found under key, or NULL if there is none.
+ */
+void* HashTable_get(const HashTable * const table, const uint64_t key);
+
+/**
+ * HashTable_remove
+ *
+ * Removes the given value from under the given key.
+ *
+ * table - the table to remove from
+ * key - the key of the value
+ * value - the value to remove
+ *
+ * Returns whether the value was found.
+ */
+bool HashTable_remove(HashTable * const table, const uint64_t key, const void * const value);
+
+/**
+ * HashTable_free
+ *
+ * Deallocates the memory used by the table's slots.
+ *
+ * table - the table to free
+ */
+void HashTable_free(HashTable * const table);
+
+/*******************************
+** Slab allocator
+*******************************/
+
+// size of a slab in bytes; slabs are also aligned to this, so that the slab holding an
+// object can be found from the object's address
+#define SLAB_SIZE (1LL << 16)
+
+// objects are grouped into size classes that are multiples of this many bytes
+#define SLAB_ALIGNMENT 16
+
+// number of size classes, making the largest object SLAB_ALIGNMENT * SLAB_CLASSES bytes,
+// enough for the children of a square with every quadrant filled up to 10 dimensions
+#define SLAB_CLASSES 512
+
+/**
+ * struct Slab_t
+ *
+ * The header at the start of every slab.
+ *
+ * arena - the arena the slab belongs to
+ * next - the next slab of the same arena
+ */
+typedef struct Slab_t {
+    struct Arena_t *arena;
+    struct Slab_t *next;
+} Slab;
+
+/**
+ * struct SlabClass_t
+ *
+ * The allocation state of a single size class.
+ *
+ * free - list of freed objects of this size class, linked through their first word
+ * next - the next unused byte of the slab being carved into objects of this size class
+ * end - the end of the slab being carved into objects of this size class
+ */
+typedef struct SlabClass_t {
+    void *free;
+    char *next, *end;
+} SlabClass;
+
+/**
+ * struct Arena_t
+ *
+ * A set of slabs that objects are allocated from, where each slab is carved into objects
+ * of a single size class. Freed objects are reused before any new memory is carved out,
+ * and all of an arena's memory is released at once by Arena_destroy.
+ *
+ * slabs - all slabs of the arena
+ * classes - the allocation state of each size class
+ * count - the number of objects currently allocated
+ */
+typedef struct Arena_t {
+    Slab *slabs;
+    SlabClass classes[SLAB_CLASSES];
+    uint64_t count;
+} Arena;
+
+/**
+ * Arena_init
+ *
+ * Initializes an empty arena. No memory is taken until the first allocation.
+ *
+ * arena - the arena to initialize
+ */
+void Arena_init(Arena * const arena);
+
+/**
+ * Arena_alloc
+ *
+ * Allocates an object of the given size from the arena, popping the free list of its
+ * size class if possible and carving it out of a slab otherwise. The object is aligned
+ * to SLAB_ALIGNMENT bytes.
+ *
+ * arena - the arena to allocate from
+ * size - the size of the object; at most SLAB_ALIGNMENT * SLAB_CLASSES bytes
+ *
+ * Returns a pointer to the object.
+ */
+void* Arena_alloc(Arena * const arena, const uint64_t size);
+
+/**
+ * Arena_free
+ *
+ * Returns an object to the free list of its size class in the arena it came from.
+ *
+ * object - the object to free
+ * size - the size the object was allocated with
+ */
+void Arena_free(void * const object, const uint64_t size);
+
+/**
+ * Arena_of
+ *
+ * Returns the arena that the given object was allocated from.
+ */
+Arena* Arena_of(const void * const object);
+
+/**
+ * Arena_destroy
+ *
+ * Releases all of the arena's slabs, and with them every object allocated from it, and
+ * leaves the arena empty. Does not free the Arena struct itself.
+ *
+ * arena - the arena to destroy
+ *
+ * Returns the number of slabs released.
+ */
+uint64_t Arena_destroy(Arena * const arena);
+
 /*******************************
 ** pthread mutex attr
 *******************************/